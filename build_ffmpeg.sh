@@ -41,7 +41,8 @@ $PROJECT_ROOT/ffmpeg-${FFMPEG_VERSION}/configure \
                      --enable-decoder=aac,h264,hevc \
                      --enable-parser=aac,h264,hevc \
                      --enable-demuxer=aac,flv,live_flv,h264,hevc \
-                     --enable-muxer=aac,flv,h264,hevc,mp4,m4v,mov \
+                     --enable-muxer=aac,adts,flv,h264,hevc,mp4,m4v,mov,mpegts \
+                     --enable-bsf=h264_mp4toannexb,hevc_mp4toannexb \
                      --enable-protocol=file,http,httpproxy,https,tls_openssl \
                      --enable-openssl \
                      --disable-securetransport \
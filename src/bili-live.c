@@ -1,7 +1,11 @@
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,9 +14,54 @@
 
 #include <libavutil/common.h>
 #include <libavutil/error.h>
+#include <libavutil/time.h>
 
 #include "bili-live.h"
+#include "chrome_trace.h"
 #include "remux.h"
+#include "stats_shm.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+static atomic_bool bili_stopping;
+
+static BILI_LIVE_ROOM **bili_rooms;
+static int bili_nb_rooms;
+
+static RemuxOptions bili_remux_options;
+
+/* Event loops receiving every stream, NULL for a thread per recording */
+static IngestEngine *bili_ingest;
+
+/* Stops every recording at once on SIGUSR1 */
+static RemuxCancel *bili_cancel;
+
+/* Drop packets resent by the CDN */
+static bool bili_dedupe;
+
+/* Seconds from SIGUSR1 until the files must be finalized */
+static int bili_shutdown_timeout = BILI_DEFAULT_SHUTDOWN_TIMEOUT;
+
+/* Prometheus text file rewritten with the metrics of the recordings */
+static const char *bili_metrics_path;
+
+/* Shared memory segment the state of the rooms is published to */
+static const char *bili_shm_name;
+
+/* Timeline of the startup of every recording, NULL unless -X */
+static ChromeTrace *bili_trace;
+
+/* Extensions of the extra copies written next to the MP4, e.g. "flv" */
+static const char *bili_extra_outputs[REMUX_MAX_OUTPUTS - 1];
+static int bili_nb_extra_outputs;
+
+/* Add the phase of the room that began at start to the trace, if any. */
+static void bili_trace_span(const BILI_LIVE_ROOM *room, const char *name, int64_t start) {
+    if (bili_trace) {
+        chrome_trace_span(bili_trace, name, "bili", room->room_id, start,
+                          av_gettime_relative());
+    }
+}
 
 static int bili_log(const char *tag, const bool update, const char *message, ...) {
     va_list args;
@@ -44,8 +93,46 @@ static int bili_log(const char *tag, const bool update, const char *message, ...
 
 static void print_usage(const char *argv0) {
     static const char *format =
-        "Usage: %s [-qh] [-o <quality option>] [-d <log path>] <room ID>\n"
+        "Usage: %s [-qFucUh] [-o <quality option>] [-d <log path>]"
+        " [-j <workers>] [-b <packets>] [-f <seconds>]"
+        " [-s <seconds>] [-S <MiB>] [-a <extension>] [-r <attempts>]"
+        " [-w <KiB>] [-p <MiB>] [-y <sync policy>] [-e <loops>] [-R <KiB>]"
+        " [-t <directory>] [-T <MiB>] [-D <packets>] [-W <seconds>] [-G <seconds>]"
+        " [-M <file>] [-P <name>] [-X <file>] <room ID> [<room ID> ...]\n"
         "\n-q:  fetch API only\n"
+        "-F:  start writing on the first keyframe without probing the stream\n"
+        "-j:  max concurrent recordings when several rooms are given"
+        " (default %d)\n"
+        "-b:  packets buffered between network and disk (default %d)\n"
+        "-f:  write fragmented MP4 with fragments of about this duration\n"
+        "-s:  start a new file on the next keyframe after this duration\n"
+        "-S:  start a new file on the next keyframe after this size\n"
+        "-a:  also write the stream to a file of this type (flv, ts),"
+        " may be repeated\n"
+        "-r:  reconnect attempts into the same file when the stream is lost"
+        " (default %d)\n"
+        "-w:  write files through a buffer of this size\n"
+        "-p:  with -w, reserve disk space in steps of this size\n"
+        "-y:  with -w, sync files to disk: none (default), periodic, close\n"
+        "-u:  with -w, write asynchronously through io_uring when available\n"
+        "-c:  read streams with libcurl, reusing connections and TLS sessions\n"
+        "-R:  read the stream ahead of the demuxer into a buffer of this size\n"
+        "-t:  spill packets to this directory while writing stalls\n"
+        "-T:  with -t, spill at most this much per file (default %d)\n"
+        "-D:  write FLV streams as they are interleaved, reordering them"
+        " within this many packets\n"
+        "-W:  reconnect once no packet arrived for this long\n"
+        "-G:  on SIGUSR1, give up on files not finalized after this long"
+        " (default %d)\n"
+        "-U:  drop packets the server sends twice\n"
+        "-M:  write the metrics of the recordings to this file in the Prometheus"
+        " text format every %d seconds\n"
+        "-P:  publish the state of the rooms to this shared memory object,"
+        " e.g. /bili-live, for bili-stats\n"
+        "-X:  write the startup phases of each recording to this file"
+        " in the Chrome trace format\n"
+        "-e:  receive all streams on this many event loops, 0 for one per CPU;"
+        " -j then only limits the recordings; implies -F\n"
         "-h:  print usage\n"
         "\nQuality options:\n"
         "%d    HEVC_PRIORITY (default)\n"
@@ -55,6 +142,12 @@ static void print_usage(const char *argv0) {
 
     fprintf(stderr, format,
             argv0,
+            BILI_DEFAULT_WORKERS,
+            REMUX_DEFAULT_RING_DEPTH,
+            BILI_DEFAULT_RECONNECTS,
+            (int)(REMUX_DEFAULT_SPILL_SIZE / (1024 * 1024)),
+            BILI_DEFAULT_SHUTDOWN_TIMEOUT,
+            BILI_METRICS_INTERVAL,
             HEVC_PRIORITY,
             AVC_PRIORITY,
             HEVC_ONLY,
@@ -101,6 +194,8 @@ BILI_LIVE_ROOM *bili_make_room(uint32_t room_id) {
     room->handle = bili_make_handle();
     room->referer = (char *)malloc(sizeof(char) * 4096);
     room->playurl_info = NULL;
+    atomic_init(&room->online, false);
+    room->poll_start = room->poll_end = 0;
 
     struct curl_slist *curl_headers = NULL;
     for (int i = 0; i < BILI_HTTP_HEADER_CNT; ++i) {
@@ -115,6 +210,12 @@ BILI_LIVE_ROOM *bili_make_room(uint32_t room_id) {
     sprintf(room->ffmpeg_headers, "%s\r\nReferer: %s\r\n",
                                   BILI_HTTP_FLV_HEADERS, room->referer);
 
+    pthread_mutex_init(&room->lock, NULL);
+    room->session = NULL;
+    room->stop_requested = false;
+    room->codec = NULL;
+    room->qn = 0;
+
     return room;
 }
 
@@ -128,6 +229,7 @@ cJSON *bili_fetch_api(const BILI_LIVE_ROOM *room, int qn) {
     curl_easy_setopt(handle, CURLOPT_WRITEDATA, (void *)&mem);
     curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, write_to_mem);
 
+    TRACE_PROBE(bili, api_fetch_start, room->room_id, qn);
     res = curl_easy_perform(handle);
     int retry = 5;
 
@@ -136,6 +238,7 @@ cJSON *bili_fetch_api(const BILI_LIVE_ROOM *room, int qn) {
         res = curl_easy_perform(handle);
         --retry;
     }
+    TRACE_PROBE(bili, api_fetch_end, room->room_id, qn, res, mem.size);
 
     cJSON *json = cJSON_Parse(mem.response);
 
@@ -163,17 +266,308 @@ void bili_free_room(BILI_LIVE_ROOM *room) {
     free(room->referer);
     free(room->ffmpeg_headers);
     cJSON_Delete(room->playurl_info);
+    pthread_mutex_destroy(&room->lock);
     free(room);
-    bili_log("INFO", false, "Exit safely. Bye~");
+}
+
+void bili_stop_room(BILI_LIVE_ROOM *room) {
+    pthread_mutex_lock(&room->lock);
+    room->stop_requested = true;
+    if (room->session) {
+        remux_session_stop(room->session);
+    }
+    pthread_mutex_unlock(&room->lock);
+}
+
+static void bili_report_unfinished(void *opaque, const char *filename) {
+    bili_log("ERROR", false, "Not finalized in time: %s", filename);
+}
+
+static void *bili_signal_thread(void *arg) {
+    sigset_t *sigset = arg;
+    int sig;
+
+    if (sigwait(sigset, &sig) == 0) {
+        int64_t deadline = av_gettime_relative() + (int64_t)bili_shutdown_timeout * AV_TIME_BASE;
+
+        bili_log("INFO", false, "Stop requested. Finishing recordings...");
+        atomic_store(&bili_stopping, true);
+        if (bili_cancel) {
+            remux_cancel_trigger(bili_cancel, deadline);
+        }
+        for (int i = 0; i < bili_nb_rooms; ++i) {
+            bili_stop_room(bili_rooms[i]);
+        }
+
+        /* every file is finalized concurrently, give up on the late ones */
+        int left = remux_finalizer_drain_until(deadline, bili_report_unfinished, NULL);
+        if (left > 0) {
+            bili_log("ERROR", false, "%d files not finalized within %d seconds. Exiting.",
+                                     left, bili_shutdown_timeout);
+            exit(1);
+        }
+    }
+
+    return NULL;
+}
+
+/* Sleep for up to `seconds`, waking up early on stop request. */
+static void bili_sleep(unsigned int seconds) {
+    while (seconds-- && !atomic_load(&bili_stopping)) {
+        sleep(1);
+    }
+}
+
+typedef struct {
+    uint32_t     room_id;
+    bool         recording;
+    RemuxMetrics metrics;
+} BILI_ROOM_METRICS;
+
+static void bili_metric_header(FILE *f, const char *name, const char *type,
+                               const char *help) {
+    fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/* Durations are kept in microseconds and exported in seconds */
+static void bili_print_histogram(FILE *f, const char *name, uint32_t room_id,
+                                 const HistogramSnapshot *h) {
+    int64_t count = 0;
+
+    for (int i = 0; i < HISTOGRAM_BUCKETS - 1; ++i) {
+        count += h->buckets[i];
+        fprintf(f, "%s_bucket{room=\"%u\",le=\"%g\"} %lld\n", name, room_id,
+                   histogram_bucket_limit(i) / 1e6, (long long)count);
+    }
+    count += h->buckets[HISTOGRAM_BUCKETS - 1];
+    fprintf(f, "%s_bucket{room=\"%u\",le=\"+Inf\"} %lld\n", name, room_id, (long long)count);
+    fprintf(f, "%s_sum{room=\"%u\"} %g\n", name, room_id, h->sum / 1e6);
+    fprintf(f, "%s_count{room=\"%u\"} %lld\n", name, room_id, (long long)count);
+}
+
+static void bili_print_metrics(FILE *f, const BILI_ROOM_METRICS *rooms, int nb_rooms) {
+    static const struct {
+        const char *name;
+        const char *help;
+        size_t     offset;
+    } stream_counters[] = {
+        { "bili_stream_packets_in_total", "Packets read from the stream.",
+          offsetof(RemuxStreamMetrics, packets_in) },
+        { "bili_stream_bytes_in_total", "Bytes read from the stream.",
+          offsetof(RemuxStreamMetrics, bytes_in) },
+        { "bili_stream_packets_out_total", "Packets of the stream written to files.",
+          offsetof(RemuxStreamMetrics, packets_out) },
+        { "bili_stream_bytes_out_total", "Bytes of the stream written to files.",
+          offsetof(RemuxStreamMetrics, bytes_out) },
+    };
+
+    bili_metric_header(f, "bili_recording", "gauge", "Whether the room is being recorded.");
+    for (int i = 0; i < nb_rooms; ++i) {
+        fprintf(f, "bili_recording{room=\"%u\"} %d\n", rooms[i].room_id, rooms[i].recording);
+    }
+
+    for (int c = 0; c < FF_ARRAY_ELEMS(stream_counters); ++c) {
+        bili_metric_header(f, stream_counters[c].name, "counter", stream_counters[c].help);
+        for (int i = 0; i < nb_rooms; ++i) {
+            const RemuxMetrics *m = &rooms[i].metrics;
+
+            for (int j = 0; j < m->nb_streams; ++j) {
+                const char *type = av_get_media_type_string(m->streams[j].type);
+                int64_t value = *(const int64_t *)((const uint8_t *)&m->streams[j] +
+                                                   stream_counters[c].offset);
+
+                fprintf(f, "%s{room=\"%u\",stream=\"%d\",type=\"%s\"} %lld\n",
+                           stream_counters[c].name, rooms[i].room_id, j,
+                           type ? type : "unknown", (long long)value);
+            }
+        }
+    }
+
+    bili_metric_header(f, "bili_read_latency_seconds", "histogram",
+                       "Time taken to read each packet from the stream.");
+    for (int i = 0; i < nb_rooms; ++i) {
+        if (rooms[i].recording) {
+            bili_print_histogram(f, "bili_read_latency_seconds", rooms[i].room_id,
+                                 &rooms[i].metrics.read_latency);
+        }
+    }
+
+    bili_metric_header(f, "bili_write_latency_seconds", "histogram",
+                       "Time taken by the muxer to write each packet.");
+    for (int i = 0; i < nb_rooms; ++i) {
+        if (rooms[i].recording) {
+            bili_print_histogram(f, "bili_write_latency_seconds", rooms[i].room_id,
+                                 &rooms[i].metrics.write_latency);
+        }
+    }
+
+    bili_metric_header(f, "bili_dts_repairs_total", "counter",
+                       "Packets whose timestamp was rewritten, by cause.");
+    for (int i = 0; i < nb_rooms; ++i) {
+        const RemuxMetrics *m = &rooms[i].metrics;
+
+        if (!rooms[i].recording) {
+            continue;
+        }
+        fprintf(f, "bili_dts_repairs_total{room=\"%u\",kind=\"jump\"} %lld\n",
+                   rooms[i].room_id, (long long)m->dts_jumps);
+        fprintf(f, "bili_dts_repairs_total{room=\"%u\",kind=\"backwards\"} %lld\n",
+                   rooms[i].room_id, (long long)m->dts_backwards);
+        fprintf(f, "bili_dts_repairs_total{room=\"%u\",kind=\"reconnect\"} %lld\n",
+                   rooms[i].room_id, (long long)m->dts_resumes);
+    }
+
+    bili_metric_header(f, "bili_queue_depth_packets", "gauge",
+                       "Packets waiting for the slowest output.");
+    for (int i = 0; i < nb_rooms; ++i) {
+        if (rooms[i].recording) {
+            fprintf(f, "bili_queue_depth_packets{room=\"%u\"} %d\n",
+                       rooms[i].room_id, rooms[i].metrics.queue_depth);
+        }
+    }
+
+    bili_metric_header(f, "bili_lag_seconds", "gauge",
+                       "How far the stream trails the wall clock since it started.");
+    for (int i = 0; i < nb_rooms; ++i) {
+        if (rooms[i].recording) {
+            fprintf(f, "bili_lag_seconds{room=\"%u\"} %g\n",
+                       rooms[i].room_id, rooms[i].metrics.lag / 1e6);
+        }
+    }
+
+    bili_metric_header(f, "bili_max_lag_seconds", "gauge",
+                       "Highest lag of the current recording.");
+    for (int i = 0; i < nb_rooms; ++i) {
+        if (rooms[i].recording) {
+            fprintf(f, "bili_max_lag_seconds{room=\"%u\"} %g\n",
+                       rooms[i].room_id, rooms[i].metrics.max_lag / 1e6);
+        }
+    }
+}
+
+/* Replace the metrics file at once, as node_exporter may read it anytime. */
+static void bili_write_metrics(const char *path) {
+    BILI_ROOM_METRICS *rooms = (BILI_ROOM_METRICS *)calloc(bili_nb_rooms, sizeof(*rooms));
+    char tmp_path[4096];
+
+    if (!rooms) {
+        return;
+    }
+
+    for (int i = 0; i < bili_nb_rooms; ++i) {
+        BILI_LIVE_ROOM *room = bili_rooms[i];
+
+        rooms[i].room_id = room->room_id;
+        pthread_mutex_lock(&room->lock);
+        if (room->session) {
+            remux_session_get_metrics(room->session, &rooms[i].metrics);
+            rooms[i].recording = true;
+        }
+        pthread_mutex_unlock(&room->lock);
+    }
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", path, (int)getpid());
+    FILE *f = fopen(tmp_path, "w");
+    if (!f) {
+        bili_log("WARN", false, "Cannot write metrics to %s", tmp_path);
+        free(rooms);
+        return;
+    }
+
+    bili_print_metrics(f, rooms, bili_nb_rooms);
+    free(rooms);
+
+    if (fclose(f) != 0 || rename(tmp_path, path) != 0) {
+        bili_log("WARN", false, "Cannot write metrics to %s", path);
+        remove(tmp_path);
+    }
+}
+
+/* Publish the state of every room, the only writer of the segment. */
+static void *bili_shm_thread(void *arg) {
+    StatsShm *shm = arg;
+    int64_t *last_bytes = (int64_t *)calloc(bili_nb_rooms, sizeof(*last_bytes));
+    int64_t last_time = 0;
+
+    if (!last_bytes) {
+        return NULL;
+    }
+
+    while (!atomic_load(&bili_stopping)) {
+        int64_t now = av_gettime_relative();
+        int64_t wall = av_gettime();
+
+        for (int i = 0; i < bili_nb_rooms; ++i) {
+            BILI_LIVE_ROOM *room = bili_rooms[i];
+            StatsShmRoomState state = { 0 };
+            RemuxMetrics metrics;
+            RemuxStats stats;
+            int64_t bytes_in = 0;
+
+            state.room_id = room->room_id;
+            state.online = atomic_load(&room->online);
+            state.update_time = wall;
+
+            pthread_mutex_lock(&room->lock);
+            if (room->session) {
+                remux_session_get_metrics(room->session, &metrics);
+                remux_session_get_stats(room->session, &stats);
+                state.recording = 1;
+                state.qn = room->qn;
+                snprintf(state.codec, sizeof(state.codec), "%s",
+                                      room->codec ? room->codec : "");
+            }
+            pthread_mutex_unlock(&room->lock);
+
+            if (state.recording) {
+                for (int j = 0; j < metrics.nb_streams; ++j) {
+                    bytes_in += metrics.streams[j].bytes_in;
+                    state.bytes_written += metrics.streams[j].bytes_out;
+                }
+                if (metrics.last_packet_time) {
+                    state.last_packet_time = wall - (now - metrics.last_packet_time);
+                }
+                state.nb_reconnects = stats.nb_reconnects;
+                /* the counters restart with each recording */
+                if (last_time && now > last_time && bytes_in >= last_bytes[i]) {
+                    state.bitrate = (bytes_in - last_bytes[i]) * 8 * AV_TIME_BASE /
+                                    (now - last_time);
+                }
+            }
+            last_bytes[i] = bytes_in;
+
+            stats_shm_publish(shm, i, &state);
+        }
+
+        last_time = now;
+        bili_sleep(BILI_SHM_INTERVAL);
+    }
+
+    free(last_bytes);
+    return NULL;
+}
+
+static void *bili_metrics_thread(void *arg) {
+    const char *path = arg;
+
+    while (!atomic_load(&bili_stopping)) {
+        bili_write_metrics(path);
+        bili_sleep(BILI_METRICS_INTERVAL);
+    }
+
+    return NULL;
 }
 
 int main(int argc, const char *argv[]) {
     curl_global_init(CURL_GLOBAL_ALL);
 
-    int ch, bili_qo = 0;
+    int ch, bili_qo = 0, nb_workers = BILI_DEFAULT_WORKERS, nb_loops = -1;
     bool qoption = false;
     char log_path[BUFSIZ] = { 0 };
-    while ((ch = getopt(argc, (char **)argv, "hqo:d:")) != -1) {
+    const char *trace_path = NULL;
+    remux_options_default(&bili_remux_options);
+    bili_remux_options.max_reconnects = BILI_DEFAULT_RECONNECTS;
+    while ((ch = getopt(argc, (char **)argv, "hqFucUo:d:j:b:f:s:S:a:r:w:p:y:e:R:t:T:D:W:G:M:P:X:")) != -1) {
         switch (ch) {
             case 'o':
                 bili_qo = atoi(optarg);
@@ -181,6 +575,45 @@ int main(int argc, const char *argv[]) {
             case 'q':
                 qoption = true;
                 break;
+            case 'F':
+                bili_remux_options.fast_start = 1;
+                break;
+            case 'u':
+                bili_remux_options.writer.io_uring = 1;
+                break;
+            case 'c':
+                bili_remux_options.curl_input = 1;
+                break;
+            case 'U':
+                bili_dedupe = true;
+                break;
+            case 'R':
+                bili_remux_options.read_ahead = atoi(optarg) * 1024;
+                break;
+            case 't':
+                bili_remux_options.spill_dir = optarg;
+                break;
+            case 'T':
+                bili_remux_options.spill_size = (int64_t)(atof(optarg) * 1024 * 1024);
+                break;
+            case 'D':
+                bili_remux_options.reorder_window = atoi(optarg);
+                break;
+            case 'W':
+                bili_remux_options.stall_timeout = (int64_t)(atof(optarg) * AV_TIME_BASE);
+                break;
+            case 'G':
+                bili_shutdown_timeout = atoi(optarg);
+                break;
+            case 'M':
+                bili_metrics_path = optarg;
+                break;
+            case 'P':
+                bili_shm_name = optarg;
+                break;
+            case 'X':
+                trace_path = optarg;
+                break;
             case 'd':
                 if (strlen(optarg) > BUFSIZ) {
                     bili_log("ERROR", false, "Log path too long");
@@ -188,6 +621,48 @@ int main(int argc, const char *argv[]) {
                 }
                 strncpy(log_path, optarg, BUFSIZ);
                 break;
+            case 'j':
+                nb_workers = atoi(optarg);
+                break;
+            case 'b':
+                bili_remux_options.ring_depth = atoi(optarg);
+                break;
+            case 'f':
+                bili_remux_options.frag_duration = (int64_t)(atof(optarg) * AV_TIME_BASE);
+                break;
+            case 's':
+                bili_remux_options.segment_duration = (int64_t)(atof(optarg) * AV_TIME_BASE);
+                break;
+            case 'S':
+                bili_remux_options.segment_size = (int64_t)(atof(optarg) * 1024 * 1024);
+                break;
+            case 'a':
+                if (bili_nb_extra_outputs >= FF_ARRAY_ELEMS(bili_extra_outputs)) {
+                    bili_log("ERROR", false, "Too many outputs");
+                    return 1;
+                }
+                bili_extra_outputs[bili_nb_extra_outputs++] = optarg;
+                break;
+            case 'r':
+                bili_remux_options.max_reconnects = atoi(optarg);
+                break;
+            case 'w':
+                bili_remux_options.writer.buffer_size = atoi(optarg) * 1024;
+                break;
+            case 'p':
+                bili_remux_options.writer.prealloc_size = (int64_t)(atof(optarg) * 1024 * 1024);
+                break;
+            case 'y':
+                bili_remux_options.writer.sync = file_writer_parse_sync(optarg);
+                break;
+            case 'e':
+                nb_loops = atoi(optarg);
+                if (nb_loops < 0) {
+                    bili_log("WARN", false, "Number of event loops not valid");
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
             case 'h':
             default:
                 print_usage(argv[0]);
@@ -201,6 +676,74 @@ int main(int argc, const char *argv[]) {
         return 1;
     }
 
+    if (nb_workers <= 0) {
+        bili_log("WARN", false, "Number of workers not valid");
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if (bili_remux_options.writer.buffer_size < 0 ||
+        bili_remux_options.writer.prealloc_size < 0 ||
+        (int)bili_remux_options.writer.sync < 0) {
+        bili_log("WARN", false, "Write options not valid");
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if (bili_remux_options.read_ahead < 0) {
+        bili_log("WARN", false, "Read-ahead size not valid");
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if (bili_remux_options.spill_size <= 0) {
+        bili_log("WARN", false, "Spill size not valid");
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if (bili_remux_options.reorder_window < 0) {
+        bili_log("WARN", false, "Reorder window not valid");
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if (bili_remux_options.stall_timeout < 0) {
+        bili_log("WARN", false, "Stall timeout not valid");
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if (bili_shutdown_timeout <= 0) {
+        bili_log("WARN", false, "Shutdown timeout not valid");
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if (bili_remux_options.max_reconnects < 0) {
+        bili_log("WARN", false, "Reconnect attempts not valid");
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if (bili_remux_options.ring_depth <= 0) {
+        bili_log("WARN", false, "Buffer size not valid");
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if (bili_remux_options.frag_duration < 0) {
+        bili_log("WARN", false, "Fragment duration not valid");
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if (bili_remux_options.segment_duration < 0 || bili_remux_options.segment_size < 0) {
+        bili_log("WARN", false, "Segment limit not valid");
+        print_usage(argv[0]);
+        return 1;
+    }
+
     if (argc - optind <= 0) {
         bili_log("WARN", false, "Room ID not provided");
         print_usage(argv[0]);
@@ -213,150 +756,650 @@ int main(int argc, const char *argv[]) {
         putenv(log_env);
     }
 
-    uint32_t room_id;
-    room_id = strtol(argv[optind], NULL, 10);
-    BILI_LIVE_ROOM *room = bili_make_room(room_id);
+    bili_nb_rooms = argc - optind;
+    bili_rooms = (BILI_LIVE_ROOM **)calloc(bili_nb_rooms, sizeof(*bili_rooms));
+    for (int i = 0; i < bili_nb_rooms; ++i) {
+        uint32_t room_id = strtol(argv[optind + i], NULL, 10);
+        bili_rooms[i] = bili_make_room(room_id);
+    }
+    BILI_LIVE_ROOM *room = bili_rooms[0];
 
     if (qoption) {
         printf("%s\n", cJSON_Print(bili_fetch_api(room, 0)));
-        bili_free_room(room);
+        for (int i = 0; i < bili_nb_rooms; ++i) {
+            bili_free_room(bili_rooms[i]);
+        }
+        free(bili_rooms);
         curl_global_cleanup();
         return 0;
     }
 
-    (void)signal(SIGCHLD, SIG_IGN);
-    int ret, retry = 5;
-    while (1) {
-        if (bili_update_room(room)) {
-            ret = bili_download_stream(room, bili_qo);
-            if (ret == AVERROR_EXIT) {
-                break;
-            }
-            if (ret < 0) {
-                --retry;
-                if (retry <= 0) {
-                    retry = 10;
-                    sleep(10);
+    bili_cancel = remux_cancel_alloc();
+    bili_remux_options.cancel = bili_cancel;
+
+    if (trace_path) {
+        bili_trace = chrome_trace_open(trace_path);
+        if (!bili_trace) {
+            bili_log("WARN", false, "Cannot write trace to %s: %s",
+                                    trace_path, strerror(errno));
+        }
+        for (int i = 0; bili_trace && i < bili_nb_rooms; ++i) {
+            char name[32];
+            snprintf(name, sizeof(name), "room %u", bili_rooms[i]->room_id);
+            chrome_trace_track_name(bili_trace, bili_rooms[i]->room_id, name);
+        }
+    }
+
+    /* at shutdown, the last file of every recording is finalized at once */
+    if (bili_nb_rooms > 1) {
+        remux_finalizer_configure(FFMIN(nb_workers, bili_nb_rooms));
+    }
+
+    /* SIGUSR1 is handled by a dedicated thread, blocked everywhere else */
+    static sigset_t stop_sigset;
+    pthread_t signal_thread;
+    sigemptyset(&stop_sigset);
+    sigaddset(&stop_sigset, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &stop_sigset, NULL);
+    pthread_create(&signal_thread, NULL, bili_signal_thread, &stop_sigset);
+    pthread_detach(signal_thread);
+
+    pthread_t metrics_thread;
+    bool metrics_started = false;
+    if (bili_metrics_path) {
+        metrics_started = pthread_create(&metrics_thread, NULL, bili_metrics_thread,
+                                         (void *)bili_metrics_path) == 0;
+        if (!metrics_started) {
+            bili_log("WARN", false, "Cannot start writing metrics");
+        }
+    }
+
+    StatsShm *shm = NULL;
+    pthread_t shm_thread;
+    if (bili_shm_name) {
+        shm = stats_shm_create(bili_shm_name, bili_nb_rooms);
+        if (!shm) {
+            bili_log("WARN", false, "Cannot create shared memory %s: %s",
+                                    bili_shm_name, strerror(errno));
+        } else if (pthread_create(&shm_thread, NULL, bili_shm_thread, shm) != 0) {
+            bili_log("WARN", false, "Cannot start publishing to %s", bili_shm_name);
+            stats_shm_close(&shm);
+        }
+    }
+
+    if (nb_loops >= 0) {
+        bili_ingest = ingest_engine_create(nb_loops);
+        if (!bili_ingest) {
+            bili_log("WARN", false, "Cannot start event loops, using a thread per recording");
+        }
+        bili_remux_options.ingest = bili_ingest;
+        /* probing without fast start would block the engine's workers */
+        if (bili_ingest) {
+            bili_remux_options.fast_start = 1;
+        }
+    }
+
+    if (bili_nb_rooms > 1) {
+        bili_run_rooms(bili_rooms, bili_nb_rooms, bili_qo, nb_workers);
+    } else {
+        int ret, retry = 5;
+        while (!atomic_load(&bili_stopping)) {
+            if (bili_update_room(room)) {
+                ret = bili_download_stream(room, bili_qo);
+                if (ret == AVERROR_EXIT) {
+                    break;
                 }
+                if (ret < 0) {
+                    --retry;
+                    if (retry <= 0) {
+                        retry = 10;
+                        bili_sleep(10);
+                    }
+                }
+            } else {
+                bili_log("INFO", true, "%u - Offline. Waiting...", room->room_id);
+                bili_sleep(30);
             }
-        } else {
-            bili_log("INFO", true, "%u - Offline. Waiting...", room->room_id);
-            sleep(30);
         }
     }
 
-    bili_free_room(room);
+    if (remux_finalizer_pending() > 0) {
+        bili_log("INFO", false, "Waiting for %d files to be finalized", remux_finalizer_pending());
+    }
+    remux_finalizer_drain();
+    atomic_store(&bili_stopping, true);
+    if (metrics_started) {
+        pthread_join(metrics_thread, NULL);
+    }
+    if (shm) {
+        pthread_join(shm_thread, NULL);
+        stats_shm_close(&shm);
+    }
+    ingest_engine_free(&bili_ingest);
+    chrome_trace_close(&bili_trace);
+    bili_remux_options.cancel = NULL;
+    remux_cancel_free(&bili_cancel);
+
+    for (int i = 0; i < bili_nb_rooms; ++i) {
+        bili_free_room(bili_rooms[i]);
+    }
+    free(bili_rooms);
+    bili_log("INFO", false, "Exit safely. Bye~");
     curl_global_cleanup();
     return 0;
 }
 
+static void bili_record_task(void *arg) {
+    BILI_ROOM_TASK *task = (BILI_ROOM_TASK *)arg;
+
+    task->ret = bili_download_stream(task->room, task->qn_option);
+    atomic_store(&task->busy, false);
+}
+
+int bili_run_rooms(BILI_LIVE_ROOM **rooms, int nb_rooms,
+                   BILI_QUALITY_OPTION qn_option, int nb_workers) {
+    BILI_ROOM_TASK *tasks = (BILI_ROOM_TASK *)calloc(nb_rooms, sizeof(*tasks));
+    ThreadPool *pool = thread_pool_create(FFMIN(nb_workers, nb_rooms));
+    int active = 0;
+
+    if (!tasks || !pool) {
+        bili_log("ERROR", false, "Cannot start worker pool.");
+        free(tasks);
+        thread_pool_free(&pool);
+        return AVERROR(ENOMEM);
+    }
+
+    for (int i = 0; i < nb_rooms; ++i) {
+        tasks[i].room = rooms[i];
+        tasks[i].qn_option = qn_option;
+        tasks[i].retry = 5;
+        atomic_init(&tasks[i].busy, false);
+    }
+
+    bili_log("INFO", false, "Watching %d rooms with %d workers",
+                            nb_rooms, FFMIN(nb_workers, nb_rooms));
+
+    /*
+     * Offline rooms are polled from this thread only. A worker is taken
+     * from the pool when a room goes live and given back when its
+     * recording ends.
+     */
+    while (!atomic_load(&bili_stopping)) {
+        time_t now = time(NULL);
+
+        for (int i = 0; i < nb_rooms && !atomic_load(&bili_stopping); ++i) {
+            BILI_ROOM_TASK *task = &tasks[i];
+
+            if (atomic_load(&task->busy)) {
+                continue;
+            }
+
+            if (bili_ingest && task->ran) {
+                if (!bili_recording_done(task->room)) {
+                    continue;
+                }
+                task->ret = bili_finish_recording(task->room, task->ret);
+            }
+
+            if (task->ran) {
+                task->ran = false;
+                --active;
+                if (task->ret < 0 && task->ret != AVERROR_EXIT) {
+                    --task->retry;
+                    if (task->retry <= 0) {
+                        task->retry = 10;
+                        task->next_check = now + 10;
+                    }
+                }
+            }
+
+            if (now < task->next_check || active >= nb_workers) {
+                continue;
+            }
+
+            if (bili_update_room(task->room)) {
+                task->online = true;
+                task->ran = true;
+                if (bili_ingest) {
+                    /* the session runs on the event loops, nothing to wait for */
+                    task->ret = bili_start_recording(task->room, task->qn_option);
+                    ++active;
+                    continue;
+                }
+                atomic_store(&task->busy, true);
+                if (thread_pool_submit(pool, bili_record_task, task) < 0) {
+                    bili_log("ERROR", false, "%u - Cannot schedule recording",
+                                             task->room->room_id);
+                    atomic_store(&task->busy, false);
+                    task->ran = false;
+                    task->next_check = now + 10;
+                    continue;
+                }
+                ++active;
+            } else {
+                if (task->online || !task->next_check) {
+                    bili_log("INFO", false, "%u - Offline. Waiting...",
+                                            task->room->room_id);
+                }
+                task->online = false;
+                task->next_check = now + 30;
+            }
+        }
+
+        sleep(1);
+    }
+
+    for (int i = 0; i < nb_rooms; ++i) {
+        bili_stop_room(rooms[i]);
+    }
+    thread_pool_free(&pool);
+    for (int i = 0; i < nb_rooms; ++i) {
+        if (bili_ingest && tasks[i].ran) {
+            bili_finish_recording(rooms[i], tasks[i].ret);
+        }
+    }
+    free(tasks);
+
+    return 0;
+}
+
 bool bili_update_room(BILI_LIVE_ROOM *room) {
+    /* traced by bili_start_recording(), most polls find nothing new */
+    room->poll_start = av_gettime_relative();
+
     cJSON_Delete(room->playurl_info);
     room->playurl_info = bili_fetch_api(room, 0);
+    room->poll_end = av_gettime_relative();
 
-    return room->playurl_info && !cJSON_IsNull(room->playurl_info);
+    bool online = room->playurl_info && !cJSON_IsNull(room->playurl_info);
+    atomic_store(&room->online, online);
+    return online;
 }
 
-int bili_download_stream(BILI_LIVE_ROOM *room, BILI_QUALITY_OPTION qn_option) {
+extern char **environ;
+
+/* A running ffmpeg transcode, reaped by its own detached thread */
+typedef struct {
+    pid_t pid;
+    char  *filename;
+} BILI_TRANSCODE;
+
+static void *bili_transcode_wait(void *arg) {
+    BILI_TRANSCODE *job = (BILI_TRANSCODE *)arg;
+    int status;
+
+    while (waitpid(job->pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            bili_log("ERROR", false, "Cannot wait for ffmpeg: %s", strerror(errno));
+            goto end;
+        }
+    }
+
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        bili_log("INFO", false, "Transcoding done. Removing %s", job->filename);
+        if (remove(job->filename)) {
+            bili_log("ERROR", false, "Cannot delete %s", job->filename);
+        }
+    } else if (WIFEXITED(status) && WEXITSTATUS(status) == 127) {
+        bili_log("ERROR", false, "FFmpeg not found.");
+    } else {
+        bili_log("ERROR", false, "Transcode failed.");
+    }
+
+end:
+    free(job->filename);
+    free(job);
+    return NULL;
+}
+
+/*
+ * Transcode a finished AVC recording to HEVC with an ffmpeg child process.
+ * This runs on the worker threads, so the child is started with
+ * posix_spawnp rather than fork, and waited for on a detached thread.
+ */
+static void bili_transcode_to_hevc(const char *filename) {
+    size_t len = strlen(filename);
+    char new_filename[4096];
+
+    if (len >= 4 && !strcmp(filename + len - 4, ".mp4")) {
+        len -= 4;
+    }
+    if (snprintf(new_filename, sizeof(new_filename), "%.*s-hevc.mp4",
+                 (int)len, filename) >= (int)sizeof(new_filename)) {
+        bili_log("ERROR", false, "File name too long: %s", filename);
+        return;
+    }
+
+    char *const argv[] = {
+        "ffmpeg",
+        "-nostdin",
+        "-loglevel", "quiet",
+        "-i", (char *)filename,
+        "-c:v", "libx265",
+        "-x265-params", "log-level=none",
+        "-pix_fmt", "yuv420p10le",
+        "-tag:v", "hvc1",
+        "-max_muxing_queue_size", "4096",
+        "-c:a", "copy",
+        new_filename,
+        NULL
+    };
+
+    BILI_TRANSCODE *job = (BILI_TRANSCODE *)calloc(1, sizeof(*job));
+    if (!job || !(job->filename = strdup(filename))) {
+        bili_log("ERROR", false, "Cannot transcode %s: out of memory", filename);
+        free(job);
+        return;
+    }
+
+    /* the child must not inherit the SIGUSR1 mask of this thread */
+    posix_spawnattr_t attr;
+    sigset_t sigmask;
+    sigemptyset(&sigmask);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &sigmask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+    bili_log("INFO", false, "Transcoding to %s", new_filename);
+    int ret = posix_spawnp(&job->pid, "ffmpeg", NULL, &attr, argv, environ);
+    posix_spawnattr_destroy(&attr);
+    if (ret) {
+        bili_log("ERROR", false, "Cannot start ffmpeg: %s", strerror(ret));
+        free(job->filename);
+        free(job);
+        return;
+    }
+
+    pthread_t waiter;
+    if (pthread_create(&waiter, NULL, bili_transcode_wait, job)) {
+        /* wait here rather than leave a zombie behind */
+        bili_transcode_wait(job);
+        return;
+    }
+    pthread_detach(waiter);
+}
+
+/* One recording of a room, passed to the remux callbacks and freed by the
+   session once its last file is finalized */
+typedef struct {
+    BILI_LIVE_ROOM    *room;
     BILI_STREAM_CODEC codec;
-    int qn;
+    int               qn;
+    bool              transcode_to_hevc;
+    int64_t           start;    /* of the poll which found the room live */
+} BILI_RECORDING;
+
+static void bili_output_closed(void *opaque, const char *filename) {
+    const BILI_RECORDING *rec = (const BILI_RECORDING *)opaque;
+    const char *ext = strrchr(filename, '.');
+
+    bili_log("INFO", false, "Saved %s", filename);
+
+    if (rec->transcode_to_hevc && ext && !strcmp(ext, ".mp4")) {
+        bili_transcode_to_hevc(filename);
+    }
+}
+
+static void bili_phase_done(void *opaque, const char *phase, int64_t start, int64_t end) {
+    const BILI_RECORDING *rec = (const BILI_RECORDING *)opaque;
+
+    chrome_trace_span(bili_trace, phase, "remux", rec->room->room_id, start, end);
+
+    /* the parent of every phase, its length is the time to first byte */
+    if (!strcmp(phase, "first_packet_write")) {
+        chrome_trace_span(bili_trace, "recording_start", "bili", rec->room->room_id,
+                          rec->start, end);
+    }
+}
+
+/* Fetch a fresh stream URL when the session lost the CDN connection. */
+static int bili_reconnect_url(void *opaque, char *url, int size) {
+    const BILI_RECORDING *rec = (const BILI_RECORDING *)opaque;
+
+    if (atomic_load(&bili_stopping) || !bili_update_room(rec->room)) {
+        bili_log("INFO", false, "%u - Stream ended", rec->room->room_id);
+        return -1;
+    }
+
+    char *new_url = bili_get_stream_url(rec->room, rec->codec, rec->qn);
+    if (!new_url) {
+        bili_log("WARN", false, "%u - Stream %s not available anymore",
+                                rec->room->room_id, BILI_CODEC_STR(rec->codec));
+        return -1;
+    }
+
+    bili_log("INFO", false, "%u - Reconnecting", rec->room->room_id);
+    snprintf(url, size, "%s", new_url);
+    free(new_url);
+
+    return 0;
+}
+
+/* Start remuxing the stream on a session that bili_stop_room() can interrupt.
+   Once started, the session is left in room->session for
+   bili_finish_recording(). */
+static int bili_record(BILI_RECORDING *rec, const char *url, const char *filename) {
+    BILI_LIVE_ROOM *room = rec->room;
+    RemuxOptions options = bili_remux_options;
     int ret;
-    bool transcode_to_hevc = false;
 
-    bili_find_codec_qn(&codec, &qn, room->playurl_info, qn_option);
+    options.async_finalize = 1;
+    options.output_closed = bili_output_closed;
+    options.reconnect_url = bili_reconnect_url;
+    options.phase_done = bili_trace ? bili_phase_done : NULL;
+    options.release = free;
+    options.opaque = rec;
+
+    RemuxSession *session = remux_session_create(url, filename, room->ffmpeg_headers,
+                                                 &options);
+    if (!session) {
+        free(rec);
+        return AVERROR(ENOMEM);
+    }
 
-    if (codec == AVC2HEVC) {
-        codec = AVC;
-        transcode_to_hevc = true;
+    for (int i = 0; i < bili_nb_extra_outputs; ++i) {
+        char extra_filename[4096];
+        const char *ext = strrchr(filename, '.');
+
+        snprintf(extra_filename, 4095, "%.*s.%s",
+                                       (int)(ext - filename), filename,
+                                       bili_extra_outputs[i]);
+        ret = remux_session_add_output(session, extra_filename, NULL);
+        if (ret < 0) {
+            remux_session_free(&session);
+            return ret;
+        }
     }
 
-    char *url = bili_get_stream_url(room, codec, qn);
-    char filename[4096];
-    struct tm *now = time_now();
-    snprintf(filename, 4095, "%d%02d%02d_%02d%02d%02d-%u.mp4",
-                             now->tm_year + 1900, now->tm_mon + 1, now->tm_mday,
-                             now->tm_hour, now->tm_min, now->tm_sec,
-                             room->room_id);
-    ret = remux(url, filename, room->ffmpeg_headers);
+    if (bili_dedupe) {
+        PacketStage stage;
 
-    free(url);
+        ret = packet_stage_dedupe(&stage);
+        if (ret >= 0) {
+            ret = remux_session_add_stage(session, REMUX_STAGE_INPUT, &stage);
+            if (ret < 0) {
+                stage.free(stage.opaque);
+            }
+        }
+        if (ret < 0) {
+            remux_session_free(&session);
+            return ret;
+        }
+    }
 
+    pthread_mutex_lock(&room->lock);
+    room->session = session;
+    room->codec = BILI_CODEC_STR(rec->codec);
+    room->qn = rec->qn;
+    if (room->stop_requested) {
+        remux_session_stop(session);
+    }
+    pthread_mutex_unlock(&room->lock);
+
+    ret = remux_session_start(session);
     if (ret < 0) {
-        bili_log("ERROR", false, "%s", av_err2str(ret));
+        pthread_mutex_lock(&room->lock);
+        room->session = NULL;
+        pthread_mutex_unlock(&room->lock);
+        remux_session_free(&session);
     }
 
-    if (transcode_to_hevc) {
-        pid_t child = fork();
+    return ret;
+}
+
+bool bili_recording_done(BILI_LIVE_ROOM *room) {
+    pthread_mutex_lock(&room->lock);
+    RemuxState state = room->session ? remux_session_state(room->session)
+                                     : REMUX_STATE_FINISHED;
+    pthread_mutex_unlock(&room->lock);
+
+    return state == REMUX_STATE_STOPPED || state == REMUX_STATE_FINISHED ||
+           state == REMUX_STATE_FAILED;
+}
 
-        if (child == -1) {
-            bili_log("ERROR", false, "Cannot fork process.");
+int bili_finish_recording(BILI_LIVE_ROOM *room, int ret) {
+    RemuxSession *session = room->session;
+    RemuxStats stats;
+
+    if (!session) {
+        if (ret < 0) {
+            bili_log("ERROR", false, "%s", av_err2str(ret));
         }
+        return ret;
+    }
 
-        if (child == 0) {
-            int ffmpeg_ret;
-            char new_filename[4096];
-            strncpy(new_filename, filename, 4095);
+    if (ret == 0) {
+        ret = remux_session_join(session);
+    }
 
-            char *ext = strstr(new_filename, ".mp4");
-            const char *suffix = "-hevc.mp4";
+    pthread_mutex_lock(&room->lock);
+    room->session = NULL;
+    pthread_mutex_unlock(&room->lock);
 
-            for (int i = 0; i < 9; ++i) {
-                *ext = suffix[i];
-                ++ext;
-            }
-            *ext = '\0';
+    remux_session_get_stats(session, &stats);
+    if (stats.first_write_latency) {
+        bili_log("INFO", false, "%u - First packet written %lld ms after connecting",
+                                room->room_id, (long long)(stats.first_write_latency / 1000));
+    }
+    if (stats.read_ahead_size) {
+        bili_log("INFO", false, "%u - Read-ahead: high-water mark %d/%d bytes,"
+                                " %lld stalls, %lld ms waiting, longest %lld ms",
+                                room->room_id, stats.read_ahead_high_water,
+                                stats.read_ahead_size, (long long)stats.read_ahead_stalls,
+                                (long long)(stats.read_ahead_stall_time / 1000),
+                                (long long)(stats.read_ahead_max_stall / 1000));
+    }
+    if (stats.nb_reconnects) {
+        bili_log("INFO", false, "%u - Reconnected %d times, %d after a stall",
+                                room->room_id, stats.nb_reconnects, stats.nb_stalls);
+    }
+    for (int i = 0; i < stats.nb_outputs; ++i) {
+        const RemuxOutputStats *os = &stats.outputs[i];
+        bili_log("INFO", false, "%u - Output %d: buffer high-water mark %d/%d packets,"
+                                " %lld full waits, %lld dropped",
+                                room->room_id, i, os->ring_high_water, os->ring_depth,
+                                (long long)os->ring_full_waits,
+                                (long long)os->dropped_packets);
+        if (os->spill_episodes) {
+            bili_log("INFO", false, "%u - Output %d: stalled %lld times, %lld packets"
+                                    " (%lld KiB) spilled, scratch file up to %lld KiB,"
+                                    " %lld ms degraded",
+                                    room->room_id, i, (long long)os->spill_episodes,
+                                    (long long)os->spilled_packets,
+                                    (long long)(os->spilled_bytes / 1024),
+                                    (long long)(os->spill_high_water / 1024),
+                                    (long long)(os->degraded_time / 1000));
+        }
+    }
 
-            bili_log("INFO", false, "Transcoding to %s", new_filename);
+    for (int i = 0; i < stats.nb_stages; ++i) {
+        const PacketStageStats *ss = &stats.stages[i];
+        bili_log("INFO", false, "%u - Stage %s: %lld packets in, %lld out,"
+                                " %lld us in %lld batches",
+                                room->room_id, ss->name, (long long)ss->packets_in,
+                                (long long)ss->packets_out, (long long)ss->time,
+                                (long long)ss->batches);
+    }
 
-            pid_t grandchild = fork();
+    remux_session_free(&session);
 
-            if (grandchild == -1) {
-                bili_log("ERROR", false, "Cannot fork process.");
-                exit(-1);
-            }
+    int pending = remux_finalizer_pending();
+    if (pending > 0) {
+        bili_log("INFO", false, "%u - %d files waiting for finalization",
+                                room->room_id, pending);
+    }
 
-            if (grandchild == 0) {
-                ffmpeg_ret = execlp("ffmpeg", "ffmpeg",
-                                    "-nostdin",
-                                    "-loglevel", "quiet",
-                                    "-i", filename,
-                                    "-c:v", "libx265",
-                                    "-x265-params", "log-level=none",
-                                    "-pix_fmt", "yuv420p10le",
-                                    "-tag:v", "hvc1",
-                                    "-max_muxing_queue_size", "4096",
-                                    "-c:a", "copy",
-                                    new_filename,
-                                    NULL);
-                if (ffmpeg_ret) {
-                    bili_log("ERROR", false, "FFmpeg not found.");
-                }
-            } else {
-                wait(&ffmpeg_ret);
-                if (ffmpeg_ret == 0) {
-                    bili_log("INFO", false, "Transcoding done. Removing %s", filename);
-                    int del_ret = remove(filename);
-                    if (del_ret) {
-                        bili_log("ERROR", false, "Cannot delete %s", filename);
-                    }
-                } else {
-                    bili_log("ERROR", false, "Transcode failed.");
-                }
-                return AVERROR_EXIT;
-            }
-        }
+    if (ret < 0) {
+        bili_log("ERROR", false, "%s", av_err2str(ret));
+    }
+
+    return ret;
+}
+
+int bili_start_recording(BILI_LIVE_ROOM *room, BILI_QUALITY_OPTION qn_option) {
+    BILI_RECORDING *rec = (BILI_RECORDING *)calloc(1, sizeof(BILI_RECORDING));
+    int ret;
+
+    if (!rec) {
+        return AVERROR(ENOMEM);
+    }
+    rec->room = room;
+    rec->start = room->poll_start;
+
+    if (bili_trace) {
+        chrome_trace_span(bili_trace, "bili_update_room", "bili", room->room_id,
+                          room->poll_start, room->poll_end);
+    }
+
+    int64_t start = av_gettime_relative();
+    bili_find_codec_qn(&rec->codec, &rec->qn, room->playurl_info, qn_option);
+    bili_trace_span(room, "bili_find_codec_qn", start);
+    TRACE_PROBE(bili, codec_select, room->room_id, qn_option, rec->codec, rec->qn);
+
+    if (rec->codec == AVC2HEVC) {
+        rec->codec = AVC;
+        rec->transcode_to_hevc = true;
+    }
+
+    start = av_gettime_relative();
+    char *url = bili_get_stream_url(room, rec->codec, rec->qn);
+    bili_trace_span(room, "bili_get_stream_url", start);
+    char filename[4096];
+    if (bili_remux_options.segment_duration || bili_remux_options.segment_size) {
+        /* expanded by remux when each segment starts */
+        snprintf(filename, 4095, "%%Y%%m%%d_%%H%%M%%S-%u.mp4", room->room_id);
+    } else {
+        struct tm *now = time_now();
+        snprintf(filename, 4095, "%d%02d%02d_%02d%02d%02d-%u.mp4",
+                                 now->tm_year + 1900, now->tm_mon + 1, now->tm_mday,
+                                 now->tm_hour, now->tm_min, now->tm_sec,
+                                 room->room_id);
+    }
+    /* rec is owned by the session from here */
+    ret = bili_record(rec, url, filename);
+    if (ret < 0) {
+        bili_trace_span(room, "recording_start", room->poll_start);
     }
 
+    free(url);
+
     return ret;
 }
 
+int bili_download_stream(BILI_LIVE_ROOM *room, BILI_QUALITY_OPTION qn_option) {
+    int ret = bili_start_recording(room, qn_option);
+
+    return bili_finish_recording(room, ret);
+}
+
 char *bili_get_stream_url(const BILI_LIVE_ROOM *room,
                           const BILI_STREAM_CODEC codec, const int qn) {
     cJSON *playurl_info = bili_fetch_api(room, qn);
     const cJSON *codecs = bili_get_codecs(playurl_info);
 
     const char *target_codec = BILI_CODEC_STR(codec);
-    bili_log("INFO", false, "Downloading: stream %s, quality %d", target_codec, qn);
+    bili_log("INFO", false, "%u - Downloading: stream %s, quality %d",
+                            room->room_id, target_codec, qn);
 
     char *url = NULL;
 
@@ -1,6 +1,8 @@
 #ifndef BILI_LIVE_H
 #define BILI_LIVE_H
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <time.h>
@@ -8,6 +10,8 @@
 #include <cJSON.h>
 #include <curl/curl.h>
 
+#include "remux.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -44,6 +48,12 @@ const char *BILI_HTTP_FLV_HEADERS =
 
 const size_t BILI_HTTP_HEADER_CNT = 5;
 
+#define BILI_DEFAULT_WORKERS 16
+#define BILI_DEFAULT_RECONNECTS 3
+#define BILI_DEFAULT_SHUTDOWN_TIMEOUT 30
+#define BILI_METRICS_INTERVAL 15
+#define BILI_SHM_INTERVAL 1
+
 typedef struct {
     char   *response;
     size_t size;
@@ -53,10 +63,20 @@ typedef struct {
     uint32_t room_id;
     CURL     *handle;
     cJSON    *playurl_info;
+    atomic_bool online;     /* at the last bili_update_room() */
+    int64_t     poll_start; /* of the last bili_update_room() */
+    int64_t     poll_end;
 
     char              *referer;
     char              *ffmpeg_headers;
     struct curl_slist *curl_headers;
+
+    /* Recording in progress, guarded by lock */
+    pthread_mutex_t lock;
+    RemuxSession    *session;
+    bool            stop_requested;
+    const char      *codec;     /* of the last recording started */
+    int             qn;
 } BILI_LIVE_ROOM;
 
 CURL *bili_make_handle();
@@ -105,6 +125,35 @@ const char *BILI_CODEC_STR(BILI_STREAM_CODEC codec) {
 
 int bili_download_stream(BILI_LIVE_ROOM *room, BILI_QUALITY_OPTION qn_option);
 
+/* Start recording the room without waiting for the end of the recording */
+int bili_start_recording(BILI_LIVE_ROOM *room, BILI_QUALITY_OPTION qn_option);
+
+/* Whether the recording started on the room has ended */
+bool bili_recording_done(BILI_LIVE_ROOM *room);
+
+/* Wait for the recording started on the room, then release it.
+   ret is the result of bili_start_recording(). */
+int bili_finish_recording(BILI_LIVE_ROOM *room, int ret);
+
+void bili_stop_room(BILI_LIVE_ROOM *room);
+
+typedef struct {
+    BILI_LIVE_ROOM      *room;
+    BILI_QUALITY_OPTION qn_option;
+
+    time_t next_check;
+    bool   online;
+    int    retry;
+
+    /* Set by the scheduler, cleared by the worker when the recording ends */
+    atomic_bool busy;
+    bool        ran;
+    int         ret;
+} BILI_ROOM_TASK;
+
+int bili_run_rooms(BILI_LIVE_ROOM **rooms, int nb_rooms,
+                   BILI_QUALITY_OPTION qn_option, int nb_workers);
+
 void bili_find_codec_qn(BILI_STREAM_CODEC *codec,
                         int *qn,
                         cJSON *playurl_info, BILI_QUALITY_OPTION qn_option);
@@ -115,8 +164,9 @@ char *bili_get_stream_url(const BILI_LIVE_ROOM *room,
 static const cJSON *bili_get_codecs(cJSON *playurl_info);
 
 struct tm *time_now() {
-    time_t now =time(NULL);
-    return localtime(&now);
+    static _Thread_local struct tm now_tm;
+    time_t now = time(NULL);
+    return localtime_r(&now, &now_tm);
 }
 
 #ifdef __cplusplus
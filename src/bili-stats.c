@@ -0,0 +1,101 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stats_shm.h"
+
+static void print_usage(const char *argv0) {
+    fprintf(stderr, "Usage: %s [-h] [-i <seconds>] <name>\n"
+                    "\nPrint the state of the rooms published by bili-live -P <name>.\n"
+                    "\n-i:  print again every this many seconds until bili-live exits\n"
+                    "-h:  print usage\n",
+                    argv0);
+}
+
+static int64_t time_now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void print_rooms(const StatsShm *shm) {
+    int64_t now = time_now_us();
+
+    printf("%-12s %-6s %-4s %-5s %5s %10s %12s %10s %7s\n",
+           "ROOM", "ONLINE", "REC", "CODEC", "QN",
+           "KBIT/S", "WRITTEN MiB", "LAST PKT", "RECONN");
+
+    for (int i = 0; i < stats_shm_nb_rooms(shm); ++i) {
+        StatsShmRoomState state;
+        char last_packet[32] = "-";
+
+        if (stats_shm_read(shm, i, &state) < 0) {
+            printf("%-12s (being updated)\n", "?");
+            continue;
+        }
+        if (state.last_packet_time) {
+            snprintf(last_packet, sizeof(last_packet), "%.1fs ago",
+                                  (now - state.last_packet_time) / 1e6);
+        }
+
+        printf("%-12u %-6s %-4s %-5s %5d %10lld %12.1f %10s %7d\n",
+               state.room_id, state.online ? "yes" : "no",
+               state.recording ? "yes" : "no",
+               state.codec[0] ? state.codec : "-", state.qn,
+               (long long)(state.bitrate / 1000),
+               state.bytes_written / (1024.0 * 1024.0),
+               last_packet, state.nb_reconnects);
+    }
+}
+
+int main(int argc, const char *argv[]) {
+    int ch, interval = 0;
+
+    while ((ch = getopt(argc, (char **)argv, "hi:")) != -1) {
+        switch (ch) {
+            case 'i':
+                interval = atoi(optarg);
+                break;
+            case 'h':
+            default:
+                print_usage(argv[0]);
+                return 0;
+        }
+    }
+
+    if (argc - optind != 1 || interval < 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    const char *name = argv[optind];
+    StatsShm *shm = stats_shm_open(name);
+    if (!shm) {
+        fprintf(stderr, "Cannot open %s: %s\n", name,
+                errno == EPROTO ? "not published by this version of bili-live"
+                                : strerror(errno));
+        return 1;
+    }
+
+    for (;;) {
+        print_rooms(shm);
+        if (!interval) {
+            break;
+        }
+
+        /* the segment stays mapped after the writer exits */
+        if (kill(stats_shm_pid(shm), 0) < 0 && errno == ESRCH) {
+            fprintf(stderr, "bili-live (pid %d) exited\n", stats_shm_pid(shm));
+            break;
+        }
+        sleep(interval);
+        printf("\n");
+    }
+
+    stats_shm_close(&shm);
+    return 0;
+}
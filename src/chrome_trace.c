@@ -0,0 +1,81 @@
+/**
+ * @file
+ * Implementation of the Chrome trace writer.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "chrome_trace.h"
+
+struct ChromeTrace {
+    FILE *f;
+    int pid;
+    int nb_events;
+    pthread_mutex_t lock;
+};
+
+ChromeTrace *chrome_trace_open(const char *path)
+{
+    ChromeTrace *t = calloc(1, sizeof(*t));
+    if (!t)
+        return NULL;
+
+    t->f = fopen(path, "w");
+    if (!t->f) {
+        free(t);
+        return NULL;
+    }
+    t->pid = getpid();
+    pthread_mutex_init(&t->lock, NULL);
+
+    fputs("[\n", t->f);
+    fflush(t->f);
+
+    return t;
+}
+
+void chrome_trace_close(ChromeTrace **pt)
+{
+    ChromeTrace *t = *pt;
+
+    if (!t)
+        return;
+
+    fputs("\n]\n", t->f);
+    fclose(t->f);
+    pthread_mutex_destroy(&t->lock);
+    free(t);
+    *pt = NULL;
+}
+
+/* Start a new event, the caller holds the lock. */
+static void trace_next_event(ChromeTrace *t)
+{
+    if (t->nb_events++)
+        fputs(",\n", t->f);
+}
+
+void chrome_trace_track_name(ChromeTrace *t, int tid, const char *name)
+{
+    pthread_mutex_lock(&t->lock);
+    trace_next_event(t);
+    fprintf(t->f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                  "\"args\":{\"name\":\"%s\"}}", t->pid, tid, name);
+    fflush(t->f);
+    pthread_mutex_unlock(&t->lock);
+}
+
+void chrome_trace_span(ChromeTrace *t, const char *name, const char *category,
+                       int tid, int64_t start, int64_t end)
+{
+    pthread_mutex_lock(&t->lock);
+    trace_next_event(t);
+    fprintf(t->f, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%lld,"
+                  "\"dur\":%lld,\"pid\":%d,\"tid\":%d}",
+            name, category, (long long)start, (long long)(end - start), t->pid, tid);
+    fflush(t->f);
+    pthread_mutex_unlock(&t->lock);
+}
@@ -0,0 +1,52 @@
+/**
+ * @file
+ * Timeline of spans written in the Chrome trace event format, for
+ * chrome://tracing or ui.perfetto.dev.
+ *
+ * Events are appended and flushed one by one as a JSON array, which the
+ * viewers also accept unterminated, so the trace of a process that was
+ * killed can still be read.
+ */
+
+#ifndef CHROME_TRACE_H
+#define CHROME_TRACE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+typedef struct ChromeTrace ChromeTrace;
+
+/**
+ * Create or truncate the trace file path.
+ *
+ * @return the new trace, or NULL with errno set on failure
+ */
+ChromeTrace *chrome_trace_open(const char *path);
+
+/**
+ * Terminate the trace, close its file and set *t to NULL.
+ */
+void chrome_trace_close(ChromeTrace **t);
+
+/**
+ * Name the track tid, e.g. after the room it shows.
+ */
+void chrome_trace_track_name(ChromeTrace *t, int tid, const char *name);
+
+/**
+ * Add a span from start to end, in microseconds of any monotonic clock
+ * used by every span of the trace, to the track tid. name and category
+ * are written as they are, so they must not need JSON escaping.
+ * Safe to call from any thread.
+ */
+void chrome_trace_span(ChromeTrace *t, const char *name, const char *category,
+                       int tid, int64_t start, int64_t end);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
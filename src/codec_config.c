@@ -0,0 +1,413 @@
+/**
+ * @file
+ * Parsers for the AVC/HEVC decoder configuration records and the AAC
+ * AudioSpecificConfig.
+ */
+
+#include <string.h>
+
+#include <libavutil/channel_layout.h>
+#include <libavutil/error.h>
+#include <libavutil/intreadwrite.h>
+#include <libavutil/mem.h>
+
+#include "codec_config.h"
+
+typedef struct BitReader {
+    const uint8_t *buf;
+    int size_in_bits;
+    int index;
+} BitReader;
+
+static void br_init(BitReader *br, const uint8_t *buf, int size)
+{
+    br->buf = buf;
+    br->size_in_bits = size * 8;
+    br->index = 0;
+}
+
+static unsigned int br_read(BitReader *br, int n)
+{
+    unsigned int v = 0;
+
+    while (n-- > 0) {
+        v <<= 1;
+        if (br->index < br->size_in_bits)
+            v |= (br->buf[br->index >> 3] >> (7 - (br->index & 7))) & 1;
+        br->index++;
+    }
+
+    return v;
+}
+
+static void br_skip(BitReader *br, int n)
+{
+    br->index += n;
+}
+
+static unsigned int br_read_ue(BitReader *br)
+{
+    int zeros = 0;
+
+    while (!br_read(br, 1)) {
+        if (++zeros > 31 || br->index >= br->size_in_bits)
+            return 0;
+    }
+
+    return (1U << zeros) - 1 + br_read(br, zeros);
+}
+
+static int br_read_se(BitReader *br)
+{
+    unsigned int k = br_read_ue(br);
+
+    return k & 1 ? (int)((k + 1) / 2) : -(int)(k / 2);
+}
+
+static int br_overrun(const BitReader *br)
+{
+    return br->index > br->size_in_bits;
+}
+
+/**
+ * Copy a NAL unit without its emulation prevention bytes.
+ *
+ * @return size of the unescaped NAL unit
+ */
+static int nal_unescape(const uint8_t *src, int size, uint8_t *dst)
+{
+    int i, n = 0, zeros = 0;
+
+    for (i = 0; i < size; i++) {
+        if (zeros >= 2 && src[i] == 3) {
+            zeros = 0;
+            continue;
+        }
+        zeros = src[i] ? 0 : zeros + 1;
+        dst[n++] = src[i];
+    }
+
+    return n;
+}
+
+static void avc_skip_scaling_list(BitReader *br, int size)
+{
+    int i, last = 8, next = 8;
+
+    for (i = 0; i < size && next; i++) {
+        next = (last + br_read_se(br)) & 0xff;
+        if (next)
+            last = next;
+    }
+}
+
+static int avc_parse_sps(AVCodecParameters *par, const uint8_t *nal, int size)
+{
+    BitReader br;
+    int profile_idc, level_idc;
+    int chroma_format_idc = 1, separate_colour_plane = 0;
+    int width_mbs, height_map_units, frame_mbs_only;
+    int crop_left = 0, crop_right = 0, crop_top = 0, crop_bottom = 0;
+    int crop_unit_x, crop_unit_y;
+    int i;
+
+    /* skip the NAL header */
+    br_init(&br, nal + 1, size - 1);
+
+    profile_idc = br_read(&br, 8);
+    br_skip(&br, 8);                                /* constraint flags */
+    level_idc = br_read(&br, 8);
+    br_read_ue(&br);                                /* seq_parameter_set_id */
+
+    if (profile_idc == 100 || profile_idc == 110 || profile_idc == 122 ||
+        profile_idc == 244 || profile_idc ==  44 || profile_idc ==  83 ||
+        profile_idc ==  86 || profile_idc == 118 || profile_idc == 128 ||
+        profile_idc == 138 || profile_idc == 139 || profile_idc == 134 ||
+        profile_idc == 135) {
+        chroma_format_idc = br_read_ue(&br);
+        if (chroma_format_idc == 3)
+            separate_colour_plane = br_read(&br, 1);
+        br_read_ue(&br);                            /* bit_depth_luma_minus8 */
+        br_read_ue(&br);                            /* bit_depth_chroma_minus8 */
+        br_skip(&br, 1);                            /* qpprime_y_zero_transform_bypass */
+        if (br_read(&br, 1)) {                      /* seq_scaling_matrix_present */
+            for (i = 0; i < (chroma_format_idc != 3 ? 8 : 12); i++) {
+                if (br_read(&br, 1))
+                    avc_skip_scaling_list(&br, i < 6 ? 16 : 64);
+            }
+        }
+    }
+
+    br_read_ue(&br);                                /* log2_max_frame_num_minus4 */
+    switch (br_read_ue(&br)) {                      /* pic_order_cnt_type */
+    case 0:
+        br_read_ue(&br);                            /* log2_max_poc_lsb_minus4 */
+        break;
+    case 1: {
+        unsigned int nb_ref_frames_in_cycle;
+
+        br_skip(&br, 1);                            /* delta_pic_order_always_zero */
+        br_read_se(&br);                            /* offset_for_non_ref_pic */
+        br_read_se(&br);                            /* offset_for_top_to_bottom_field */
+        nb_ref_frames_in_cycle = br_read_ue(&br);
+        if (nb_ref_frames_in_cycle > 255)
+            return AVERROR_INVALIDDATA;
+        for (i = 0; i < nb_ref_frames_in_cycle; i++)
+            br_read_se(&br);
+        break;
+    }
+    }
+
+    br_read_ue(&br);                                /* max_num_ref_frames */
+    br_skip(&br, 1);                                /* gaps_in_frame_num_allowed */
+    width_mbs = br_read_ue(&br) + 1;
+    height_map_units = br_read_ue(&br) + 1;
+    frame_mbs_only = br_read(&br, 1);
+    if (!frame_mbs_only)
+        br_skip(&br, 1);                            /* mb_adaptive_frame_field */
+    br_skip(&br, 1);                                /* direct_8x8_inference */
+    if (br_read(&br, 1)) {                          /* frame_cropping */
+        crop_left   = br_read_ue(&br);
+        crop_right  = br_read_ue(&br);
+        crop_top    = br_read_ue(&br);
+        crop_bottom = br_read_ue(&br);
+    }
+
+    if (br_overrun(&br))
+        return AVERROR_INVALIDDATA;
+
+    if (separate_colour_plane || chroma_format_idc == 0) {
+        crop_unit_x = 1;
+        crop_unit_y = 2 - frame_mbs_only;
+    } else {
+        crop_unit_x = chroma_format_idc == 3 ? 1 : 2;
+        crop_unit_y = (chroma_format_idc == 1 ? 2 : 1) * (2 - frame_mbs_only);
+    }
+
+    par->width  = width_mbs * 16 - crop_unit_x * (crop_left + crop_right);
+    par->height = (2 - frame_mbs_only) * height_map_units * 16 -
+                  crop_unit_y * (crop_top + crop_bottom);
+    par->profile = profile_idc;
+    par->level = level_idc;
+
+    return par->width > 0 && par->height > 0 ? 0 : AVERROR_INVALIDDATA;
+}
+
+/* AVCDecoderConfigurationRecord, ISO/IEC 14496-15 5.2.4.1 */
+static int avc_parse_config(AVCodecParameters *par)
+{
+    const uint8_t *p = par->extradata;
+    int size = par->extradata_size;
+    int nal_size, ret;
+    uint8_t *nal;
+
+    if (size < 8 || p[0] != 1 || !(p[5] & 0x1f))
+        return AVERROR_INVALIDDATA;
+
+    nal_size = AV_RB16(p + 6);
+    if (nal_size < 4 || 8 + nal_size > size)
+        return AVERROR_INVALIDDATA;
+
+    nal = av_malloc(nal_size);
+    if (!nal)
+        return AVERROR(ENOMEM);
+
+    nal_size = nal_unescape(p + 8, nal_size, nal);
+    ret = avc_parse_sps(par, nal, nal_size);
+    av_free(nal);
+
+    return ret;
+}
+
+static void hevc_skip_sub_layers(BitReader *br, int max_sub_layers_minus1)
+{
+    int profile_present[8], level_present[8];
+    int i;
+
+    for (i = 0; i < max_sub_layers_minus1; i++) {
+        profile_present[i] = br_read(br, 1);
+        level_present[i] = br_read(br, 1);
+    }
+
+    if (max_sub_layers_minus1 > 0)
+        br_skip(br, 2 * (8 - max_sub_layers_minus1));
+
+    for (i = 0; i < max_sub_layers_minus1; i++) {
+        if (profile_present[i])
+            br_skip(br, 88);
+        if (level_present[i])
+            br_skip(br, 8);
+    }
+}
+
+static int hevc_parse_sps(AVCodecParameters *par, const uint8_t *nal, int size)
+{
+    BitReader br;
+    int max_sub_layers_minus1;
+    int profile_idc, level_idc;
+    int chroma_format_idc, separate_colour_plane = 0;
+    int width, height;
+    int sub_width = 1, sub_height = 1;
+
+    /* skip the NAL header */
+    br_init(&br, nal + 2, size - 2);
+
+    br_skip(&br, 4);                                /* sps_video_parameter_set_id */
+    max_sub_layers_minus1 = br_read(&br, 3);
+    br_skip(&br, 1);                                /* temporal_id_nesting */
+
+    /* profile_tier_level() */
+    br_skip(&br, 3);                                /* profile_space, tier */
+    profile_idc = br_read(&br, 5);
+    br_skip(&br, 32 + 48);                          /* compatibility, constraints */
+    level_idc = br_read(&br, 8);
+    hevc_skip_sub_layers(&br, max_sub_layers_minus1);
+
+    br_read_ue(&br);                                /* sps_seq_parameter_set_id */
+    chroma_format_idc = br_read_ue(&br);
+    if (chroma_format_idc == 3)
+        separate_colour_plane = br_read(&br, 1);
+    width  = br_read_ue(&br);
+    height = br_read_ue(&br);
+
+    if (!separate_colour_plane) {
+        sub_width  = chroma_format_idc == 1 || chroma_format_idc == 2 ? 2 : 1;
+        sub_height = chroma_format_idc == 1 ? 2 : 1;
+    }
+
+    if (br_read(&br, 1)) {                          /* conformance_window */
+        int left   = br_read_ue(&br);
+        int right  = br_read_ue(&br);
+        int top    = br_read_ue(&br);
+        int bottom = br_read_ue(&br);
+
+        width  -= sub_width * (left + right);
+        height -= sub_height * (top + bottom);
+    }
+
+    if (br_overrun(&br))
+        return AVERROR_INVALIDDATA;
+
+    par->width = width;
+    par->height = height;
+    par->profile = profile_idc;
+    par->level = level_idc;
+
+    return par->width > 0 && par->height > 0 ? 0 : AVERROR_INVALIDDATA;
+}
+
+/* HEVCDecoderConfigurationRecord, ISO/IEC 14496-15 8.3.3.1 */
+static int hevc_parse_config(AVCodecParameters *par)
+{
+    const uint8_t *p = par->extradata;
+    const uint8_t *end = p + par->extradata_size;
+    int nb_arrays, i, j;
+
+    if (par->extradata_size < 23 || p[0] != 1)
+        return AVERROR_INVALIDDATA;
+
+    nb_arrays = p[22];
+    p += 23;
+
+    for (i = 0; i < nb_arrays; i++) {
+        int nal_type, nb_nals;
+
+        if (end - p < 3)
+            return AVERROR_INVALIDDATA;
+        nal_type = p[0] & 0x3f;
+        nb_nals = AV_RB16(p + 1);
+        p += 3;
+
+        for (j = 0; j < nb_nals; j++) {
+            int nal_size, ret;
+            uint8_t *nal;
+
+            if (end - p < 2)
+                return AVERROR_INVALIDDATA;
+            nal_size = AV_RB16(p);
+            p += 2;
+            if (end - p < nal_size)
+                return AVERROR_INVALIDDATA;
+
+            /* 33: SPS_NUT */
+            if (nal_type == 33 && nal_size > 2) {
+                nal = av_malloc(nal_size);
+                if (!nal)
+                    return AVERROR(ENOMEM);
+
+                ret = hevc_parse_sps(par, nal, nal_unescape(p, nal_size, nal));
+                av_free(nal);
+                return ret;
+            }
+            p += nal_size;
+        }
+    }
+
+    return AVERROR_INVALIDDATA;
+}
+
+/* AudioSpecificConfig, ISO/IEC 14496-3 1.6.2.1 */
+static int aac_parse_config(AVCodecParameters *par)
+{
+    static const int sample_rates[] = {
+        96000, 88200, 64000, 48000, 44100, 32000,
+        24000, 22050, 16000, 12000, 11025, 8000, 7350,
+    };
+    BitReader br;
+    int object_type, rate_index, sample_rate, channel_config;
+
+    if (par->extradata_size < 2)
+        return AVERROR_INVALIDDATA;
+
+    br_init(&br, par->extradata, par->extradata_size);
+
+    object_type = br_read(&br, 5);
+    if (object_type == 31)
+        object_type = 32 + br_read(&br, 6);
+
+    rate_index = br_read(&br, 4);
+    if (rate_index == 0xf)
+        sample_rate = br_read(&br, 24);
+    else if (rate_index < FF_ARRAY_ELEMS(sample_rates))
+        sample_rate = sample_rates[rate_index];
+    else
+        return AVERROR_INVALIDDATA;
+
+    channel_config = br_read(&br, 4);
+    if (channel_config < 1 || channel_config > 7 || br_overrun(&br))
+        return AVERROR_INVALIDDATA;
+
+    par->profile = object_type - 1;
+    par->sample_rate = sample_rate;
+    par->channels = channel_config == 7 ? 8 : channel_config;
+    par->channel_layout = av_get_default_channel_layout(par->channels);
+    par->frame_size = 1024;
+
+    return 0;
+}
+
+int codec_config_parse(AVCodecParameters *par)
+{
+    switch (par->codec_id) {
+    case AV_CODEC_ID_H264:
+        return avc_parse_config(par);
+    case AV_CODEC_ID_HEVC:
+        return hevc_parse_config(par);
+    case AV_CODEC_ID_AAC:
+        return aac_parse_config(par);
+    default:
+        return AVERROR(ENOSYS);
+    }
+}
+
+int codec_config_ready(const AVCodecParameters *par)
+{
+    switch (par->codec_id) {
+    case AV_CODEC_ID_H264:
+    case AV_CODEC_ID_HEVC:
+    case AV_CODEC_ID_AAC:
+        return par->extradata_size > 0;
+    default:
+        return 1;
+    }
+}
@@ -0,0 +1,40 @@
+/**
+ * @file
+ * Codec parameters from decoder configuration records.
+ *
+ * FLV carries the AVC/HEVC decoder configuration record and the AAC
+ * AudioSpecificConfig in its sequence header tags, which the demuxer
+ * stores as extradata. Parsing them gives the muxer what it needs without
+ * probing the stream with avformat_find_stream_info().
+ */
+
+#ifndef CODEC_CONFIG_H
+#define CODEC_CONFIG_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <libavcodec/avcodec.h>
+
+/**
+ * Fill the dimensions, profile and level of an AVC or HEVC stream, or the
+ * sample rate, channels and profile of an AAC stream, from the
+ * configuration record in par->extradata.
+ *
+ * @return 0 on success, AVERROR(ENOSYS) for other codecs,
+ *         AVERROR_INVALIDDATA if the record cannot be parsed
+ */
+int codec_config_parse(AVCodecParameters *par);
+
+/**
+ * @return 1 if par has the configuration record codec_config_parse()
+ *         needs, or if its codec does not use one, 0 otherwise
+ */
+int codec_config_ready(const AVCodecParameters *par);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
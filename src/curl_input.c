@@ -0,0 +1,309 @@
+/**
+ * @file
+ * Implementation of the libcurl input backend.
+ */
+
+#include <pthread.h>
+#include <string.h>
+
+#include <libavutil/avstring.h>
+#include <libavutil/common.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+
+#include "curl_input.h"
+
+#define INPUT_AVIO_SIZE 32768
+
+/**
+ * Longest wait for socket activity before the interrupt callback is
+ * checked again, in milliseconds.
+ */
+#define INPUT_POLL_MS 100
+
+typedef struct CurlInput {
+    CURLM *multi;
+    CURL *easy;
+    struct curl_slist *headers;
+    AVIOInterruptCB int_cb;
+
+    uint8_t *buf;
+    int buf_size;
+    int buf_len;
+    int buf_pos;                ///< first byte not read yet
+    int done;
+    int error;                  ///< how reads end once done
+} CurlInput;
+
+static CURLSH *share;
+static pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+static pthread_once_t share_once = PTHREAD_ONCE_INIT;
+
+static void share_lock(CURL *handle, curl_lock_data data,
+                       curl_lock_access access, void *userp)
+{
+    pthread_mutex_lock(&share_locks[data]);
+}
+
+static void share_unlock(CURL *handle, curl_lock_data data, void *userp)
+{
+    pthread_mutex_unlock(&share_locks[data]);
+}
+
+static void share_init(void)
+{
+    int i;
+
+    curl_global_init(CURL_GLOBAL_ALL);
+
+    for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+        pthread_mutex_init(&share_locks[i], NULL);
+
+    share = curl_share_init();
+    if (!share)
+        return;
+
+    curl_share_setopt(share, CURLSHOPT_LOCKFUNC, share_lock);
+    curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+}
+
+void curl_input_setup(CURL *easy)
+{
+    pthread_once(&share_once, share_init);
+
+    if (share)
+        curl_easy_setopt(easy, CURLOPT_SHARE, share);
+
+    curl_easy_setopt(easy, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(easy, CURLOPT_PIPEWAIT, 1L);
+    curl_easy_setopt(easy, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(easy, CURLOPT_MAXREDIRS, 10L);
+    curl_easy_setopt(easy, CURLOPT_CONNECTTIMEOUT, 5L);
+    curl_easy_setopt(easy, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+    /* a live stream never ends by itself: give up after a stall instead */
+    curl_easy_setopt(easy, CURLOPT_LOW_SPEED_LIMIT, 1L);
+    curl_easy_setopt(easy, CURLOPT_LOW_SPEED_TIME, (long)CURL_INPUT_STALL_TIMEOUT);
+}
+
+struct curl_slist *curl_input_headers(const char *http_headers)
+{
+    struct curl_slist *list = NULL;
+    const char *p = http_headers;
+
+    while (p && *p) {
+        const char *eol = strstr(p, "\r\n");
+        int len = eol ? eol - p : strlen(p);
+
+        if (len > 0) {
+            char *line = av_strndup(p, len);
+            struct curl_slist *tmp = line ? curl_slist_append(list, line) : NULL;
+
+            av_free(line);
+            if (!tmp) {
+                curl_slist_free_all(list);
+                return NULL;
+            }
+            list = tmp;
+        }
+        p = eol ? eol + 2 : p + len;
+    }
+
+    return list;
+}
+
+static size_t input_write(char *data, size_t size, size_t nmemb, void *userp)
+{
+    CurlInput *in = userp;
+    size_t len = size * nmemb;
+
+    if (in->buf_pos) {
+        memmove(in->buf, in->buf + in->buf_pos, in->buf_len - in->buf_pos);
+        in->buf_len -= in->buf_pos;
+        in->buf_pos = 0;
+    }
+
+    if (in->buf_len + len > in->buf_size) {
+        int new_size = FFMAX(in->buf_len + len, in->buf_size * 2);
+        uint8_t *buf = av_realloc(in->buf, new_size);
+
+        if (!buf)
+            return 0;
+        in->buf = buf;
+        in->buf_size = new_size;
+    }
+
+    memcpy(in->buf + in->buf_len, data, len);
+    in->buf_len += len;
+
+    return len;
+}
+
+static int input_error(CURL *easy, CURLcode res)
+{
+    long code = 0;
+
+    curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &code);
+
+    if (code >= 400)
+        return code == 404 ? AVERROR_HTTP_NOT_FOUND :
+               code == 403 ? AVERROR_HTTP_FORBIDDEN :
+               code >= 500 ? AVERROR_HTTP_SERVER_ERROR : AVERROR_HTTP_OTHER_4XX;
+    if (res == CURLE_OK)
+        return AVERROR_EOF;
+    if (res == CURLE_OPERATION_TIMEDOUT)
+        return AVERROR(ETIMEDOUT);
+    return AVERROR(EIO);
+}
+
+/**
+ * Let libcurl make progress on the transfer.
+ *
+ * @return 0 on success, a negative AVERROR code otherwise
+ */
+static int input_perform(CurlInput *in)
+{
+    CURLMsg *msg;
+    int running, left;
+
+    if (curl_multi_perform(in->multi, &running) != CURLM_OK)
+        return AVERROR(EIO);
+
+    while ((msg = curl_multi_info_read(in->multi, &left))) {
+        if (msg->msg == CURLMSG_DONE) {
+            in->done = 1;
+            in->error = input_error(in->easy, msg->data.result);
+        }
+    }
+
+    return 0;
+}
+
+static int input_read(void *opaque, uint8_t *buf, int buf_size)
+{
+    CurlInput *in = opaque;
+    int ret;
+
+    while (in->buf_pos == in->buf_len && !in->done) {
+        if (in->int_cb.callback && in->int_cb.callback(in->int_cb.opaque))
+            return AVERROR_EXIT;
+
+        ret = input_perform(in);
+        if (ret < 0)
+            return ret;
+        if (in->buf_pos < in->buf_len || in->done)
+            break;
+
+        if (curl_multi_wait(in->multi, NULL, 0, INPUT_POLL_MS, NULL) != CURLM_OK)
+            return AVERROR(EIO);
+    }
+
+    if (in->buf_pos == in->buf_len)
+        return in->error;
+
+    ret = FFMIN(in->buf_len - in->buf_pos, buf_size);
+    memcpy(buf, in->buf + in->buf_pos, ret);
+    in->buf_pos += ret;
+
+    return ret;
+}
+
+static void input_free(CurlInput *in)
+{
+    if (in->multi && in->easy)
+        curl_multi_remove_handle(in->multi, in->easy);
+    if (in->easy)
+        curl_easy_cleanup(in->easy);
+    if (in->multi)
+        curl_multi_cleanup(in->multi);
+    curl_slist_free_all(in->headers);
+    av_free(in->buf);
+    av_free(in);
+}
+
+int curl_input_open(AVIOContext **pb, const char *url, const char *http_headers,
+                    const AVIOInterruptCB *int_cb)
+{
+    CurlInput *in;
+    uint8_t *buffer;
+    int ret;
+
+    in = av_mallocz(sizeof(*in));
+    if (!in)
+        return AVERROR(ENOMEM);
+    if (int_cb)
+        in->int_cb = *int_cb;
+
+    in->easy = curl_easy_init();
+    in->multi = curl_multi_init();
+    if (http_headers)
+        in->headers = curl_input_headers(http_headers);
+    if (!in->easy || !in->multi) {
+        input_free(in);
+        return AVERROR(ENOMEM);
+    }
+
+    curl_input_setup(in->easy);
+    curl_easy_setopt(in->easy, CURLOPT_URL, url);
+    curl_easy_setopt(in->easy, CURLOPT_HTTPHEADER, in->headers);
+    curl_easy_setopt(in->easy, CURLOPT_WRITEFUNCTION, input_write);
+    curl_easy_setopt(in->easy, CURLOPT_WRITEDATA, in);
+
+    if (curl_multi_add_handle(in->multi, in->easy) != CURLM_OK) {
+        input_free(in);
+        return AVERROR(ENOMEM);
+    }
+
+    /* wait for the response, so that a bad URL fails the open */
+    while (!in->buf_len && !in->done) {
+        if (in->int_cb.callback && in->int_cb.callback(in->int_cb.opaque)) {
+            input_free(in);
+            return AVERROR_EXIT;
+        }
+        ret = input_perform(in);
+        if (ret >= 0 && !in->buf_len && !in->done &&
+            curl_multi_wait(in->multi, NULL, 0, INPUT_POLL_MS, NULL) != CURLM_OK)
+            ret = AVERROR(EIO);
+        if (ret < 0) {
+            input_free(in);
+            return ret;
+        }
+    }
+    if (!in->buf_len && in->error != AVERROR_EOF) {
+        ret = in->error;
+        input_free(in);
+        return ret;
+    }
+
+    buffer = av_malloc(INPUT_AVIO_SIZE);
+    if (!buffer) {
+        input_free(in);
+        return AVERROR(ENOMEM);
+    }
+
+    *pb = avio_alloc_context(buffer, INPUT_AVIO_SIZE, 0, in, input_read,
+                             NULL, NULL);
+    if (!*pb) {
+        av_free(buffer);
+        input_free(in);
+        return AVERROR(ENOMEM);
+    }
+    (*pb)->seekable = 0;
+
+    return 0;
+}
+
+void curl_input_close(AVIOContext **pb)
+{
+    if (!*pb)
+        return;
+
+    input_free((*pb)->opaque);
+    av_freep(&(*pb)->buffer);
+    avio_context_free(pb);
+}
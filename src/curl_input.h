@@ -0,0 +1,62 @@
+/**
+ * @file
+ * Input AVIO backend reading HTTP(S) streams with libcurl.
+ *
+ * Every transfer of the process, including those of the ingest engine,
+ * goes through one share of DNS cache, TLS sessions and connections.
+ * A reconnect then reuses the previous connection, or at least resumes
+ * its TLS session, and streams from the same CDN host share connections.
+ * HTTP/2 is negotiated over TLS.
+ */
+
+#ifndef CURL_INPUT_H
+#define CURL_INPUT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <curl/curl.h>
+
+#include <libavformat/avio.h>
+
+/**
+ * Seconds without data after which a transfer fails, like the timeout of
+ * FFmpeg's http protocol.
+ */
+#define CURL_INPUT_STALL_TIMEOUT 5
+
+/**
+ * Set the options common to every stream transfer on easy, including the
+ * process-wide share.
+ */
+void curl_input_setup(CURL *easy);
+
+/**
+ * Turn CRLF separated header lines into a libcurl list.
+ *
+ * @return the list, or NULL if http_headers has no line or on failure
+ */
+struct curl_slist *curl_input_headers(const char *http_headers);
+
+/**
+ * Start receiving url and open a read context on it.
+ * @param http_headers extra request headers separated by CRLF, may be NULL
+ * @param int_cb checked while waiting for data, may be NULL
+ *
+ * @return 0 on success, a negative AVERROR code otherwise
+ */
+int curl_input_open(AVIOContext **pb, const char *url, const char *http_headers,
+                    const AVIOInterruptCB *int_cb);
+
+/**
+ * Stop the transfer, free a context opened with curl_input_open() and
+ * set *pb to NULL.
+ */
+void curl_input_close(AVIOContext **pb);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
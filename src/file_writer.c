@@ -0,0 +1,234 @@
+/**
+ * @file
+ * Implementation of the file writer AVIO backend.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libavutil/common.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include <libavutil/time.h>
+
+#include "file_writer.h"
+#include "uring_queue.h"
+
+#define WRITER_ALIGN 4096
+
+typedef struct FileWriter {
+    int fd;
+    FileWriterOptions opts;
+    int64_t pos;            ///< offset of the next write
+    int64_t size;           ///< end of the written data
+    int64_t prealloc_end;   ///< end of the reserved space
+    int64_t last_sync;
+    int error;
+    UringFile *uring;       ///< asynchronous writes, NULL for pwrite(2)
+} FileWriter;
+
+void file_writer_options_default(FileWriterOptions *opts)
+{
+    opts->buffer_size = 0;
+    opts->prealloc_size = 0;
+    opts->sync = FILE_SYNC_NONE;
+    opts->sync_interval = FILE_WRITER_DEFAULT_SYNC_INTERVAL;
+    opts->io_uring = 0;
+}
+
+int file_writer_parse_sync(const char *name)
+{
+    if (!strcmp(name, "none"))
+        return FILE_SYNC_NONE;
+    if (!strcmp(name, "periodic"))
+        return FILE_SYNC_PERIODIC;
+    if (!strcmp(name, "close"))
+        return FILE_SYNC_CLOSE;
+    return -1;
+}
+
+static void writer_prealloc(FileWriter *w, int64_t end)
+{
+    while (w->opts.prealloc_size > 0 && end > w->prealloc_end) {
+        if (fallocate(w->fd, FALLOC_FL_KEEP_SIZE, w->prealloc_end,
+                      w->opts.prealloc_size) < 0) {
+            /* not supported by the filesystem, or out of space: write anyway */
+            w->opts.prealloc_size = 0;
+            return;
+        }
+        w->prealloc_end += w->opts.prealloc_size;
+    }
+}
+
+static int writer_write(void *opaque, uint8_t *buf, int buf_size)
+{
+    FileWriter *w = opaque;
+    int done = 0;
+
+    if (w->error)
+        return w->error;
+
+    writer_prealloc(w, w->pos + buf_size);
+
+    if (w->uring) {
+        w->error = uring_file_write(w->uring, buf, buf_size, w->pos);
+        if (w->error == AVERROR(ENOSYS)) {
+            /* the ring stopped with nothing of ours in flight */
+            w->error = 0;
+            uring_file_close(&w->uring);
+        } else if (w->error < 0) {
+            return w->error;
+        } else {
+            done = buf_size;
+        }
+    }
+
+    while (done < buf_size) {
+        ssize_t n = pwrite(w->fd, buf + done, buf_size - done, w->pos + done);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            w->error = AVERROR(errno);
+            return w->error;
+        }
+        done += n;
+    }
+
+    w->pos += done;
+    if (w->pos > w->size)
+        w->size = w->pos;
+
+    if (w->opts.sync == FILE_SYNC_PERIODIC &&
+        av_gettime_relative() - w->last_sync >= w->opts.sync_interval) {
+        if (w->uring)
+            w->error = uring_file_datasync(w->uring);
+        if (!w->uring || w->error == AVERROR(ENOSYS)) {
+            w->error = fdatasync(w->fd) < 0 ? AVERROR(errno) : 0;
+            uring_file_close(&w->uring);
+        }
+        if (w->error < 0)
+            return w->error;
+        w->last_sync = av_gettime_relative();
+    }
+
+    return done;
+}
+
+static int64_t writer_seek(void *opaque, int64_t offset, int whence)
+{
+    FileWriter *w = opaque;
+
+    switch (whence) {
+    case AVSEEK_SIZE:
+        return w->size;
+    case SEEK_SET:
+        break;
+    case SEEK_CUR:
+        offset += w->pos;
+        break;
+    case SEEK_END:
+        offset += w->size;
+        break;
+    default:
+        return AVERROR(EINVAL);
+    }
+
+    if (offset < 0)
+        return AVERROR(EINVAL);
+
+    /* queued writes may overlap the rewritten area, let them land first */
+    if (w->uring && offset != w->pos) {
+        int ret = uring_file_wait(w->uring);
+        if (ret < 0)
+            return ret;
+    }
+
+    w->pos = offset;
+    return offset;
+}
+
+int file_writer_open(AVIOContext **pb, const char *filename,
+                     const FileWriterOptions *opts)
+{
+    FileWriter *w;
+    void *buffer = NULL;
+    int buffer_size = FFALIGN(opts->buffer_size, WRITER_ALIGN);
+    int ret;
+
+    w = av_mallocz(sizeof(*w));
+    if (!w)
+        return AVERROR(ENOMEM);
+    w->opts = *opts;
+    w->last_sync = av_gettime_relative();
+
+    w->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (w->fd < 0) {
+        ret = AVERROR(errno);
+        av_free(w);
+        return ret;
+    }
+
+    /* av_malloc() is only SIMD aligned, writes of whole pages want more */
+    ret = posix_memalign(&buffer, WRITER_ALIGN, buffer_size);
+    if (ret) {
+        close(w->fd);
+        av_free(w);
+        return AVERROR(ret);
+    }
+
+    *pb = avio_alloc_context(buffer, buffer_size, 1, w, NULL,
+                             writer_write, writer_seek);
+    if (!*pb) {
+        free(buffer);
+        close(w->fd);
+        av_free(w);
+        return AVERROR(ENOMEM);
+    }
+    (*pb)->seekable = AVIO_SEEKABLE_NORMAL;
+
+    /* without io_uring support, writes go through pwrite(2) */
+    if (opts->io_uring)
+        w->uring = uring_file_open(w->fd);
+
+    return 0;
+}
+
+int file_writer_close(AVIOContext **pb)
+{
+    FileWriter *w;
+    int ret, err;
+
+    if (!*pb)
+        return 0;
+
+    w = (*pb)->opaque;
+    avio_flush(*pb);
+    ret = w->error ? w->error : (*pb)->error;
+
+    err = uring_file_close(&w->uring);
+    if (err < 0 && !ret)
+        ret = err;
+
+    /* give back the space reserved past the end of the data */
+    if (w->prealloc_end > w->size && ftruncate(w->fd, w->size) < 0 && !ret)
+        ret = AVERROR(errno);
+
+    if (w->opts.sync != FILE_SYNC_NONE && fdatasync(w->fd) < 0 && !ret)
+        ret = AVERROR(errno);
+
+    if (close(w->fd) < 0 && !ret)
+        ret = AVERROR(errno);
+
+    /* the buffer comes from posix_memalign(), not from av_malloc() */
+    free((*pb)->buffer);
+    (*pb)->buffer = NULL;
+    avio_context_free(pb);
+    av_free(w);
+
+    return ret;
+}
@@ -0,0 +1,98 @@
+/**
+ * @file
+ * Output AVIO backend writing local files through a large aligned buffer.
+ *
+ * Compared to avio_open(), each write(2) covers a whole buffer, the file
+ * grows by preallocated extents, and how often data is forced to the disk
+ * is selectable.
+ */
+
+#ifndef FILE_WRITER_H
+#define FILE_WRITER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include <libavformat/avio.h>
+
+/**
+ * Default interval of FILE_SYNC_PERIODIC, in microseconds.
+ */
+#define FILE_WRITER_DEFAULT_SYNC_INTERVAL 10000000
+
+/**
+ * When written data is forced to the disk with fdatasync(2).
+ */
+typedef enum FileSyncPolicy {
+    FILE_SYNC_NONE,         ///< left to the kernel
+    FILE_SYNC_PERIODIC,     ///< every sync_interval, and when the file is closed
+    FILE_SYNC_CLOSE,        ///< when the file is closed, i.e. on each rotation
+} FileSyncPolicy;
+
+typedef struct FileWriterOptions {
+    /**
+     * Size of the write buffer in bytes, rounded up to a page.
+     * 0 disables the backend and files are opened with avio_open().
+     */
+    int buffer_size;
+
+    /**
+     * Reserve disk space in steps of this many bytes ahead of the data
+     * with fallocate(2), so that concurrent recordings do not interleave
+     * their blocks. Unused space is released on close. 0 disables it.
+     */
+    int64_t prealloc_size;
+
+    FileSyncPolicy sync;
+
+    /**
+     * Interval of FILE_SYNC_PERIODIC, in microseconds.
+     */
+    int64_t sync_interval;
+
+    /**
+     * Queue the writes to the io_uring shared by all files instead of
+     * blocking in pwrite(2), so that a slow disk holds up neither the
+     * muxer nor the reader. Falls back to pwrite(2) where io_uring is not
+     * available.
+     */
+    int io_uring;
+} FileWriterOptions;
+
+/**
+ * Fill opts with the default settings, which disable the backend.
+ */
+void file_writer_options_default(FileWriterOptions *opts);
+
+/**
+ * Parse a sync policy name: "none", "periodic" or "close".
+ *
+ * @return the policy, or a negative value if the name is unknown
+ */
+int file_writer_parse_sync(const char *name);
+
+/**
+ * Create or truncate filename and open a seekable write context on it.
+ *
+ * @return 0 on success, a negative AVERROR code otherwise
+ */
+int file_writer_open(AVIOContext **pb, const char *filename,
+                     const FileWriterOptions *opts);
+
+/**
+ * Flush and close a context opened with file_writer_open(), then set *pb
+ * to NULL.
+ *
+ * @return 0 on success, a negative AVERROR code if data could not be
+ *         written or synced
+ */
+int file_writer_close(AVIOContext **pb);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,199 @@
+/**
+ * @file
+ * Write throughput of avio_open() against the file writer backend.
+ *
+ * Both contexts receive the same data in chunks the size of a typical
+ * video packet, and each file is closed, syncing it if asked, before the
+ * clock stops. The backends take turns and the fastest run of each is
+ * reported.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libavformat/avio.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include <libavutil/time.h>
+
+#include "file_writer.h"
+
+#define BENCH_CHUNK_SIZE (64 * 1024)
+
+static int bench_write(AVIOContext *pb, const uint8_t *chunk, int64_t total)
+{
+    int64_t done;
+
+    for (done = 0; done < total; done += BENCH_CHUNK_SIZE)
+        avio_write(pb, chunk, BENCH_CHUNK_SIZE);
+    avio_flush(pb);
+
+    return pb->error;
+}
+
+static int bench_avio(const char *filename, const uint8_t *chunk, int64_t total,
+                      int sync)
+{
+    AVIOContext *pb = NULL;
+    int ret, err;
+
+    ret = avio_open(&pb, filename, AVIO_FLAG_WRITE);
+    if (ret < 0)
+        return ret;
+
+    ret = bench_write(pb, chunk, total);
+    err = avio_closep(&pb);
+    if (ret < 0 || err < 0)
+        return ret < 0 ? ret : err;
+
+    /* the file protocol does not sync, do it through another descriptor */
+    if (sync) {
+        int fd = open(filename, O_WRONLY | O_CLOEXEC);
+
+        if (fd < 0 || fdatasync(fd) < 0)
+            ret = AVERROR(errno);
+        if (fd >= 0)
+            close(fd);
+    }
+
+    return ret;
+}
+
+static int bench_file_writer(const char *filename, const uint8_t *chunk,
+                             int64_t total, const FileWriterOptions *opts)
+{
+    AVIOContext *pb = NULL;
+    int ret, err;
+
+    ret = file_writer_open(&pb, filename, opts);
+    if (ret < 0)
+        return ret;
+
+    ret = bench_write(pb, chunk, total);
+
+    err = file_writer_close(&pb);
+    return ret < 0 ? ret : err;
+}
+
+/**
+ * Time one run of a backend, after flushing what previous runs left in
+ * the page cache so it does not count against this one.
+ *
+ * @return the elapsed time in microseconds, or a negative AVERROR code
+ */
+static int64_t bench_run(int file_writer, const char *dir, const uint8_t *chunk,
+                         int64_t total, const FileWriterOptions *opts)
+{
+    char filename[4096];
+    int64_t start;
+    int ret;
+
+    snprintf(filename, sizeof(filename), "%s/file_writer_bench.%s", dir,
+             file_writer ? "fw" : "avio");
+    sync();
+
+    start = av_gettime_relative();
+    if (file_writer)
+        ret = bench_file_writer(filename, chunk, total, opts);
+    else
+        ret = bench_avio(filename, chunk, total, opts->sync != FILE_SYNC_NONE);
+    if (ret >= 0)
+        ret = 0;
+
+    unlink(filename);
+    return ret < 0 ? ret : av_gettime_relative() - start;
+}
+
+static void bench_report(const char *name, int64_t total, int64_t elapsed)
+{
+    printf("%-12s %8.1f MiB/s  (%"PRId64" ms)\n", name,
+           (double)total / (1024 * 1024) / ((double)elapsed / AV_TIME_BASE),
+           elapsed / 1000);
+}
+
+int main(int argc, char **argv)
+{
+    FileWriterOptions opts;
+    const char *dir;
+    uint8_t *chunk;
+    int64_t total = 1024LL * 1024 * 1024, best[2] = { 0 };
+    int rounds = 3, ch, i;
+
+    file_writer_options_default(&opts);
+    opts.buffer_size = 1024 * 1024;
+
+    while ((ch = getopt(argc, argv, "n:r:w:p:y:u")) != -1) {
+        switch (ch) {
+        case 'n':
+            total = (int64_t)atoi(optarg) * 1024 * 1024;
+            break;
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        case 'w':
+            opts.buffer_size = atoi(optarg) * 1024;
+            break;
+        case 'p':
+            opts.prealloc_size = (int64_t)atoi(optarg) * 1024 * 1024;
+            break;
+        case 'y':
+            opts.sync = file_writer_parse_sync(optarg);
+            break;
+        case 'u':
+            opts.io_uring = 1;
+            break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+
+    if (optind != argc - 1 || total <= 0 || rounds <= 0 ||
+        opts.buffer_size <= 0 || opts.prealloc_size < 0 || (int)opts.sync < 0) {
+        printf("usage: %s [-n <MiB>] [-r <rounds>] [-w <KiB>] [-p <MiB>]"
+               " [-y <sync policy>] [-u] directory\n"
+               "Write the same data through avio_open() and through the file"
+               " writer, and print the throughput of each.\n"
+               "-n:  amount of data written to each file (default 1024)\n"
+               "-r:  runs of each backend, the fastest is reported (default 3)\n"
+               "-w:  buffer size of the file writer (default 1024)\n"
+               "-p:  preallocation step of the file writer\n"
+               "-y:  sync policy of the file writer: none (default), periodic,"
+               " close; avio_open() files are synced on close unless none\n"
+               "-u:  write through io_uring when available\n", argv[0]);
+        return 1;
+    }
+    dir = argv[optind];
+
+    chunk = av_malloc(BENCH_CHUNK_SIZE);
+    if (!chunk)
+        return 1;
+    for (i = 0; i < BENCH_CHUNK_SIZE; i++)
+        chunk[i] = i * 131;
+
+    /* alternate the backends so neither always runs on a cold disk */
+    for (i = 0; i < 2 * rounds; i++) {
+        int file_writer = (i + i / 2) % 2;
+        int64_t elapsed = bench_run(file_writer, dir, chunk, total, &opts);
+
+        if (elapsed < 0) {
+            fprintf(stderr, "%s: %s\n", file_writer ? "file_writer" : "avio_open",
+                    av_err2str((int)elapsed));
+            av_free(chunk);
+            return 1;
+        }
+        if (!best[file_writer] || elapsed < best[file_writer])
+            best[file_writer] = elapsed;
+    }
+
+    bench_report("avio_open", total, best[0]);
+    bench_report("file_writer", total, best[1]);
+
+    av_free(chunk);
+    return 0;
+}
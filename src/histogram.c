@@ -0,0 +1,67 @@
+/**
+ * @file
+ * Implementation of the histogram.
+ */
+
+#include <stdatomic.h>
+
+#include <libavutil/common.h>
+#include <libavutil/mem.h>
+
+#include "histogram.h"
+
+struct Histogram {
+    atomic_int_least64_t count;
+    atomic_int_least64_t sum;
+    atomic_int_least64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+Histogram *histogram_alloc(void)
+{
+    Histogram *h = av_mallocz(sizeof(*h));
+    int i;
+
+    if (!h)
+        return NULL;
+
+    atomic_init(&h->count, 0);
+    atomic_init(&h->sum, 0);
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+        atomic_init(&h->buckets[i], 0);
+
+    return h;
+}
+
+void histogram_free(Histogram **h)
+{
+    av_freep(h);
+}
+
+void histogram_record(Histogram *h, int64_t value)
+{
+    int i = 0;
+
+    if (value > 0)
+        i = FFMIN(64 - __builtin_clzll(value), HISTOGRAM_BUCKETS - 1);
+    else
+        value = 0;
+
+    atomic_fetch_add_explicit(&h->buckets[i], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, value, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+}
+
+void histogram_read(const Histogram *h, HistogramSnapshot *snap)
+{
+    int i;
+
+    snap->count = atomic_load_explicit(&h->count, memory_order_relaxed);
+    snap->sum = atomic_load_explicit(&h->sum, memory_order_relaxed);
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+        snap->buckets[i] = atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+}
+
+int64_t histogram_bucket_limit(int i)
+{
+    return i < HISTOGRAM_BUCKETS - 1 ? INT64_C(1) << i : INT64_MAX;
+}
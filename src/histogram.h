@@ -0,0 +1,65 @@
+/**
+ * @file
+ * Lock-free histogram of durations or sizes in power-of-two buckets.
+ *
+ * Recording is a couple of relaxed atomic additions, so that it can stay
+ * enabled on the packet path of every session.
+ */
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/**
+ * Number of buckets. Bucket i counts the values below 2^i not counted by
+ * the previous buckets; the last one counts every larger value as well.
+ */
+#define HISTOGRAM_BUCKETS 32
+
+typedef struct Histogram Histogram;
+
+/**
+ * Copy of the counters of a histogram.
+ */
+typedef struct HistogramSnapshot {
+    int64_t count;
+    int64_t sum;
+    int64_t buckets[HISTOGRAM_BUCKETS];
+} HistogramSnapshot;
+
+/**
+ * @return a new empty histogram, or NULL on failure
+ */
+Histogram *histogram_alloc(void);
+
+/**
+ * Free the histogram and set *h to NULL.
+ */
+void histogram_free(Histogram **h);
+
+/**
+ * Count value, negative values as 0. Safe to call from any thread.
+ */
+void histogram_record(Histogram *h, int64_t value);
+
+/**
+ * Read the counters of the histogram. Safe to call from any thread; the
+ * counters are read one by one, not as an atomic whole.
+ */
+void histogram_read(const Histogram *h, HistogramSnapshot *snap);
+
+/**
+ * @return the exclusive upper bound of bucket i, INT64_MAX for the last one
+ */
+int64_t histogram_bucket_limit(int i);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
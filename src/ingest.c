@@ -0,0 +1,889 @@
+/**
+ * @file
+ * Implementation of the HTTP-FLV ingestion engine.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libavutil/error.h>
+#include <libavutil/intreadwrite.h>
+#include <libavutil/mem.h>
+#include <libavutil/time.h>
+
+#include "ingest.h"
+#include "thread_pool.h"
+
+#ifdef __linux__
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "curl_input.h"
+
+#define LOOP_MAX_EVENTS 64
+
+/**
+ * Size of the read context buffer of a stream.
+ */
+#define STREAM_AVIO_SIZE 32768
+
+/**
+ * Media time of audio, in milliseconds, that makes an audio-only stream
+ * ready to be opened.
+ */
+#define STREAM_OPEN_AUDIO_MS 1000
+
+enum {
+    STREAM_OP_START   = 1 << 0,     ///< (re)start the transfer at start_at
+    STREAM_OP_UNPAUSE = 1 << 1,     ///< the reader drained the buffer
+    STREAM_OP_STOP    = 1 << 2,     ///< detach the stream from the loop
+};
+
+typedef struct IngestLoop {
+    IngestEngine *engine;
+    pthread_t thread;
+    int epfd;
+    int evfd;
+    CURLM *multi;
+    int64_t timeout;            ///< when libcurl wants to be called, or -1
+
+    /* guards streams and the ops of every stream of the loop */
+    pthread_mutex_t lock;
+    IngestStream **streams;
+    int nb_streams;
+    atomic_int load;
+    int exiting;
+} IngestLoop;
+
+struct IngestEngine {
+    IngestLoop *loops;
+    int nb_loops;
+    ThreadPool *workers;
+};
+
+struct IngestStream {
+    IngestLoop *loop;
+    void (*on_data)(void *opaque);
+    void *opaque;
+
+    /* loop side */
+    CURL *easy;
+    struct curl_slist *headers;
+    int attached;               ///< easy is added to the multi handle
+    int ops;                    ///< STREAM_OP_*, guarded by loop->lock
+    int64_t start_at;
+    char *next_url;             ///< URL of the next start, guarded by loop->lock
+    int detached;
+
+    /* shared with the reader, guarded by lock */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint8_t *buf;
+    int buf_size;
+    int buf_len;
+    int64_t buf_start;          ///< offset of buf[0]
+    int64_t read_pos;           ///< offset of the next byte to read
+    int paused;
+    int stale;                  ///< restarted, drop what the old transfer sends
+    int eof;
+    int error;                  ///< how reads end after eof
+    int aborted;
+    int64_t stall_limit;        ///< see ingest_stream_set_stall_limit()
+    int64_t last_data;          ///< when data last arrived, 0 before the first
+
+    /* FLV tag scanner */
+    int header_done;
+    int64_t tag_pos;            ///< offset of the next tag header
+    int64_t pending_end;        ///< end of the last tag whose header was seen
+    int64_t complete_end;       ///< end of the last complete tag
+    int64_t first_audio_ms;
+    int open_ready;
+};
+
+static void loop_wake(IngestLoop *loop)
+{
+    uint64_t one = 1;
+
+    if (write(loop->evfd, &one, sizeof(one)) < 0) {
+        /* the counter is already non-zero, the loop will wake up anyway */
+    }
+}
+
+/**
+ * Advance over the FLV tags that are complete in the buffer. Only the
+ * first bytes of a tag are looked at, so its body can be read and dropped
+ * before it is complete. Called with st->lock held.
+ */
+static void stream_scan(IngestStream *st)
+{
+    int64_t end = st->buf_start + st->buf_len;
+
+    if (!st->header_done) {
+        if (st->buf_start > 0 || st->buf_len < 9)
+            return;
+        /* FLV header, then the first PreviousTagSize */
+        st->tag_pos = AV_RB32(st->buf + 5) + 4;
+        st->pending_end = st->tag_pos;
+        st->header_done = 1;
+    }
+
+    while (st->pending_end <= end) {
+        const uint8_t *p;
+        int type, size;
+        int64_t ms;
+
+        st->complete_end = st->pending_end;
+
+        /* tag header and the first two bytes of the body */
+        if (end - st->tag_pos < 13)
+            break;
+
+        p = st->buf + (st->tag_pos - st->buf_start);
+        type = p[0] & 0x1f;
+        size = AV_RB24(p + 1);
+        ms = AV_RB24(p + 4) | (int64_t)p[7] << 24;
+
+        if (!st->open_ready) {
+            /* a coded keyframe, not the sequence header */
+            if (type == 9 && size >= 2 && (p[11] >> 4) == 1 && p[12] == 1)
+                st->open_ready = 1;
+            if (type == 8) {
+                if (st->first_audio_ms < 0)
+                    st->first_audio_ms = ms;
+                else if (ms - st->first_audio_ms >= STREAM_OPEN_AUDIO_MS)
+                    st->open_ready = 1;
+            }
+        }
+
+        st->tag_pos += 11 + size + 4;
+        st->pending_end = st->tag_pos;
+    }
+}
+
+/* Called with st->lock held. */
+static void stream_reset(IngestStream *st)
+{
+    st->buf_len = 0;
+    st->buf_start = 0;
+    st->read_pos = 0;
+    st->paused = 0;
+    st->eof = 0;
+    st->error = 0;
+    st->last_data = 0;
+    st->header_done = 0;
+    st->tag_pos = 0;
+    st->pending_end = 0;
+    st->complete_end = 0;
+    st->first_audio_ms = -1;
+    st->open_ready = 0;
+}
+
+static size_t stream_write(char *data, size_t size, size_t nmemb, void *userp)
+{
+    IngestStream *st = userp;
+    size_t len = size * nmemb;
+    int64_t keep_from;
+    int drop;
+
+    pthread_mutex_lock(&st->lock);
+
+    if (st->aborted) {
+        pthread_mutex_unlock(&st->lock);
+        return 0;
+    }
+    if (st->stale) {
+        pthread_mutex_unlock(&st->lock);
+        return len;
+    }
+
+    /* forget what both the reader and the scanner are done with */
+    keep_from = FFMIN(st->read_pos, st->header_done ? st->tag_pos : 0);
+    drop = keep_from - st->buf_start;
+    if (drop > 0) {
+        memmove(st->buf, st->buf + drop, st->buf_len - drop);
+        st->buf_len -= drop;
+        st->buf_start += drop;
+    }
+
+    /*
+     * Only pause while the reader has complete tags left, a tag larger than
+     * the buffer must be received whole before a step can read on.
+     */
+    if (st->buf_len >= INGEST_DEFAULT_BUFFER_SIZE &&
+        st->complete_end > st->read_pos + 4) {
+        /* libcurl hands the same data again once unpaused */
+        st->paused = 1;
+        pthread_mutex_unlock(&st->lock);
+        st->on_data(st->opaque);
+        return CURL_WRITEFUNC_PAUSE;
+    }
+
+    if (st->buf_len + len > st->buf_size) {
+        int new_size = FFMAX(st->buf_len + len, st->buf_size * 2);
+        uint8_t *buf = av_realloc(st->buf, new_size);
+
+        if (!buf) {
+            pthread_mutex_unlock(&st->lock);
+            return 0;
+        }
+        st->buf = buf;
+        st->buf_size = new_size;
+    }
+
+    memcpy(st->buf + st->buf_len, data, len);
+    st->buf_len += len;
+    st->last_data = av_gettime_relative();
+    stream_scan(st);
+
+    pthread_cond_broadcast(&st->cond);
+    pthread_mutex_unlock(&st->lock);
+
+    st->on_data(st->opaque);
+
+    return len;
+}
+
+static void stream_finish(IngestStream *st, CURLcode res)
+{
+    long code = 0;
+
+    curl_easy_getinfo(st->easy, CURLINFO_RESPONSE_CODE, &code);
+
+    pthread_mutex_lock(&st->lock);
+    if (st->stale) {
+        pthread_mutex_unlock(&st->lock);
+        return;
+    }
+    st->eof = 1;
+    if (res == CURLE_OK && code < 400)
+        st->error = AVERROR_EOF;
+    else if (code >= 400)
+        st->error = code == 404 ? AVERROR_HTTP_NOT_FOUND :
+                    code == 403 ? AVERROR_HTTP_FORBIDDEN :
+                    code >= 500 ? AVERROR_HTTP_SERVER_ERROR : AVERROR_HTTP_OTHER_4XX;
+    else if (res == CURLE_OPERATION_TIMEDOUT)
+        st->error = AVERROR(ETIMEDOUT);
+    else
+        st->error = AVERROR(EIO);
+    pthread_cond_broadcast(&st->cond);
+    pthread_mutex_unlock(&st->lock);
+
+    st->on_data(st->opaque);
+}
+
+static int loop_socket(CURL *easy, curl_socket_t s, int what, void *userp,
+                       void *socketp)
+{
+    IngestLoop *loop = userp;
+    struct epoll_event ev = { 0 };
+
+    if (what == CURL_POLL_REMOVE) {
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, s, NULL);
+        curl_multi_assign(loop->multi, s, NULL);
+        return 0;
+    }
+
+    ev.events = (what & CURL_POLL_IN  ? EPOLLIN  : 0) |
+                (what & CURL_POLL_OUT ? EPOLLOUT : 0);
+    ev.data.fd = s;
+
+    if (socketp) {
+        epoll_ctl(loop->epfd, EPOLL_CTL_MOD, s, &ev);
+    } else {
+        epoll_ctl(loop->epfd, EPOLL_CTL_ADD, s, &ev);
+        curl_multi_assign(loop->multi, s, loop);
+    }
+
+    return 0;
+}
+
+static int loop_timer(CURLM *multi, long timeout_ms, void *userp)
+{
+    IngestLoop *loop = userp;
+
+    loop->timeout = timeout_ms < 0 ? -1 : av_gettime_relative() + timeout_ms * 1000;
+    return 0;
+}
+
+static void loop_check_done(IngestLoop *loop)
+{
+    CURLMsg *msg;
+    int left;
+
+    while ((msg = curl_multi_info_read(loop->multi, &left))) {
+        IngestStream *st;
+
+        if (msg->msg != CURLMSG_DONE)
+            continue;
+
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&st);
+        stream_finish(st, msg->data.result);
+        curl_multi_remove_handle(loop->multi, st->easy);
+        st->attached = 0;
+    }
+}
+
+static void stream_start(IngestLoop *loop, IngestStream *st, char *url)
+{
+    if (url)
+        curl_easy_setopt(st->easy, CURLOPT_URL, url);
+    av_free(url);
+
+    pthread_mutex_lock(&st->lock);
+    st->stale = 0;
+    pthread_mutex_unlock(&st->lock);
+
+    if (curl_multi_add_handle(loop->multi, st->easy) != CURLM_OK) {
+        stream_finish(st, CURLE_FAILED_INIT);
+        return;
+    }
+    st->attached = 1;
+}
+
+/**
+ * When the transfer of st is to be ended as stalled, or -1 if it is not
+ * watched right now. Called with st->lock held.
+ */
+static int64_t stream_stall_due(IngestStream *st)
+{
+    /* a paused transfer receives nothing on purpose */
+    if (!st->stall_limit || !st->last_data || st->paused || st->eof)
+        return -1;
+    return st->last_data + st->stall_limit;
+}
+
+/**
+ * Carry out the operations requested on the streams of the loop, and end
+ * the transfers that stalled.
+ *
+ * @return when the next delayed start or stall check is due, or -1
+ */
+static int64_t loop_run_ops(IngestLoop *loop)
+{
+    int64_t now = av_gettime_relative();
+    int64_t next = -1;
+    int i;
+
+    pthread_mutex_lock(&loop->lock);
+    for (i = 0; i < loop->nb_streams; i++) {
+        IngestStream *st = loop->streams[i];
+        char *url;
+
+        if (st->ops & STREAM_OP_STOP) {
+            if (st->attached)
+                curl_multi_remove_handle(loop->multi, st->easy);
+            st->attached = 0;
+            loop->streams[i--] = loop->streams[--loop->nb_streams];
+            atomic_fetch_sub(&loop->load, 1);
+
+            pthread_mutex_lock(&st->lock);
+            st->detached = 1;
+            pthread_cond_broadcast(&st->cond);
+            pthread_mutex_unlock(&st->lock);
+            continue;
+        }
+
+        if (st->ops & STREAM_OP_UNPAUSE) {
+            st->ops &= ~STREAM_OP_UNPAUSE;
+            if (st->attached)
+                curl_easy_pause(st->easy, CURLPAUSE_CONT);
+
+            /* the gap while paused was not the sender's */
+            pthread_mutex_lock(&st->lock);
+            if (st->last_data)
+                st->last_data = now;
+            pthread_mutex_unlock(&st->lock);
+        }
+
+        if (st->ops & STREAM_OP_START) {
+            if (st->attached) {
+                curl_multi_remove_handle(loop->multi, st->easy);
+                st->attached = 0;
+            }
+            if (st->start_at > now) {
+                if (next < 0 || st->start_at < next)
+                    next = st->start_at;
+                continue;
+            }
+            st->ops &= ~STREAM_OP_START;
+            url = st->next_url;
+            st->next_url = NULL;
+            stream_start(loop, st, url);
+        }
+
+        if (st->attached) {
+            int64_t due;
+
+            pthread_mutex_lock(&st->lock);
+            due = stream_stall_due(st);
+            pthread_mutex_unlock(&st->lock);
+
+            if (due >= 0 && due <= now) {
+                /* reads then end with AVERROR(ETIMEDOUT) */
+                curl_multi_remove_handle(loop->multi, st->easy);
+                st->attached = 0;
+                stream_finish(st, CURLE_OPERATION_TIMEDOUT);
+            } else if (due >= 0 && (next < 0 || due < next)) {
+                next = due;
+            }
+        }
+    }
+    pthread_mutex_unlock(&loop->lock);
+
+    return next;
+}
+
+static void *loop_thread(void *arg)
+{
+    IngestLoop *loop = arg;
+    struct epoll_event events[LOOP_MAX_EVENTS];
+    int running;
+
+    for (;;) {
+        int64_t next_start, deadline;
+        int timeout_ms = -1;
+        int exiting, n, i;
+
+        next_start = loop_run_ops(loop);
+
+        pthread_mutex_lock(&loop->lock);
+        exiting = loop->exiting;
+        pthread_mutex_unlock(&loop->lock);
+        if (exiting)
+            break;
+
+        deadline = loop->timeout;
+        if (next_start >= 0 && (deadline < 0 || next_start < deadline))
+            deadline = next_start;
+        if (deadline >= 0)
+            timeout_ms = FFMAX(deadline - av_gettime_relative() + 999, 0) / 1000;
+
+        n = epoll_wait(loop->epfd, events, LOOP_MAX_EVENTS, timeout_ms);
+
+        for (i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            int mask = 0;
+
+            if (fd == loop->evfd) {
+                uint64_t count;
+                if (read(loop->evfd, &count, sizeof(count)) < 0) {
+                    /* nothing to read, another wakeup consumed it */
+                }
+                continue;
+            }
+
+            if (events[i].events & EPOLLIN)
+                mask |= CURL_CSELECT_IN;
+            if (events[i].events & EPOLLOUT)
+                mask |= CURL_CSELECT_OUT;
+            if (events[i].events & (EPOLLERR | EPOLLHUP))
+                mask |= CURL_CSELECT_ERR;
+            curl_multi_socket_action(loop->multi, fd, mask, &running);
+        }
+
+        if (loop->timeout >= 0 && av_gettime_relative() >= loop->timeout) {
+            loop->timeout = -1;
+            curl_multi_socket_action(loop->multi, CURL_SOCKET_TIMEOUT, 0, &running);
+        }
+
+        loop_check_done(loop);
+    }
+
+    return NULL;
+}
+
+static int loop_init(IngestEngine *e, IngestLoop *loop)
+{
+    struct epoll_event ev = { 0 };
+
+    loop->engine = e;
+    loop->timeout = -1;
+    atomic_init(&loop->load, 0);
+
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    loop->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    loop->multi = curl_multi_init();
+    if (loop->epfd < 0 || loop->evfd < 0 || !loop->multi)
+        return AVERROR(ENOMEM);
+
+    ev.events = EPOLLIN;
+    ev.data.fd = loop->evfd;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->evfd, &ev) < 0)
+        return AVERROR(errno);
+
+    curl_multi_setopt(loop->multi, CURLMOPT_SOCKETFUNCTION, loop_socket);
+    curl_multi_setopt(loop->multi, CURLMOPT_SOCKETDATA, loop);
+    curl_multi_setopt(loop->multi, CURLMOPT_TIMERFUNCTION, loop_timer);
+    curl_multi_setopt(loop->multi, CURLMOPT_TIMERDATA, loop);
+    /* streams from the same CDN host share one HTTP/2 connection */
+    curl_multi_setopt(loop->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+
+    pthread_mutex_init(&loop->lock, NULL);
+
+    if (pthread_create(&loop->thread, NULL, loop_thread, loop)) {
+        pthread_mutex_destroy(&loop->lock);
+        return AVERROR(EAGAIN);
+    }
+
+    return 0;
+}
+
+static void loop_uninit(IngestLoop *loop, int started)
+{
+    if (started) {
+        pthread_mutex_lock(&loop->lock);
+        loop->exiting = 1;
+        pthread_mutex_unlock(&loop->lock);
+        loop_wake(loop);
+        pthread_join(loop->thread, NULL);
+        pthread_mutex_destroy(&loop->lock);
+    }
+
+    if (loop->multi)
+        curl_multi_cleanup(loop->multi);
+    if (loop->evfd >= 0)
+        close(loop->evfd);
+    if (loop->epfd >= 0)
+        close(loop->epfd);
+    av_freep(&loop->streams);
+}
+
+IngestEngine *ingest_engine_create(int nb_loops)
+{
+    IngestEngine *e;
+
+    if (nb_loops <= 0)
+        nb_loops = FFMAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+
+    e = av_mallocz(sizeof(*e));
+    if (!e)
+        return NULL;
+
+    e->loops = av_mallocz_array(nb_loops, sizeof(*e->loops));
+    e->workers = thread_pool_create(nb_loops);
+    if (!e->loops || !e->workers) {
+        ingest_engine_free(&e);
+        return NULL;
+    }
+
+    for (; e->nb_loops < nb_loops; e->nb_loops++) {
+        IngestLoop *loop = &e->loops[e->nb_loops];
+
+        loop->epfd = loop->evfd = -1;
+        if (loop_init(e, loop) < 0) {
+            loop_uninit(loop, 0);
+            ingest_engine_free(&e);
+            return NULL;
+        }
+    }
+
+    return e;
+}
+
+void ingest_engine_free(IngestEngine **pe)
+{
+    IngestEngine *e = *pe;
+    int i;
+
+    if (!e)
+        return;
+
+    for (i = 0; i < e->nb_loops; i++)
+        loop_uninit(&e->loops[i], 1);
+    thread_pool_free(&e->workers);
+    av_freep(&e->loops);
+    av_freep(pe);
+}
+
+int ingest_engine_submit(IngestEngine *e, void (*func)(void *arg), void *arg)
+{
+    return thread_pool_submit(e->workers, func, arg);
+}
+
+IngestStream *ingest_stream_open(IngestEngine *e, const char *url,
+                                 const char *http_headers,
+                                 void (*on_data)(void *opaque), void *opaque)
+{
+    IngestLoop *loop = &e->loops[0];
+    IngestStream *st;
+    int i, ret;
+
+    for (i = 1; i < e->nb_loops; i++) {
+        if (atomic_load(&e->loops[i].load) < atomic_load(&loop->load))
+            loop = &e->loops[i];
+    }
+
+    st = av_mallocz(sizeof(*st));
+    if (!st)
+        return NULL;
+
+    st->loop = loop;
+    st->on_data = on_data;
+    st->opaque = opaque;
+    st->easy = curl_easy_init();
+    st->next_url = av_strdup(url);
+    if (http_headers)
+        st->headers = curl_input_headers(http_headers);
+
+    if (!st->easy || !st->next_url) {
+        curl_slist_free_all(st->headers);
+        if (st->easy)
+            curl_easy_cleanup(st->easy);
+        av_free(st->next_url);
+        av_free(st);
+        return NULL;
+    }
+
+    pthread_mutex_init(&st->lock, NULL);
+    pthread_cond_init(&st->cond, NULL);
+    stream_reset(st);
+
+    curl_input_setup(st->easy);
+    curl_easy_setopt(st->easy, CURLOPT_PRIVATE, st);
+    curl_easy_setopt(st->easy, CURLOPT_WRITEFUNCTION, stream_write);
+    curl_easy_setopt(st->easy, CURLOPT_WRITEDATA, st);
+    curl_easy_setopt(st->easy, CURLOPT_HTTPHEADER, st->headers);
+
+    pthread_mutex_lock(&loop->lock);
+    ret = av_dynarray_add_nofree(&loop->streams, &loop->nb_streams, st);
+    if (ret >= 0) {
+        st->ops = STREAM_OP_START;
+        st->start_at = 0;
+        atomic_fetch_add(&loop->load, 1);
+    }
+    pthread_mutex_unlock(&loop->lock);
+
+    if (ret < 0) {
+        st->detached = 1;
+        ingest_stream_close(&st);
+        return NULL;
+    }
+
+    loop_wake(loop);
+    return st;
+}
+
+int ingest_stream_restart(IngestStream *st, const char *url, int64_t delay)
+{
+    IngestLoop *loop = st->loop;
+    char *next_url = av_strdup(url);
+
+    if (!next_url)
+        return AVERROR(ENOMEM);
+
+    pthread_mutex_lock(&loop->lock);
+    pthread_mutex_lock(&st->lock);
+    stream_reset(st);
+    st->stale = 1;
+    pthread_mutex_unlock(&st->lock);
+
+    av_free(st->next_url);
+    st->next_url = next_url;
+    st->start_at = av_gettime_relative() + delay;
+    st->ops |= STREAM_OP_START;
+    pthread_mutex_unlock(&loop->lock);
+
+    loop_wake(loop);
+    return 0;
+}
+
+void ingest_stream_set_stall_limit(IngestStream *st, int64_t limit)
+{
+    int wake;
+
+    pthread_mutex_lock(&st->lock);
+    wake = !st->stall_limit && limit;
+    st->stall_limit = limit;
+    pthread_mutex_unlock(&st->lock);
+
+    /*
+     * Only a loop not watching the stream yet needs to be woken up, a
+     * lower limit is applied by the check already due under the old one.
+     */
+    if (wake)
+        loop_wake(st->loop);
+}
+
+void ingest_stream_abort(IngestStream *st)
+{
+    pthread_mutex_lock(&st->lock);
+    st->aborted = 1;
+    pthread_cond_broadcast(&st->cond);
+    pthread_mutex_unlock(&st->lock);
+}
+
+void ingest_stream_close(IngestStream **pst)
+{
+    IngestStream *st = *pst;
+    IngestLoop *loop;
+
+    if (!st)
+        return;
+    loop = st->loop;
+
+    if (!st->detached) {
+        pthread_mutex_lock(&loop->lock);
+        st->ops |= STREAM_OP_STOP;
+        pthread_mutex_unlock(&loop->lock);
+        loop_wake(loop);
+
+        pthread_mutex_lock(&st->lock);
+        while (!st->detached)
+            pthread_cond_wait(&st->cond, &st->lock);
+        pthread_mutex_unlock(&st->lock);
+    }
+
+    curl_easy_cleanup(st->easy);
+    curl_slist_free_all(st->headers);
+    pthread_cond_destroy(&st->cond);
+    pthread_mutex_destroy(&st->lock);
+    av_free(st->next_url);
+    av_free(st->buf);
+    av_freep(pst);
+}
+
+int ingest_stream_ready(IngestStream *st, int64_t pos)
+{
+    int ready;
+
+    pthread_mutex_lock(&st->lock);
+    if (st->eof || st->aborted)
+        ready = 1;
+    else if (pos < 0)
+        ready = st->open_ready || st->paused;
+    else
+        /* pos may still be before the PreviousTagSize of the last tag */
+        ready = st->complete_end > pos + 4;
+    pthread_mutex_unlock(&st->lock);
+
+    return ready;
+}
+
+static int stream_read(void *opaque, uint8_t *buf, int buf_size)
+{
+    IngestStream *st = opaque;
+    int avail, ret;
+
+    pthread_mutex_lock(&st->lock);
+    for (;;) {
+        avail = st->buf_start + st->buf_len - st->read_pos;
+        if (st->aborted || avail > 0 || st->eof)
+            break;
+        pthread_cond_wait(&st->cond, &st->lock);
+    }
+
+    if (st->aborted) {
+        ret = AVERROR_EXIT;
+    } else if (!avail) {
+        ret = st->error;
+    } else {
+        ret = FFMIN(avail, buf_size);
+        memcpy(buf, st->buf + (st->read_pos - st->buf_start), ret);
+        st->read_pos += ret;
+
+        /* also resume once only an incomplete tag is left to read */
+        if (st->paused &&
+            (st->buf_start + st->buf_len - st->read_pos < INGEST_DEFAULT_BUFFER_SIZE / 2 ||
+             st->complete_end <= st->read_pos + 4)) {
+            st->paused = 0;
+            pthread_mutex_unlock(&st->lock);
+
+            /* only the loop may touch the transfer */
+            pthread_mutex_lock(&st->loop->lock);
+            st->ops |= STREAM_OP_UNPAUSE;
+            pthread_mutex_unlock(&st->loop->lock);
+            loop_wake(st->loop);
+            return ret;
+        }
+    }
+    pthread_mutex_unlock(&st->lock);
+
+    return ret;
+}
+
+int ingest_stream_open_avio(IngestStream *st, AVIOContext **pb)
+{
+    uint8_t *buffer = av_malloc(STREAM_AVIO_SIZE);
+
+    if (!buffer)
+        return AVERROR(ENOMEM);
+
+    *pb = avio_alloc_context(buffer, STREAM_AVIO_SIZE, 0, st, stream_read,
+                             NULL, NULL);
+    if (!*pb) {
+        av_free(buffer);
+        return AVERROR(ENOMEM);
+    }
+    (*pb)->seekable = 0;
+
+    return 0;
+}
+
+void ingest_stream_close_avio(AVIOContext **pb)
+{
+    if (!*pb)
+        return;
+
+    av_freep(&(*pb)->buffer);
+    avio_context_free(pb);
+}
+
+#else
+
+IngestEngine *ingest_engine_create(int nb_loops)
+{
+    return NULL;
+}
+
+void ingest_engine_free(IngestEngine **e)
+{
+}
+
+int ingest_engine_submit(IngestEngine *e, void (*func)(void *arg), void *arg)
+{
+    return AVERROR(ENOSYS);
+}
+
+IngestStream *ingest_stream_open(IngestEngine *e, const char *url,
+                                 const char *http_headers,
+                                 void (*on_data)(void *opaque), void *opaque)
+{
+    return NULL;
+}
+
+int ingest_stream_restart(IngestStream *st, const char *url, int64_t delay)
+{
+    return AVERROR(ENOSYS);
+}
+
+void ingest_stream_set_stall_limit(IngestStream *st, int64_t limit)
+{
+}
+
+void ingest_stream_abort(IngestStream *st)
+{
+}
+
+void ingest_stream_close(IngestStream **st)
+{
+}
+
+int ingest_stream_ready(IngestStream *st, int64_t pos)
+{
+    return 1;
+}
+
+int ingest_stream_open_avio(IngestStream *st, AVIOContext **pb)
+{
+    return AVERROR(ENOSYS);
+}
+
+void ingest_stream_close_avio(AVIOContext **pb)
+{
+}
+
+#endif
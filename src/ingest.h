@@ -0,0 +1,117 @@
+/**
+ * @file
+ * Non-blocking HTTP-FLV ingestion shared by many sessions.
+ *
+ * Every stream socket is multiplexed with libcurl's multi interface on a
+ * few epoll loops, and received data is buffered per stream. Sessions
+ * using the engine do not own a thread: their demuxing runs on the
+ * engine's workers once complete FLV tags are buffered, so the number of
+ * threads follows the number of cores rather than the number of streams.
+ */
+
+#ifndef INGEST_H
+#define INGEST_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include <libavformat/avio.h>
+
+/**
+ * Bytes buffered per stream before its transfer is paused. A larger FLV
+ * tag is still buffered whole.
+ */
+#define INGEST_DEFAULT_BUFFER_SIZE (4 * 1024 * 1024)
+
+typedef struct IngestEngine IngestEngine;
+typedef struct IngestStream IngestStream;
+
+/**
+ * Start an engine with nb_loops event loops and as many workers.
+ * @param nb_loops number of loops, 0 for one per online CPU
+ *
+ * @return the new engine, or NULL on failure
+ */
+IngestEngine *ingest_engine_create(int nb_loops);
+
+/**
+ * Stop the loops and workers, then free the engine and set *e to NULL.
+ * Every stream must have been closed.
+ */
+void ingest_engine_free(IngestEngine **e);
+
+/**
+ * Queue func(arg) to run on one of the workers of the engine.
+ *
+ * @return 0 on success, a negative AVERROR code otherwise
+ */
+int ingest_engine_submit(IngestEngine *e, void (*func)(void *arg), void *arg);
+
+/**
+ * Start receiving url on the least loaded loop.
+ * @param http_headers extra request headers separated by CRLF, may be NULL
+ * @param on_data called from a loop thread when data or the end of the
+ *                transfer arrives; must not block
+ *
+ * @return the new stream, or NULL on failure
+ */
+IngestStream *ingest_stream_open(IngestEngine *e, const char *url,
+                                 const char *http_headers,
+                                 void (*on_data)(void *opaque), void *opaque);
+
+/**
+ * Drop the buffered data and start a new transfer of url, after delay
+ * microseconds. Offsets start again from 0.
+ *
+ * @return 0 on success, a negative AVERROR code otherwise
+ */
+int ingest_stream_restart(IngestStream *st, const char *url, int64_t delay);
+
+/**
+ * End the transfer as timed out once no data has arrived for limit
+ * microseconds, checked by the loop from the first data on. Reads then
+ * return AVERROR(ETIMEDOUT). A paused transfer is not watched. 0, the
+ * default, disables the check.
+ */
+void ingest_stream_set_stall_limit(IngestStream *st, int64_t limit);
+
+/**
+ * Make every pending and further read of the stream return AVERROR_EXIT.
+ */
+void ingest_stream_abort(IngestStream *st);
+
+/**
+ * Stop the transfer, wait until the loop has let go of the stream, then
+ * free it and set *st to NULL. on_data is not called anymore afterwards.
+ */
+void ingest_stream_close(IngestStream **st);
+
+/**
+ * Whether demuxing can go on without waiting for the network.
+ * @param pos offset the demuxer has reached, or -1 to ask whether enough
+ *            is buffered to open the input: the first video keyframe, or
+ *            one second of audio
+ *
+ * @return 1 if every tag before the next one to read is complete, or the
+ *         transfer has ended, 0 otherwise
+ */
+int ingest_stream_ready(IngestStream *st, int64_t pos);
+
+/**
+ * Create a read context on the buffered data of the stream. Reads wait
+ * for data. Free it with ingest_stream_close_avio().
+ *
+ * @return 0 on success, a negative AVERROR code otherwise
+ */
+int ingest_stream_open_avio(IngestStream *st, AVIOContext **pb);
+
+void ingest_stream_close_avio(AVIOContext **pb);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,343 @@
+/**
+ * @file
+ * Implementation of the packet pipeline and of its built-in stages.
+ */
+
+#include <stdatomic.h>
+#include <string.h>
+
+#include <libavutil/crc.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include <libavutil/time.h>
+
+#include "packet_pipeline.h"
+
+typedef struct StageEntry {
+    PacketStage stage;
+    atomic_int_least64_t batches;
+    atomic_int_least64_t packets_in;
+    atomic_int_least64_t packets_out;
+    atomic_int_least64_t time;
+} StageEntry;
+
+struct PacketPipeline {
+    StageEntry **stages;
+    int nb_stages;
+};
+
+PacketPipeline *packet_pipeline_alloc(void)
+{
+    return av_mallocz(sizeof(PacketPipeline));
+}
+
+void packet_pipeline_free(PacketPipeline **pp)
+{
+    PacketPipeline *p = *pp;
+    int i;
+
+    if (!p)
+        return;
+
+    for (i = 0; i < p->nb_stages; i++) {
+        PacketStage *stage = &p->stages[i]->stage;
+
+        if (stage->free)
+            stage->free(stage->opaque);
+        av_free(p->stages[i]);
+    }
+    av_freep(&p->stages);
+    av_freep(pp);
+}
+
+int packet_pipeline_insert(PacketPipeline *p, int index, const PacketStage *stage)
+{
+    StageEntry *entry;
+    int ret;
+
+    if (!stage->process)
+        return AVERROR(EINVAL);
+
+    entry = av_mallocz(sizeof(*entry));
+    if (!entry)
+        return AVERROR(ENOMEM);
+    entry->stage = *stage;
+    atomic_init(&entry->batches, 0);
+    atomic_init(&entry->packets_in, 0);
+    atomic_init(&entry->packets_out, 0);
+    atomic_init(&entry->time, 0);
+
+    ret = av_dynarray_add_nofree(&p->stages, &p->nb_stages, entry);
+    if (ret < 0) {
+        av_free(entry);
+        return ret;
+    }
+
+    if (index >= 0 && index < p->nb_stages - 1) {
+        memmove(&p->stages[index + 1], &p->stages[index],
+                (p->nb_stages - 1 - index) * sizeof(*p->stages));
+        p->stages[index] = entry;
+    }
+
+    return 0;
+}
+
+int packet_pipeline_nb_stages(const PacketPipeline *p)
+{
+    return p->nb_stages;
+}
+
+int packet_pipeline_run(PacketPipeline *p, const PacketStreams *streams,
+                        AVPacket **pkts, int *nb_pkts)
+{
+    int ret, i;
+
+    for (i = 0; i < p->nb_stages && *nb_pkts; i++) {
+        StageEntry *entry = p->stages[i];
+        int nb_in = *nb_pkts;
+        int64_t start = av_gettime_relative();
+
+        ret = entry->stage.process(entry->stage.opaque, streams, pkts, nb_pkts);
+
+        atomic_fetch_add_explicit(&entry->time, av_gettime_relative() - start,
+                                  memory_order_relaxed);
+        atomic_fetch_add_explicit(&entry->batches, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&entry->packets_in, nb_in, memory_order_relaxed);
+        atomic_fetch_add_explicit(&entry->packets_out, *nb_pkts, memory_order_relaxed);
+        if (ret < 0)
+            return ret;
+    }
+
+    return 0;
+}
+
+int packet_pipeline_get_stats(PacketPipeline *p, PacketStageStats *stats, int max)
+{
+    int i;
+
+    for (i = 0; i < p->nb_stages && i < max; i++) {
+        StageEntry *entry = p->stages[i];
+
+        stats[i].name        = entry->stage.name;
+        stats[i].batches     = atomic_load(&entry->batches);
+        stats[i].packets_in  = atomic_load(&entry->packets_in);
+        stats[i].packets_out = atomic_load(&entry->packets_out);
+        stats[i].time        = atomic_load(&entry->time);
+    }
+
+    return i;
+}
+
+/* Unref pkts[i] and close the gap. */
+static void batch_drop(AVPacket **pkts, int *nb_pkts, int i)
+{
+    AVPacket *dropped = pkts[i];
+
+    av_packet_unref(dropped);
+    memmove(&pkts[i], &pkts[i + 1], (*nb_pkts - i - 1) * sizeof(*pkts));
+    /* keep the blank packet around for the next batch */
+    pkts[--*nb_pkts] = dropped;
+}
+
+static int filter_process(void *opaque, const PacketStreams *streams,
+                          AVPacket **pkts, int *nb_pkts)
+{
+    unsigned types = (uintptr_t)opaque;
+    int i = 0;
+
+    while (i < *nb_pkts) {
+        const AVCodecParameters *par = streams->codecpar[pkts[i]->stream_index];
+
+        if (par->codec_type < 0 || !(types & (1U << par->codec_type)))
+            batch_drop(pkts, nb_pkts, i);
+        else
+            i++;
+    }
+
+    return 0;
+}
+
+int packet_stage_filter(PacketStage *stage, unsigned types)
+{
+    stage->name = "stream filter";
+    stage->process = filter_process;
+    stage->free = NULL;
+    stage->opaque = (void *)(uintptr_t)types;
+
+    return 0;
+}
+
+typedef struct DedupeLast {
+    int64_t dts;
+    int flags;
+    int size;
+    uint32_t crc;
+} DedupeLast;
+
+typedef struct Dedupe {
+    const AVCRC *table;
+    DedupeLast *last;
+    int nb_last;
+} Dedupe;
+
+static int dedupe_process(void *opaque, const PacketStreams *streams,
+                          AVPacket **pkts, int *nb_pkts)
+{
+    Dedupe *d = opaque;
+    int i = 0;
+
+    if (d->nb_last < streams->nb_streams) {
+        DedupeLast *last = av_realloc_array(d->last, streams->nb_streams, sizeof(*last));
+
+        if (!last)
+            return AVERROR(ENOMEM);
+        for (i = d->nb_last; i < streams->nb_streams; i++)
+            last[i].dts = AV_NOPTS_VALUE;
+        d->last = last;
+        d->nb_last = streams->nb_streams;
+        i = 0;
+    }
+
+    while (i < *nb_pkts) {
+        AVPacket *pkt = pkts[i];
+        DedupeLast *last = &d->last[pkt->stream_index];
+        uint32_t crc = av_crc(d->table, 0, pkt->data, pkt->size);
+
+        if (pkt->dts != AV_NOPTS_VALUE && pkt->dts == last->dts &&
+            pkt->flags == last->flags && pkt->size == last->size && crc == last->crc) {
+            batch_drop(pkts, nb_pkts, i);
+            continue;
+        }
+
+        last->dts = pkt->dts;
+        last->flags = pkt->flags;
+        last->size = pkt->size;
+        last->crc = crc;
+        i++;
+    }
+
+    return 0;
+}
+
+static void dedupe_free(void *opaque)
+{
+    Dedupe *d = opaque;
+
+    av_free(d->last);
+    av_free(d);
+}
+
+int packet_stage_dedupe(PacketStage *stage)
+{
+    Dedupe *d = av_mallocz(sizeof(*d));
+    if (!d)
+        return AVERROR(ENOMEM);
+
+    d->table = av_crc_get_table(AV_CRC_32_IEEE);
+
+    stage->name = "dedupe";
+    stage->process = dedupe_process;
+    stage->free = dedupe_free;
+    stage->opaque = d;
+
+    return 0;
+}
+
+typedef struct Stats {
+    atomic_int_least64_t packets[AVMEDIA_TYPE_NB];
+    atomic_int_least64_t bytes[AVMEDIA_TYPE_NB];
+    atomic_int_least64_t keyframes;
+} Stats;
+
+static int stats_process(void *opaque, const PacketStreams *streams,
+                         AVPacket **pkts, int *nb_pkts)
+{
+    Stats *st = opaque;
+    int i;
+
+    for (i = 0; i < *nb_pkts; i++) {
+        const AVPacket *pkt = pkts[i];
+        enum AVMediaType type = streams->codecpar[pkt->stream_index]->codec_type;
+
+        if (type < 0 || type >= AVMEDIA_TYPE_NB)
+            continue;
+        atomic_fetch_add_explicit(&st->packets[type], 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&st->bytes[type], pkt->size, memory_order_relaxed);
+        if (type == AVMEDIA_TYPE_VIDEO && pkt->flags & AV_PKT_FLAG_KEY)
+            atomic_fetch_add_explicit(&st->keyframes, 1, memory_order_relaxed);
+    }
+
+    return 0;
+}
+
+int packet_stage_stats(PacketStage *stage)
+{
+    Stats *st = av_mallocz(sizeof(*st));
+    int i;
+
+    if (!st)
+        return AVERROR(ENOMEM);
+
+    for (i = 0; i < AVMEDIA_TYPE_NB; i++) {
+        atomic_init(&st->packets[i], 0);
+        atomic_init(&st->bytes[i], 0);
+    }
+    atomic_init(&st->keyframes, 0);
+
+    stage->name = "stats";
+    stage->process = stats_process;
+    stage->free = av_free;
+    stage->opaque = st;
+
+    return 0;
+}
+
+void packet_stage_stats_get(void *opaque, PacketCounters *counters)
+{
+    Stats *st = opaque;
+    int i;
+
+    for (i = 0; i < AVMEDIA_TYPE_NB; i++) {
+        counters->packets[i] = atomic_load(&st->packets[i]);
+        counters->bytes[i] = atomic_load(&st->bytes[i]);
+    }
+    counters->keyframes = atomic_load(&st->keyframes);
+}
+
+typedef struct Tee {
+    int (*func)(void *opaque, const AVPacket *pkt);
+    void *opaque;
+} Tee;
+
+static int tee_process(void *opaque, const PacketStreams *streams,
+                       AVPacket **pkts, int *nb_pkts)
+{
+    Tee *t = opaque;
+    int ret, i;
+
+    for (i = 0; i < *nb_pkts; i++) {
+        ret = t->func(t->opaque, pkts[i]);
+        if (ret < 0)
+            return ret;
+    }
+
+    return 0;
+}
+
+int packet_stage_tee(PacketStage *stage,
+                     int (*func)(void *opaque, const AVPacket *pkt), void *opaque)
+{
+    Tee *t = av_mallocz(sizeof(*t));
+    if (!t)
+        return AVERROR(ENOMEM);
+
+    t->func = func;
+    t->opaque = opaque;
+
+    stage->name = "tee";
+    stage->process = tee_process;
+    stage->free = av_free;
+    stage->opaque = t;
+
+    return 0;
+}
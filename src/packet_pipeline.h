@@ -0,0 +1,163 @@
+/**
+ * @file
+ * Ordered chain of stages processing batches of packets between the
+ * demuxer and the outputs.
+ *
+ * A stage works on a batch in place: it may change packets, drop them or
+ * look at them, and counts how long it took. The stages below are built
+ * in, others only have to fill a PacketStage.
+ */
+
+#ifndef PACKET_PIPELINE_H
+#define PACKET_PIPELINE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include <libavcodec/avcodec.h>
+
+/**
+ * Largest number of packets in a batch.
+ */
+#define PACKET_BATCH_SIZE 32
+
+/**
+ * Streams the packets of a batch refer to by stream_index.
+ */
+typedef struct PacketStreams {
+    AVCodecParameters *const *codecpar;
+    const AVRational *time_base;
+    int nb_streams;
+} PacketStreams;
+
+typedef struct PacketStage {
+    const char *name;
+
+    /**
+     * Process pkts[0] to pkts[*nb_pkts - 1]. A stage dropping packets
+     * unrefs them and moves the following ones down, so that the kept
+     * packets stay first and in order, then updates *nb_pkts.
+     *
+     * @return 0 on success, a negative AVERROR code to end the session
+     */
+    int (*process)(void *opaque, const PacketStreams *streams,
+                   AVPacket **pkts, int *nb_pkts);
+
+    /**
+     * Release opaque when the pipeline is freed, may be NULL.
+     */
+    void (*free)(void *opaque);
+
+    void *opaque;
+} PacketStage;
+
+/**
+ * Counters of one stage of a pipeline.
+ */
+typedef struct PacketStageStats {
+    const char *name;
+    int64_t batches;        ///< batches processed
+    int64_t packets_in;     ///< packets handed to the stage
+    int64_t packets_out;    ///< packets left by the stage
+    int64_t time;           ///< microseconds spent in the stage
+} PacketStageStats;
+
+typedef struct PacketPipeline PacketPipeline;
+
+/**
+ * @return a new empty pipeline, or NULL on failure
+ */
+PacketPipeline *packet_pipeline_alloc(void);
+
+/**
+ * Free every stage and the pipeline, and set *p to NULL.
+ */
+void packet_pipeline_free(PacketPipeline **p);
+
+/**
+ * Insert a copy of stage before the stage at index, or last if index is
+ * out of range. The pipeline owns stage->opaque on success only.
+ *
+ * @return 0 on success, a negative AVERROR code otherwise
+ */
+int packet_pipeline_insert(PacketPipeline *p, int index, const PacketStage *stage);
+
+/**
+ * @return number of stages
+ */
+int packet_pipeline_nb_stages(const PacketPipeline *p);
+
+/**
+ * Run the batch through every stage, stopping early if none is left.
+ *
+ * @return 0 on success, the error of the stage that failed otherwise
+ */
+int packet_pipeline_run(PacketPipeline *p, const PacketStreams *streams,
+                        AVPacket **pkts, int *nb_pkts);
+
+/**
+ * Read the counters of up to max stages, in order. Safe to call from any
+ * thread.
+ *
+ * @return number of stages filled
+ */
+int packet_pipeline_get_stats(PacketPipeline *p, PacketStageStats *stats, int max);
+
+/**
+ * Stream filter: keep only the packets of streams whose media type is in
+ * types, a mask of (1 << AVMEDIA_TYPE_*).
+ *
+ * @return 0 on success, a negative AVERROR code otherwise
+ */
+int packet_stage_filter(PacketStage *stage, unsigned types);
+
+/**
+ * Deduplication: drop a packet with the same DTS, flags and payload as
+ * the previous packet of its stream, as resent by some servers. Use
+ * before timestamp repair, which makes the DTS of duplicates differ.
+ *
+ * @return 0 on success, a negative AVERROR code otherwise
+ */
+int packet_stage_dedupe(PacketStage *stage);
+
+/**
+ * Counters of the packets seen by a stats stage.
+ */
+typedef struct PacketCounters {
+    int64_t packets[AVMEDIA_TYPE_NB];
+    int64_t bytes[AVMEDIA_TYPE_NB];
+    int64_t keyframes;      ///< video keyframes
+} PacketCounters;
+
+/**
+ * Statistics: count the packets and bytes going through, per media type.
+ * The counters stay readable with packet_stage_stats_get() through the
+ * opaque of the stage until the pipeline is freed.
+ *
+ * @return 0 on success, a negative AVERROR code otherwise
+ */
+int packet_stage_stats(PacketStage *stage);
+
+/**
+ * Read the counters of a stage made by packet_stage_stats(). Safe to
+ * call from any thread.
+ */
+void packet_stage_stats_get(void *opaque, PacketCounters *counters);
+
+/**
+ * Tee: hand every packet to func, which may take references to it but
+ * must not change it, before the next stages see it.
+ *
+ * @return 0 on success, a negative AVERROR code otherwise
+ */
+int packet_stage_tee(PacketStage *stage,
+                     int (*func)(void *opaque, const AVPacket *pkt), void *opaque);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,249 @@
+/**
+ * @file
+ * Implementation of the SPSC packet ring.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+
+#include "packet_ring.h"
+
+/* Keeps the producer and consumer fields on separate cache lines */
+#define RING_CACHE_LINE 64
+
+#define RING_WAIT_PRODUCER 1
+#define RING_WAIT_CONSUMER 2
+
+/* Upper bound of a sleep, so that close/abort are noticed regardless */
+#define RING_WAIT_NSEC 100000000
+
+struct PacketRing {
+    AVPacket *slots;
+    unsigned int depth;
+
+    /* Written by the producer only */
+    _Alignas(RING_CACHE_LINE) atomic_uint head;
+    atomic_int high_water;
+    atomic_int_least64_t full_waits;
+
+    /* Written by the consumer only */
+    _Alignas(RING_CACHE_LINE) atomic_uint tail;
+
+    _Alignas(RING_CACHE_LINE) atomic_int waiting;
+    atomic_int closed;
+    atomic_int aborted;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+static void ring_sleep(PacketRing *ring, int who)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += RING_WAIT_NSEC;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+
+    pthread_cond_timedwait(&ring->cond, &ring->lock, &ts);
+    atomic_fetch_and(&ring->waiting, ~who);
+}
+
+static void ring_wake(PacketRing *ring, int who)
+{
+    /* pairs with the flag set in push()/pop() before re-checking */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&ring->waiting) & who) {
+        pthread_mutex_lock(&ring->lock);
+        pthread_cond_broadcast(&ring->cond);
+        pthread_mutex_unlock(&ring->lock);
+    }
+}
+
+PacketRing *packet_ring_alloc(int depth)
+{
+    PacketRing *ring;
+    void *mem;
+
+    if (depth <= 0)
+        return NULL;
+
+    /* av_malloc() only guarantees SIMD alignment, less than the members ask */
+    if (posix_memalign(&mem, RING_CACHE_LINE, sizeof(*ring)))
+        return NULL;
+    ring = mem;
+    memset(ring, 0, sizeof(*ring));
+
+    ring->slots = av_mallocz_array(depth, sizeof(*ring->slots));
+    if (!ring->slots) {
+        free(ring);
+        return NULL;
+    }
+    ring->depth = depth;
+
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->high_water, 0);
+    atomic_init(&ring->full_waits, 0);
+    atomic_init(&ring->waiting, 0);
+    atomic_init(&ring->closed, 0);
+    atomic_init(&ring->aborted, 0);
+
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->cond, NULL);
+
+    return ring;
+}
+
+void packet_ring_free(PacketRing **pring)
+{
+    PacketRing *ring = *pring;
+    unsigned int i;
+
+    if (!ring)
+        return;
+
+    for (i = 0; i < ring->depth; i++)
+        av_packet_unref(&ring->slots[i]);
+
+    pthread_cond_destroy(&ring->cond);
+    pthread_mutex_destroy(&ring->lock);
+    av_freep(&ring->slots);
+    /* the ring comes from posix_memalign(), not from av_malloc() */
+    free(ring);
+    *pring = NULL;
+}
+
+/* Store pkt in the free slot at head and publish it. */
+static int ring_put(PacketRing *ring, AVPacket *pkt, unsigned int head)
+{
+    unsigned int count;
+
+    if (atomic_load(&ring->aborted))
+        return AVERROR_EXIT;
+
+    av_packet_move_ref(&ring->slots[head % ring->depth], pkt);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+    count = head + 1 - atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if ((int)count > atomic_load_explicit(&ring->high_water, memory_order_relaxed))
+        atomic_store_explicit(&ring->high_water, count, memory_order_relaxed);
+
+    ring_wake(ring, RING_WAIT_CONSUMER);
+    return 0;
+}
+
+int packet_ring_push(PacketRing *ring, AVPacket *pkt)
+{
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= ring->depth)
+        atomic_fetch_add_explicit(&ring->full_waits, 1, memory_order_relaxed);
+
+    while (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= ring->depth) {
+        if (atomic_load(&ring->aborted))
+            return AVERROR_EXIT;
+
+        pthread_mutex_lock(&ring->lock);
+        atomic_fetch_or(&ring->waiting, RING_WAIT_PRODUCER);
+        if (head - atomic_load(&ring->tail) >= ring->depth &&
+            !atomic_load(&ring->aborted))
+            ring_sleep(ring, RING_WAIT_PRODUCER);
+        else
+            atomic_fetch_and(&ring->waiting, ~RING_WAIT_PRODUCER);
+        pthread_mutex_unlock(&ring->lock);
+    }
+
+    return ring_put(ring, pkt, head);
+}
+
+int packet_ring_try_push(PacketRing *ring, AVPacket *pkt)
+{
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= ring->depth)
+        return atomic_load(&ring->aborted) ? AVERROR_EXIT : AVERROR(EAGAIN);
+
+    return ring_put(ring, pkt, head);
+}
+
+int packet_ring_pop(PacketRing *ring, AVPacket *pkt)
+{
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    while (atomic_load_explicit(&ring->head, memory_order_acquire) == tail) {
+        if (atomic_load(&ring->aborted))
+            return AVERROR_EXIT;
+
+        if (atomic_load(&ring->closed)) {
+            /* the producer may have pushed right before closing */
+            if (atomic_load_explicit(&ring->head, memory_order_acquire) == tail)
+                return AVERROR_EOF;
+            break;
+        }
+
+        pthread_mutex_lock(&ring->lock);
+        atomic_fetch_or(&ring->waiting, RING_WAIT_CONSUMER);
+        if (atomic_load(&ring->head) == tail &&
+            !atomic_load(&ring->closed) && !atomic_load(&ring->aborted))
+            ring_sleep(ring, RING_WAIT_CONSUMER);
+        else
+            atomic_fetch_and(&ring->waiting, ~RING_WAIT_CONSUMER);
+        pthread_mutex_unlock(&ring->lock);
+    }
+
+    if (atomic_load(&ring->aborted))
+        return AVERROR_EXIT;
+
+    av_packet_move_ref(pkt, &ring->slots[tail % ring->depth]);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+
+    ring_wake(ring, RING_WAIT_PRODUCER);
+    return 0;
+}
+
+void packet_ring_close(PacketRing *ring)
+{
+    atomic_store(&ring->closed, 1);
+    ring_wake(ring, RING_WAIT_PRODUCER | RING_WAIT_CONSUMER);
+}
+
+void packet_ring_reopen(PacketRing *ring)
+{
+    atomic_store(&ring->closed, 0);
+}
+
+void packet_ring_abort(PacketRing *ring)
+{
+    atomic_store(&ring->aborted, 1);
+    ring_wake(ring, RING_WAIT_PRODUCER | RING_WAIT_CONSUMER);
+}
+
+int packet_ring_depth(const PacketRing *ring)
+{
+    return ring->depth;
+}
+
+int packet_ring_count(const PacketRing *ring)
+{
+    return atomic_load(&ring->head) - atomic_load(&ring->tail);
+}
+
+int packet_ring_high_water(const PacketRing *ring)
+{
+    return atomic_load(&ring->high_water);
+}
+
+int64_t packet_ring_full_waits(const PacketRing *ring)
+{
+    return atomic_load(&ring->full_waits);
+}
@@ -0,0 +1,100 @@
+/**
+ * @file
+ * Bounded single-producer/single-consumer ring of AVPackets.
+ *
+ * Push and pop are lock-free while the ring is neither full nor empty.
+ * A side that has to wait sleeps on a condition variable, which the other
+ * side only touches when a waiter is flagged.
+ */
+
+#ifndef PACKET_RING_H
+#define PACKET_RING_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include <libavcodec/avcodec.h>
+
+typedef struct PacketRing PacketRing;
+
+/**
+ * Allocate a ring holding up to depth packets.
+ *
+ * @return the new ring, or NULL on failure
+ */
+PacketRing *packet_ring_alloc(int depth);
+
+/**
+ * Free the ring and every packet left in it, and set *ring to NULL.
+ */
+void packet_ring_free(PacketRing **ring);
+
+/**
+ * Move pkt into the ring, waiting while the ring is full.
+ * Producer side only. pkt is blank on success.
+ *
+ * @return 0 on success, AVERROR_EXIT if the ring was aborted
+ */
+int packet_ring_push(PacketRing *ring, AVPacket *pkt);
+
+/**
+ * Move pkt into the ring if a slot is free. Producer side only.
+ *
+ * @return 0 on success, AVERROR(EAGAIN) if the ring is full,
+ *         AVERROR_EXIT if the ring was aborted
+ */
+int packet_ring_try_push(PacketRing *ring, AVPacket *pkt);
+
+/**
+ * Move the oldest packet of the ring into pkt, waiting while the ring is
+ * empty. Consumer side only.
+ *
+ * @return 0 on success, AVERROR_EOF once the ring is closed and drained,
+ *         AVERROR_EXIT if the ring was aborted
+ */
+int packet_ring_pop(PacketRing *ring, AVPacket *pkt);
+
+/**
+ * Signal the end of input: pop() returns AVERROR_EOF after the last packet.
+ */
+void packet_ring_close(PacketRing *ring);
+
+/**
+ * Make a closed ring accept packets again. Only valid while neither side
+ * is using the ring, e.g. after the consumer has seen AVERROR_EOF.
+ */
+void packet_ring_reopen(PacketRing *ring);
+
+/**
+ * Wake both sides and make every further push() and pop() fail.
+ */
+void packet_ring_abort(PacketRing *ring);
+
+/**
+ * @return capacity of the ring
+ */
+int packet_ring_depth(const PacketRing *ring);
+
+/**
+ * @return number of packets currently queued
+ */
+int packet_ring_count(const PacketRing *ring);
+
+/**
+ * @return highest number of packets ever queued at once
+ */
+int packet_ring_high_water(const PacketRing *ring);
+
+/**
+ * @return number of times push() had to wait for a free slot
+ */
+int64_t packet_ring_full_waits(const PacketRing *ring);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,270 @@
+/**
+ * @file
+ * Implementation of the read-ahead stage.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+
+#include <libavutil/common.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include <libavutil/time.h>
+
+#include "read_ahead.h"
+
+#define READ_AHEAD_AVIO_SIZE 32768
+
+/**
+ * Longest wait of the demuxer before the interrupt callback is checked
+ * again, in microseconds.
+ */
+#define READ_AHEAD_POLL 100000
+
+struct ReadAhead {
+    uint8_t *buf;
+    int size;
+    int low_water;              ///< resume reading at or below this fill
+    AVIOInterruptCB int_cb;
+
+    AVIOContext *source;
+    void (*close_source)(AVIOContext **pb);
+    pthread_t thread;
+    int running;
+    atomic_int stopping;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int head;                   ///< next byte for the demuxer
+    int fill;
+    int draining;               ///< ring was full, wait for low_water
+    int eof;
+    int error;                  ///< how reads end after eof
+
+    ReadAheadStats stats;       ///< guarded by lock
+};
+
+static int ra_interrupted(void *opaque)
+{
+    ReadAhead *ra = opaque;
+
+    return atomic_load(&ra->stopping) ||
+           (ra->int_cb.callback && ra->int_cb.callback(ra->int_cb.opaque));
+}
+
+static void *ra_thread(void *arg)
+{
+    ReadAhead *ra = arg;
+
+    pthread_mutex_lock(&ra->lock);
+    for (;;) {
+        int tail, len, ret;
+
+        while (!atomic_load(&ra->stopping) &&
+               (ra->fill == ra->size || (ra->draining && ra->fill > ra->low_water)))
+            pthread_cond_wait(&ra->cond, &ra->lock);
+        if (atomic_load(&ra->stopping))
+            break;
+        ra->draining = 0;
+
+        /* only this thread fills the free part of the ring */
+        tail = (ra->head + ra->fill) % ra->size;
+        len = FFMIN(ra->size - ra->fill, ra->size - tail);
+        len = FFMIN(len, READ_AHEAD_CHUNK);
+        pthread_mutex_unlock(&ra->lock);
+
+        ret = avio_read_partial(ra->source, ra->buf + tail, len);
+
+        pthread_mutex_lock(&ra->lock);
+        if (ret == 0)
+            ret = avio_feof(ra->source) ? AVERROR_EOF : 0;
+        if (ret < 0) {
+            ra->eof = 1;
+            ra->error = ret;
+            pthread_cond_broadcast(&ra->cond);
+            break;
+        }
+
+        ra->fill += ret;
+        ra->stats.bytes += ret;
+        if (ra->fill > ra->stats.high_water)
+            ra->stats.high_water = ra->fill;
+        if (ra->fill == ra->size)
+            ra->draining = 1;
+        pthread_cond_broadcast(&ra->cond);
+    }
+    pthread_mutex_unlock(&ra->lock);
+
+    return NULL;
+}
+
+static int ra_read(void *opaque, uint8_t *buf, int buf_size)
+{
+    ReadAhead *ra = opaque;
+    int64_t stall_start = 0;
+    int ret = 0;
+
+    pthread_mutex_lock(&ra->lock);
+    while (!ra->fill && !ra->eof) {
+        struct timespec ts;
+        int64_t deadline;
+
+        if (ra->int_cb.callback && ra->int_cb.callback(ra->int_cb.opaque)) {
+            ret = AVERROR_EXIT;
+            break;
+        }
+        if (!stall_start)
+            stall_start = av_gettime_relative();
+
+        deadline = av_gettime() + READ_AHEAD_POLL;
+        ts.tv_sec  = deadline / 1000000;
+        ts.tv_nsec = deadline % 1000000 * 1000;
+        pthread_cond_timedwait(&ra->cond, &ra->lock, &ts);
+    }
+
+    if (stall_start) {
+        int64_t stall = av_gettime_relative() - stall_start;
+
+        ra->stats.stalls++;
+        ra->stats.stall_time += stall;
+        if (stall > ra->stats.max_stall)
+            ra->stats.max_stall = stall;
+    }
+
+    if (!ret && !ra->fill)
+        ret = ra->error;
+
+    if (!ret) {
+        int len = FFMIN(ra->fill, buf_size);
+        int first = FFMIN(len, ra->size - ra->head);
+
+        memcpy(buf, ra->buf + ra->head, first);
+        memcpy(buf + first, ra->buf, len - first);
+        ra->head = (ra->head + len) % ra->size;
+        ra->fill -= len;
+        ret = len;
+        pthread_cond_broadcast(&ra->cond);
+    }
+    pthread_mutex_unlock(&ra->lock);
+
+    return ret;
+}
+
+ReadAhead *read_ahead_alloc(int size, const AVIOInterruptCB *int_cb)
+{
+    ReadAhead *ra;
+
+    if (size < READ_AHEAD_CHUNK)
+        size = READ_AHEAD_CHUNK;
+
+    ra = av_mallocz(sizeof(*ra));
+    if (!ra)
+        return NULL;
+
+    ra->buf = av_malloc(size);
+    if (!ra->buf) {
+        av_free(ra);
+        return NULL;
+    }
+    ra->size = size;
+    ra->low_water = size / 2;
+    ra->stats.size = size;
+    if (int_cb)
+        ra->int_cb = *int_cb;
+    atomic_init(&ra->stopping, 0);
+
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->cond, NULL);
+
+    return ra;
+}
+
+AVIOInterruptCB read_ahead_interrupt_cb(ReadAhead *ra)
+{
+    return (AVIOInterruptCB){ ra_interrupted, ra };
+}
+
+int read_ahead_start(ReadAhead *ra, AVIOContext *source,
+                     void (*close_source)(AVIOContext **pb), AVIOContext **pb)
+{
+    uint8_t *buffer;
+    int ret;
+
+    if (ra->running)
+        return AVERROR(EINVAL);
+
+    buffer = av_malloc(READ_AHEAD_AVIO_SIZE);
+    if (!buffer)
+        return AVERROR(ENOMEM);
+
+    *pb = avio_alloc_context(buffer, READ_AHEAD_AVIO_SIZE, 0, ra, ra_read,
+                             NULL, NULL);
+    if (!*pb) {
+        av_free(buffer);
+        return AVERROR(ENOMEM);
+    }
+    (*pb)->seekable = 0;
+
+    ra->source = source;
+    ra->close_source = close_source;
+    ra->head = 0;
+    ra->fill = 0;
+    ra->draining = 0;
+    ra->eof = 0;
+    ra->error = 0;
+    atomic_store(&ra->stopping, 0);
+
+    ret = pthread_create(&ra->thread, NULL, ra_thread, ra);
+    if (ret) {
+        ra->source = NULL;
+        av_freep(&(*pb)->buffer);
+        avio_context_free(pb);
+        return AVERROR(ret);
+    }
+    ra->running = 1;
+
+    return 0;
+}
+
+void read_ahead_stop(AVIOContext **pb)
+{
+    ReadAhead *ra;
+
+    if (!*pb)
+        return;
+    ra = (*pb)->opaque;
+
+    pthread_mutex_lock(&ra->lock);
+    atomic_store(&ra->stopping, 1);
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->lock);
+
+    pthread_join(ra->thread, NULL);
+    ra->running = 0;
+
+    ra->close_source(&ra->source);
+    av_freep(&(*pb)->buffer);
+    avio_context_free(pb);
+}
+
+void read_ahead_get_stats(ReadAhead *ra, ReadAheadStats *stats)
+{
+    pthread_mutex_lock(&ra->lock);
+    *stats = ra->stats;
+    pthread_mutex_unlock(&ra->lock);
+}
+
+void read_ahead_free(ReadAhead **pra)
+{
+    ReadAhead *ra = *pra;
+
+    if (!ra)
+        return;
+
+    pthread_cond_destroy(&ra->cond);
+    pthread_mutex_destroy(&ra->lock);
+    av_freep(&ra->buf);
+    av_freep(pra);
+}
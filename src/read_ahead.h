@@ -0,0 +1,83 @@
+/**
+ * @file
+ * Read-ahead stage between the network and the demuxer.
+ *
+ * A dedicated thread reads the source into a memory ring while the
+ * demuxer reads from the ring, so that network jitter is absorbed by the
+ * buffered data instead of stalling the demuxer.
+ */
+
+#ifndef READ_AHEAD_H
+#define READ_AHEAD_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include <libavformat/avio.h>
+
+/**
+ * Largest read from the source at once.
+ */
+#define READ_AHEAD_CHUNK 32768
+
+typedef struct ReadAhead ReadAhead;
+
+typedef struct ReadAheadStats {
+    int size;               ///< capacity of the ring in bytes
+    int high_water;         ///< most bytes buffered at once
+    int64_t bytes;          ///< bytes read from the sources
+    int64_t stalls;         ///< times the demuxer found the ring empty
+    int64_t stall_time;     ///< microseconds the demuxer waited for data
+    int64_t max_stall;      ///< longest single wait, in microseconds
+} ReadAheadStats;
+
+/**
+ * Allocate a stage with a ring of size bytes. Once the ring is full, the
+ * source is only read again when the ring has drained to half its size,
+ * so that reads stay large. The stage can be started on one source at a
+ * time, any number of times; the statistics add up.
+ * @param int_cb checked while the demuxer waits for data, may be NULL
+ *
+ * @return the new stage, or NULL on failure
+ */
+ReadAhead *read_ahead_alloc(int size, const AVIOInterruptCB *int_cb);
+
+/**
+ * @return the interrupt callback to open the source with, which also
+ *         ends a blocked read of the source when the stage is stopped
+ */
+AVIOInterruptCB read_ahead_interrupt_cb(ReadAhead *ra);
+
+/**
+ * Start the reader thread on source and open a read context on the ring.
+ * On success the stage owns source and closes it with close_source.
+ *
+ * @return 0 on success, a negative AVERROR code otherwise
+ */
+int read_ahead_start(ReadAhead *ra, AVIOContext *source,
+                     void (*close_source)(AVIOContext **pb), AVIOContext **pb);
+
+/**
+ * Stop the reader thread, close the source and the context opened by
+ * read_ahead_start(), then set *pb to NULL.
+ */
+void read_ahead_stop(AVIOContext **pb);
+
+/**
+ * Read the counters of the stage. Safe to call from any thread.
+ */
+void read_ahead_get_stats(ReadAhead *ra, ReadAheadStats *stats);
+
+/**
+ * Free a stopped stage and set *ra to NULL.
+ */
+void read_ahead_free(ReadAhead **ra);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -27,17 +27,235 @@
  * Use forked FFmpeg by ksvc to handle unofficial FLV with HEVC stream.
  */
 
+#include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
 
+#include <libavutil/avstring.h>
 #include <libavutil/log.h>
+#include <libavutil/time.h>
 #include <libavutil/timestamp.h>
 #include <libavformat/avformat.h>
 
 #include "libavutil/dict.h"
 #include "libavutil/error.h"
+#include "codec_config.h"
+#include "curl_input.h"
+#include "file_writer.h"
+#include "histogram.h"
+#include "ingest.h"
+#include "packet_pipeline.h"
+#include "packet_ring.h"
+#include "read_ahead.h"
 #include "remux.h"
+#include "spill_queue.h"
+#include "thread_pool.h"
+#include "trace.h"
 
-static int keyboard_interrupt = 0;
+/**
+ * Limits of the fast start probe: stop buffering once this many packets
+ * or this much media time (in AV_TIME_BASE) has been read.
+ */
+#define FAST_START_MAX_PACKETS  256
+#define FAST_START_MAX_DURATION AV_TIME_BASE
+
+/**
+ * Stall watchdog: the limit is at least this many times the usual
+ * longest gap between packets, which decays by WATCHDOG_GAP_DECAY per
+ * packet, and at most the socket timeout.
+ */
+#define WATCHDOG_GAP_FACTOR 3
+#define WATCHDOG_GAP_DECAY  0.999
+#define WATCHDOG_MAX_LIMIT  (CURL_INPUT_STALL_TIMEOUT * AV_TIME_BASE)
+
+/**
+ * Number of threads writing trailers in the background.
+ */
+#define FINALIZER_THREADS 2
+
+/**
+ * Keeps the callback opaque of a session alive while the session or any
+ * of its files waiting for the finalizer may still use it.
+ */
+typedef struct CallbackRef {
+    atomic_int refs;
+    atomic_int_least64_t deadline;  ///< of the output I/O, 0 if none
+    void (*output_closed)(void *opaque, const char *filename);
+    void (*release)(void *opaque);
+    void *opaque;
+} CallbackRef;
+
+/**
+ * A closed output file waiting for its trailer.
+ */
+typedef struct FinalizeJob {
+    AVFormatContext *ofmt_ctx;
+    char *filename;
+    CallbackRef *cb;
+} FinalizeJob;
+
+/**
+ * One destination of the session, fed by the reader through its own ring
+ * and written by its own thread.
+ */
+typedef struct RemuxOutput {
+    RemuxSession *session;
+    char *url;
+    char *format_name;
+
+    PacketRing *ring;
+    pthread_t writer;
+    int writer_started;
+    atomic_int failed;
+    int ret;
+
+    /* reader side */
+    int need_keyframe;          ///< packets dropped, resume on a keyframe
+    atomic_int_least64_t dropped_packets;
+    SpillQueue *spill;          ///< overflow of the ring, may be NULL
+    int spilling;               ///< packets spilled since the last catch-up
+
+    /* writer side */
+    AVFormatContext *ofmt_ctx;
+    char *seg_filename;
+    char *last_expanded;
+    int64_t seg_start;          ///< first DTS of the segment, in AV_TIME_BASE
+    atomic_int nb_segments;
+} RemuxOutput;
+
+/**
+ * Traffic of one output stream, see RemuxStreamMetrics.
+ */
+typedef struct StreamCounters {
+    atomic_int type;
+    atomic_int_least64_t packets_in;
+    atomic_int_least64_t bytes_in;
+    atomic_int_least64_t packets_out;
+    atomic_int_least64_t bytes_out;
+} StreamCounters;
+
+/**
+ * Cancellation token: the sessions started with it, until they are freed.
+ */
+struct RemuxCancel {
+    atomic_int triggered;
+    pthread_mutex_t lock;
+    RemuxSession **sessions;
+    int nb_sessions;
+};
+
+struct RemuxSession {
+    char *in_filename;
+    char *http_headers;
+    RemuxOptions opts;
+
+    pthread_t thread;
+    int thread_started;
+    int thread_joined;
+    int cancel_registered;      ///< listed by opts.cancel
+
+    atomic_int state;
+    atomic_int abort_request;
+    int ret;
+
+    AVFormatContext *ifmt_ctx;
+    int *stream_mapping;
+    int stream_mapping_size;
+    int64_t *in_last_dts;
+    int64_t *out_last_dts;
+
+    /* output streams, kept to set up every new segment */
+    AVCodecParameters **out_codecpar;
+    AVRational *in_time_base;   ///< input time base of each output stream
+    int nb_out_streams;
+    int has_video;
+
+    /* after a reconnect, where the new input continues, in AV_TIME_BASE */
+    int64_t resume_ts;
+    int64_t resume_in_ts;
+    atomic_int nb_reconnects;
+
+    /* stall watchdog, checked by the interrupt callback of the input */
+    atomic_int_least64_t last_packet_time;  ///< 0 while not reading packets
+    atomic_int_least64_t stall_limit;
+    atomic_int stalled;
+    atomic_int nb_stalls;
+    double gap_peak;            ///< usual longest gap between packets
+    int64_t stall_detected;     ///< when the read ended on a stall, or 0
+
+    /* packets read by the fast start probe, dispatched first */
+    AVPacket **probe_pkts;
+    int nb_probe_pkts;
+
+    /* stages added with remux_session_add_stage(), NULL if none */
+    PacketPipeline *pipeline;
+    int nb_input_stages;        ///< stages before the timestamp repair
+    AVPacket *batch[PACKET_BATCH_SIZE];
+    int nb_batch;
+
+    /* with direct_write, packets sorted by DTS before dispatch */
+    int direct_write;           ///< only changed while no writer runs
+    AVPacket *reorder;          ///< opts.reorder_window slots
+    int64_t *reorder_ts;        ///< DTS of each slot, in AV_TIME_BASE
+    int nb_reorder;
+
+    int64_t start_time;         ///< av_gettime_relative() when the session ran
+    atomic_int_least64_t first_write_latency;
+
+    /* metrics, see remux_session_get_metrics() */
+    StreamCounters streams[REMUX_MAX_STREAMS];
+    atomic_int nb_streams;
+    Histogram *read_latency;
+    Histogram *write_latency;
+    atomic_int_least64_t dts_jumps;
+    atomic_int_least64_t dts_backwards;
+    atomic_int_least64_t dts_resumes;
+    int64_t read_time;          ///< when the last packet was read, or 0
+    atomic_int_least64_t last_read_time;    ///< read_time of the last packet
+    int64_t lag_origin;         ///< read time minus media time of the first packet
+    atomic_int_least64_t lag;
+    atomic_int_least64_t max_lag;
+
+    RemuxOutput **outputs;
+    int nb_outputs;
+
+    CallbackRef *cb;
+
+    /* custom I/O of the input, NULL with FFmpeg's protocols */
+    AVIOContext *input_pb;
+    void (*input_pb_close)(AVIOContext **pb);
+    ReadAhead *read_ahead;      ///< may be NULL
+
+    /* input received by opts.ingest, see session_ingest_step() */
+    IngestStream *ingest;
+    atomic_int ingest_scheduled;    ///< a step is queued or running
+    int ingest_started;             ///< outputs started on a first input
+    int ingest_attempts;            ///< reconnects since the last open
+    int ingest_read_ret;            ///< how the lost input ended
+    pthread_t refresh_thread;       ///< asks reconnect_url off the workers
+    int refresh_started;            ///< refresh_thread is to be joined
+    atomic_int refreshing;          ///< refresh_thread has not restarted the transfer
+    int refresh_ret;                ///< how the refresh ended, read once refreshing is 0
+    pthread_mutex_t done_lock;
+    pthread_cond_t done_cond;
+    int done;
+};
+
+static volatile sig_atomic_t keyboard_interrupt = 0;
+
+static pthread_once_t remux_init_once = PTHREAD_ONCE_INIT;
+
+static ThreadPool *finalizer;
+static int finalizer_threads = FINALIZER_THREADS;
+static pthread_once_t finalizer_once = PTHREAD_ONCE_INIT;
+
+/* output files of the process from their header to their trailer */
+static pthread_mutex_t open_files_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t open_files_cond = PTHREAD_COND_INITIALIZER;
+static const char **open_files;
+static int nb_open_files;
 
 void handle_stop(int sig) {
     if (sig == SIGUSR1) {
@@ -45,200 +263,2530 @@ void handle_stop(int sig) {
     }
 }
 
-int remux(const char *in_filename, const char *out_filename, const char *http_headers)
+static void remux_global_init(void)
 {
-    AVOutputFormat *ofmt = NULL;
-    AVFormatContext *ifmt_ctx = NULL, *ofmt_ctx = NULL;
-    AVPacket pkt;
-    int ret, i;
-    int stream_index = 0;
-    int *stream_mapping = NULL;
-    int stream_mapping_size = 0;
-    int64_t *in_last_dts = NULL;
-    int64_t *out_last_dts = NULL;
-    AVDictionary *options = NULL;
-
     avformat_network_init();
     av_log_set_level(AV_LOG_WARNING);
+}
+
+static void finalizer_init(void)
+{
+    finalizer = thread_pool_create(finalizer_threads);
+    if (!finalizer)
+        fprintf(stderr, "Could not start the finalizer, trailers are written inline\n");
+}
 
-    if (http_headers) {
-        av_dict_set(&options, "timeout", "5000000", AV_DICT_APPEND);
-        av_dict_set(&options, "headers", http_headers, AV_DICT_APPEND);
-        av_dict_set(&options, "multiple_requests", "1", AV_DICT_APPEND);
-        av_dict_set(&options, "reconnect_at_eof", "1", AV_DICT_APPEND);
-        av_dict_set(&options, "reconnect_streamed", "1", AV_DICT_APPEND);
-        av_dict_set(&options, "reconnect_delay_max", "3", AV_DICT_APPEND);
+/**
+ * Track an output file until open_file_remove(), by the address of its
+ * name, which must stay valid until then.
+ */
+static void open_file_add(const char *filename)
+{
+    pthread_mutex_lock(&open_files_lock);
+    if (av_dynarray_add_nofree(&open_files, &nb_open_files, (void *)filename) < 0)
+        av_log(NULL, AV_LOG_WARNING, "Could not track '%s'\n", filename);
+    pthread_mutex_unlock(&open_files_lock);
+}
+
+static void open_file_remove(const char *filename)
+{
+    int i;
+
+    pthread_mutex_lock(&open_files_lock);
+    for (i = 0; i < nb_open_files; i++) {
+        if (open_files[i] == filename) {
+            open_files[i] = open_files[--nb_open_files];
+            pthread_cond_broadcast(&open_files_cond);
+            break;
+        }
     }
+    pthread_mutex_unlock(&open_files_lock);
+}
 
-    if ((ret = avformat_open_input(&ifmt_ctx, in_filename, 0, &options)) < 0) {
-        fprintf(stderr, "Could not open input file '%s'\n", in_filename);
-        goto end;
+static CallbackRef *callback_ref_alloc(const RemuxOptions *opts)
+{
+    CallbackRef *cb = av_mallocz(sizeof(*cb));
+    if (!cb)
+        return NULL;
+
+    atomic_init(&cb->refs, 1);
+    atomic_init(&cb->deadline, 0);
+    cb->output_closed = opts->output_closed;
+    cb->release = opts->release;
+    cb->opaque = opts->opaque;
+
+    return cb;
+}
+
+static CallbackRef *callback_ref(CallbackRef *cb)
+{
+    atomic_fetch_add(&cb->refs, 1);
+    return cb;
+}
+
+static void callback_unref(CallbackRef **pcb)
+{
+    CallbackRef *cb = *pcb;
+
+    if (!cb)
+        return;
+
+    if (atomic_fetch_sub(&cb->refs, 1) == 1) {
+        if (cb->release)
+            cb->release(cb->opaque);
+        av_free(cb);
     }
+    *pcb = NULL;
+}
 
-    if ((ret = avformat_find_stream_info(ifmt_ctx, 0)) < 0) {
-        fprintf(stderr, "Failed to retrieve input stream information\n");
-        goto end;
+static int callback_deadline_passed(CallbackRef *cb)
+{
+    int64_t deadline = atomic_load(&cb->deadline);
+
+    return deadline && av_gettime_relative() >= deadline;
+}
+
+/**
+ * Interrupt callback of the outputs. Unlike the input, they are not
+ * interrupted by a stop request, only once the deadline has passed.
+ */
+static int output_interrupt_cb(void *opaque)
+{
+    return callback_deadline_passed(opaque);
+}
+
+/**
+ * Open the I/O context of an output file, through the file writer when
+ * it is enabled and the file is local.
+ */
+static int output_open_io(AVFormatContext *ofmt_ctx, const char *filename,
+                          const RemuxOptions *opts)
+{
+    const char *protocol = avio_find_protocol_name(filename);
+    const char *path = filename;
+
+    if (opts->writer.buffer_size > 0 && protocol && !strcmp(protocol, "file")) {
+        av_strstart(filename, "file:", &path);
+        ofmt_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+        return file_writer_open(&ofmt_ctx->pb, path, &opts->writer);
     }
 
-    av_dump_format(ifmt_ctx, 0, in_filename, 0);
+    return avio_open2(&ofmt_ctx->pb, filename, AVIO_FLAG_WRITE,
+                      &ofmt_ctx->interrupt_callback, NULL);
+}
 
-    avformat_alloc_output_context2(&ofmt_ctx, NULL, NULL, out_filename);
-    if (!ofmt_ctx) {
-        fprintf(stderr, "Could not create output context\n");
-        ret = AVERROR_UNKNOWN;
-        goto end;
+static int output_close_io(AVFormatContext *ofmt_ctx)
+{
+    if (ofmt_ctx->oformat->flags & AVFMT_NOFILE)
+        return 0;
+    if (ofmt_ctx->flags & AVFMT_FLAG_CUSTOM_IO)
+        return file_writer_close(&ofmt_ctx->pb);
+    return avio_closep(&ofmt_ctx->pb);
+}
+
+/**
+ * Write the trailer of an output file, close it and run the output_closed
+ * callback.
+ */
+static void output_finalize(AVFormatContext *ofmt_ctx, const char *filename,
+                            CallbackRef *cb)
+{
+    int ret;
+
+    av_write_trailer(ofmt_ctx);
+
+    ret = output_close_io(ofmt_ctx);
+    if (ret < 0)
+        av_log(NULL, AV_LOG_ERROR, "Error closing '%s': %s\n",
+               filename ? filename : "output", av_err2str(ret));
+    avformat_free_context(ofmt_ctx);
+
+    if (cb->output_closed && filename)
+        cb->output_closed(cb->opaque, filename);
+
+    if (filename)
+        open_file_remove(filename);
+}
+
+static void finalize_job_run(void *arg)
+{
+    FinalizeJob *job = arg;
+
+    output_finalize(job->ofmt_ctx, job->filename, job->cb);
+
+    callback_unref(&job->cb);
+    av_free(job->filename);
+    av_free(job);
+}
+
+int remux_finalizer_pending(void)
+{
+    pthread_once(&finalizer_once, finalizer_init);
+    return finalizer ? thread_pool_pending(finalizer) : 0;
+}
+
+void remux_finalizer_drain(void)
+{
+    pthread_once(&finalizer_once, finalizer_init);
+    if (finalizer)
+        thread_pool_wait(finalizer);
+}
+
+void remux_finalizer_configure(int nb_threads)
+{
+    if (nb_threads > 0)
+        finalizer_threads = nb_threads;
+}
+
+int remux_finalizer_drain_until(int64_t deadline,
+                                void (*unfinished)(void *opaque, const char *filename),
+                                void *opaque)
+{
+    int nb_left, i;
+
+    pthread_mutex_lock(&open_files_lock);
+    while (nb_open_files) {
+        int64_t now = av_gettime_relative();
+        int64_t wake;
+        struct timespec ts;
+
+        if (now >= deadline)
+            break;
+
+        /* the deadline is on the monotonic clock, wait in steps */
+        wake = av_gettime() + FFMIN(deadline - now, 100000);
+        ts.tv_sec  = wake / 1000000;
+        ts.tv_nsec = wake % 1000000 * 1000;
+        pthread_cond_timedwait(&open_files_cond, &open_files_lock, &ts);
     }
 
-    stream_mapping_size = ifmt_ctx->nb_streams;
-    stream_mapping = av_mallocz_array(stream_mapping_size, sizeof(*stream_mapping));
-    if (!stream_mapping) {
-        ret = AVERROR(ENOMEM);
-        goto end;
+    nb_left = nb_open_files;
+    for (i = 0; i < nb_left && unfinished; i++)
+        unfinished(opaque, open_files[i]);
+    pthread_mutex_unlock(&open_files_lock);
+
+    return nb_left;
+}
+
+static int session_interrupted(RemuxSession *s)
+{
+    return keyboard_interrupt || atomic_load(&s->abort_request) ||
+           (s->opts.cancel && remux_cancel_triggered(s->opts.cancel)) ||
+           callback_deadline_passed(s->cb);
+}
+
+/**
+ * Whether no packet arrived for longer than the stall limit while reading
+ * packets. May be called from any thread.
+ */
+static int session_stalled(RemuxSession *s)
+{
+    int64_t last, gap, limit;
+
+    /* the ingest loop watches the transfer itself */
+    if (!s->opts.stall_timeout || s->ingest)
+        return 0;
+    if (atomic_load(&s->stalled))
+        return 1;
+
+    last = atomic_load(&s->last_packet_time);
+    if (!last)
+        return 0;
+
+    gap = av_gettime_relative() - last;
+    limit = atomic_load(&s->stall_limit);
+    if (gap < limit)
+        return 0;
+
+    if (!atomic_exchange(&s->stalled, 1)) {
+        atomic_fetch_add(&s->nb_stalls, 1);
+        av_log(NULL, AV_LOG_WARNING, "No packet for %"PRId64" ms (limit %"PRId64
+               " ms, usual gap %"PRId64" ms), dropping the input\n",
+               gap / 1000, limit / 1000, (int64_t)s->gap_peak / 1000);
     }
+    return 1;
+}
 
-    in_last_dts = av_mallocz_array(stream_mapping_size, sizeof(int64_t));
-    if (!in_last_dts) {
-        ret = AVERROR(ENOMEM);
-        goto end;
+/**
+ * Interrupt callback of the input: also ends a read that stalled.
+ */
+static int session_input_interrupt_cb(void *opaque)
+{
+    RemuxSession *s = opaque;
+
+    return session_interrupted(s) || session_stalled(s);
+}
+
+/**
+ * Start watching the gaps between packets, from now.
+ */
+static void session_watchdog_arm(RemuxSession *s)
+{
+    if (!s->opts.stall_timeout)
+        return;
+
+    atomic_store(&s->stalled, 0);
+    atomic_store(&s->last_packet_time, av_gettime_relative());
+}
+
+/**
+ * Stop watching, e.g. while the input is reopened.
+ */
+static void session_watchdog_disarm(RemuxSession *s)
+{
+    atomic_store(&s->last_packet_time, 0);
+    atomic_store(&s->stalled, 0);
+}
+
+/**
+ * Account for a packet received at now, and adapt the stall limit to the
+ * gap since the previous one.
+ */
+static void session_watchdog_feed(RemuxSession *s, int64_t now)
+{
+    int64_t last, limit;
+
+    if (!s->opts.stall_timeout)
+        return;
+
+    last = atomic_load(&s->last_packet_time);
+    if (last)
+        s->gap_peak = FFMAX(s->gap_peak * WATCHDOG_GAP_DECAY, now - last);
+    atomic_store(&s->last_packet_time, now);
+
+    limit = FFMIN(WATCHDOG_GAP_FACTOR * s->gap_peak, WATCHDOG_MAX_LIMIT);
+    limit = FFMAX(s->opts.stall_timeout, limit);
+    /* ingest steps only read what has arrived, the loop checks the gaps */
+    if (s->ingest && atomic_exchange(&s->stall_limit, limit) != limit)
+        ingest_stream_set_stall_limit(s->ingest, limit);
+    else
+        atomic_store(&s->stall_limit, limit);
+
+    if (s->stall_detected) {
+        av_log(NULL, AV_LOG_WARNING, "Receiving again %"PRId64" ms after "
+               "the stall was detected\n", (now - s->stall_detected) / 1000);
+        s->stall_detected = 0;
     }
+}
 
-    out_last_dts = av_mallocz_array(stream_mapping_size, sizeof(int64_t));
-    if (!out_last_dts) {
-        ret = AVERROR(ENOMEM);
-        goto end;
+void remux_options_default(RemuxOptions *opts)
+{
+    opts->ring_depth = REMUX_DEFAULT_RING_DEPTH;
+    opts->spill_dir = NULL;
+    opts->spill_size = REMUX_DEFAULT_SPILL_SIZE;
+    opts->reorder_window = 0;
+    opts->frag_duration = 0;
+    opts->segment_duration = 0;
+    opts->segment_size = 0;
+    opts->fast_start = 0;
+    opts->max_reconnects = 0;
+    opts->reconnect_url = NULL;
+    opts->stall_timeout = 0;
+    opts->async_finalize = 0;
+    file_writer_options_default(&opts->writer);
+    opts->ingest = NULL;
+    opts->curl_input = 0;
+    opts->read_ahead = 0;
+    opts->output_closed = NULL;
+    opts->phase_done = NULL;
+    opts->release = NULL;
+    opts->opaque = NULL;
+}
+
+/**
+ * Report a startup phase that began at start to opts.phase_done.
+ */
+static void session_phase_done(RemuxSession *s, const char *phase, int64_t start)
+{
+    if (s->opts.phase_done)
+        s->opts.phase_done(s->opts.opaque, phase, start, av_gettime_relative());
+}
+
+/**
+ * Set the muxer options for fragmented MP4 output.
+ * Fragments are cut on video keyframes once frag_duration has elapsed,
+ * or every frag_duration for audio-only streams.
+ */
+static void session_fragment_options(RemuxSession *s, AVFormatContext *ofmt_ctx,
+                                     AVDictionary **mux_options)
+{
+    int has_video = 0;
+    int i;
+
+    if (s->opts.frag_duration <= 0)
+        return;
+
+    if (!av_match_name(ofmt_ctx->oformat->name, "mp4,mov,ipod,ismv,f4v,3gp,3g2")) {
+        av_log(ofmt_ctx, AV_LOG_WARNING,
+               "Fragmentation not supported by format '%s', ignored\n",
+               ofmt_ctx->oformat->name);
+        return;
     }
 
-    ofmt = ofmt_ctx->oformat;
+    for (i = 0; i < ofmt_ctx->nb_streams; i++) {
+        if (ofmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+            has_video = 1;
+    }
 
-    for (i = 0; i < ifmt_ctx->nb_streams; i++) {
-        AVStream *out_stream;
-        AVStream *in_stream = ifmt_ctx->streams[i];
-        AVCodecParameters *in_codecpar = in_stream->codecpar;
+    /*
+     * empty_moov writes the track headers up front, so the file is
+     * playable up to its last complete fragment if the process dies.
+     * The muxer only keeps the samples of the current fragment in memory.
+     */
+    if (has_video) {
+        av_dict_set(mux_options, "movflags",
+                    "+frag_keyframe+empty_moov+default_base_moof", AV_DICT_APPEND);
+        av_dict_set_int(mux_options, "min_frag_duration", s->opts.frag_duration, 0);
+    } else {
+        av_dict_set(mux_options, "movflags",
+                    "+empty_moov+default_base_moof", AV_DICT_APPEND);
+        av_dict_set_int(mux_options, "frag_duration", s->opts.frag_duration, 0);
+    }
 
-        if (in_codecpar->codec_type != AVMEDIA_TYPE_AUDIO &&
-            in_codecpar->codec_type != AVMEDIA_TYPE_VIDEO &&
-            in_codecpar->codec_type != AVMEDIA_TYPE_SUBTITLE) {
-            stream_mapping[i] = -1;
-            continue;
-        }
+    /* push every completed fragment to the file right away */
+    ofmt_ctx->flush_packets = 1;
+}
+
+static int session_segmenting(const RemuxSession *s)
+{
+    return s->opts.segment_duration > 0 || s->opts.segment_size > 0;
+}
+
+/**
+ * Name of the next file of an output. When segmenting, the URL is
+ * expanded with strftime(3). A counter is appended to the name if it did
+ * not change since the previous file.
+ */
+static void output_filename(RemuxOutput *o, char *buf, size_t size)
+{
+    char expanded[4096];
+    struct tm now_tm;
+    time_t now = time(NULL);
+    const char *ext, *slash;
+
+    if (session_segmenting(o->session)) {
+        localtime_r(&now, &now_tm);
+        if (!strftime(expanded, sizeof(expanded), o->url, &now_tm))
+            av_strlcpy(expanded, o->url, sizeof(expanded));
+    } else {
+        av_strlcpy(expanded, o->url, sizeof(expanded));
+    }
+
+    if (!o->last_expanded || strcmp(expanded, o->last_expanded)) {
+        av_free(o->last_expanded);
+        o->last_expanded = av_strdup(expanded);
+        av_strlcpy(buf, expanded, size);
+        return;
+    }
+
+    ext = strrchr(expanded, '.');
+    slash = strrchr(expanded, '/');
+    if (!ext || (slash && ext < slash))
+        ext = expanded + strlen(expanded);
+
+    snprintf(buf, size, "%.*s-%d%s",
+             (int)(ext - expanded), expanded, atomic_load(&o->nb_segments), ext);
+}
 
-        stream_mapping[i] = stream_index++;
+/**
+ * Create the next file of an output and write its header, with the codec
+ * parameters saved from the input.
+ */
+static int output_open(RemuxOutput *o)
+{
+    RemuxSession *s = o->session;
+    AVFormatContext *ofmt_ctx = NULL;
+    AVDictionary *mux_options = NULL;
+    char filename[4096];
+    int64_t start;
+    int ret, i;
+
+    output_filename(o, filename, sizeof(filename));
+
+    avformat_alloc_output_context2(&ofmt_ctx, NULL, o->format_name, filename);
+    if (!ofmt_ctx) {
+        fprintf(stderr, "Could not create output context\n");
+        return AVERROR_UNKNOWN;
+    }
+    /* the finalizer may use it after the session is gone: keep it on cb */
+    ofmt_ctx->interrupt_callback = (AVIOInterruptCB){ output_interrupt_cb, s->cb };
 
-        out_stream = avformat_new_stream(ofmt_ctx, NULL);
+    for (i = 0; i < s->nb_out_streams; i++) {
+        AVStream *out_stream = avformat_new_stream(ofmt_ctx, NULL);
         if (!out_stream) {
             fprintf(stderr, "Failed allocating output stream\n");
             ret = AVERROR_UNKNOWN;
-            goto end;
+            goto fail;
         }
 
-        ret = avcodec_parameters_copy(out_stream->codecpar, in_codecpar);
+        ret = avcodec_parameters_copy(out_stream->codecpar, s->out_codecpar[i]);
         if (ret < 0) {
             fprintf(stderr, "Failed to copy codec parameters\n");
-            goto end;
+            goto fail;
         }
 
-        if (out_stream->codecpar->codec_id == AV_CODEC_ID_HEVC) {
+        if (out_stream->codecpar->codec_id == AV_CODEC_ID_HEVC &&
+            av_match_name(ofmt_ctx->oformat->name, "mp4,mov")) {
             out_stream->codecpar->codec_tag = MKTAG('h', 'v', 'c', '1');
         } else {
             out_stream->codecpar->codec_tag = 0;
         }
-
-        in_last_dts[i] = AV_NOPTS_VALUE;
     }
-    av_dump_format(ofmt_ctx, 0, out_filename, 1);
+    av_dump_format(ofmt_ctx, 0, filename, 1);
 
-    if (!(ofmt->flags & AVFMT_NOFILE)) {
-        ret = avio_open(&ofmt_ctx->pb, out_filename, AVIO_FLAG_WRITE);
+    if (!(ofmt_ctx->oformat->flags & AVFMT_NOFILE)) {
+        ret = output_open_io(ofmt_ctx, filename, &s->opts);
         if (ret < 0) {
-            fprintf(stderr, "Could not open output file '%s'", out_filename);
-            goto end;
+            fprintf(stderr, "Could not open output file '%s'", filename);
+            goto fail;
         }
     }
 
-    ret = avformat_write_header(ofmt_ctx, NULL);
+    session_fragment_options(s, ofmt_ctx, &mux_options);
+
+    start = av_gettime_relative();
+    ret = avformat_write_header(ofmt_ctx, &mux_options);
+    session_phase_done(s, "avformat_write_header", start);
+    av_dict_free(&mux_options);
     if (ret < 0) {
         fprintf(stderr, "Error occurred when opening output file\n");
-        goto end;
+        goto fail;
     }
 
-    (void)signal(SIGUSR1, handle_stop);
+    o->ofmt_ctx = ofmt_ctx;
+    o->seg_filename = av_strdup(filename);
+    o->seg_start = AV_NOPTS_VALUE;
+    if (o->seg_filename)
+        open_file_add(o->seg_filename);
+    atomic_fetch_add(&o->nb_segments, 1);
 
-    while (!keyboard_interrupt) {
-        AVStream *in_stream, *out_stream;
+    return 0;
+fail:
+    output_close_io(ofmt_ctx);
+    avformat_free_context(ofmt_ctx);
+    return ret;
+}
 
-        ret = av_read_frame(ifmt_ctx, &pkt);
-        if (ret < 0)
-            break;
+/**
+ * Close the current file of an output. With async_finalize set, the
+ * trailer is written by the finalizer and this returns right away.
+ */
+static void output_close(RemuxOutput *o)
+{
+    RemuxSession *s = o->session;
+    AVFormatContext *ofmt_ctx = o->ofmt_ctx;
+    FinalizeJob *job;
 
-        in_stream = ifmt_ctx->streams[pkt.stream_index];
-        if (pkt.stream_index >= stream_mapping_size ||
-            stream_mapping[pkt.stream_index] < 0) {
-            av_packet_unref(&pkt);
-            continue;
-        }
+    if (!ofmt_ctx)
+        return;
+    o->ofmt_ctx = NULL;
 
-        pkt.stream_index = stream_mapping[pkt.stream_index];
-        out_stream = ofmt_ctx->streams[pkt.stream_index];
+    if (s->opts.async_finalize) {
+        pthread_once(&finalizer_once, finalizer_init);
 
-        /* rescale DTS to be monotonic increasing */
-        int64_t dts;
-        do {
-            if (in_last_dts[pkt.stream_index] == AV_NOPTS_VALUE) {
-                dts = 0;
-                break;
-            }
+        job = finalizer ? av_mallocz(sizeof(*job)) : NULL;
+        if (job) {
+            job->ofmt_ctx = ofmt_ctx;
+            job->filename = o->seg_filename;
+            job->cb = callback_ref(s->cb);
 
-            if (pkt.dts > in_last_dts[pkt.stream_index]) {
-                if (pkt.dts > in_last_dts[pkt.stream_index] + 1000) {
-                    dts = out_last_dts[pkt.stream_index] + 10;
-                } else {
-                    dts = pkt.dts - in_last_dts[pkt.stream_index] + out_last_dts[pkt.stream_index];
-                }
-            } else {
-                dts = out_last_dts[pkt.stream_index] + 10;
+            if (thread_pool_submit(finalizer, finalize_job_run, job) >= 0) {
+                o->seg_filename = NULL;
+                return;
             }
-        } while (0);
-        in_last_dts[pkt.stream_index] = pkt.dts;
-        out_last_dts[pkt.stream_index] = dts;
-
-        /* shift pts */
-        int64_t cts = pkt.pts - pkt.dts;
-        pkt.dts = dts;
-        pkt.pts = dts + cts;
-
-        /* copy packet */
-        pkt.pts = av_rescale_q_rnd(pkt.pts, in_stream->time_base, out_stream->time_base, AV_ROUND_NEAR_INF|AV_ROUND_PASS_MINMAX);
-        pkt.dts = av_rescale_q_rnd(pkt.dts, in_stream->time_base, out_stream->time_base, AV_ROUND_NEAR_INF|AV_ROUND_PASS_MINMAX);
-        pkt.duration = av_rescale_q(pkt.duration, in_stream->time_base, out_stream->time_base);
-        pkt.pos = -1;
-
-        av_interleaved_write_frame(ofmt_ctx, &pkt);
-        av_packet_unref(&pkt);
+            callback_unref(&job->cb);
+            av_free(job);
+        }
     }
 
-    if (keyboard_interrupt) {
-        av_log(ofmt_ctx, AV_LOG_WARNING, "%s\n", "Keyboard interrupt received");
-        ret = AVERROR_EXIT;
-    }
+    output_finalize(ofmt_ctx, o->seg_filename, s->cb);
+    av_freep(&o->seg_filename);
+}
 
-    av_write_trailer(ofmt_ctx);
-end:
+/**
+ * Whether pkt should open a new segment: it must be a video keyframe
+ * (any packet for audio-only input) and the current segment must have
+ * reached its duration or size limit.
+ */
+static int output_should_rotate(RemuxOutput *o, const AVPacket *pkt, int64_t ts)
+{
+    RemuxSession *s = o->session;
+    const AVCodecParameters *par = s->out_codecpar[pkt->stream_index];
 
-    avformat_close_input(&ifmt_ctx);
+    if (!session_segmenting(s) || o->seg_start == AV_NOPTS_VALUE)
+        return 0;
 
-    /* close output */
-    if (ofmt_ctx && !(ofmt->flags & AVFMT_NOFILE))
-        avio_closep(&ofmt_ctx->pb);
-    avformat_free_context(ofmt_ctx);
+    if (s->has_video &&
+        (par->codec_type != AVMEDIA_TYPE_VIDEO || !(pkt->flags & AV_PKT_FLAG_KEY)))
+        return 0;
 
-    av_dict_free(&options);
-    av_freep(&stream_mapping);
-    av_freep(&in_last_dts);
-    av_freep(&out_last_dts);
+    if (s->opts.segment_duration > 0 &&
+        ts - o->seg_start >= s->opts.segment_duration)
+        return 1;
 
-    if (ret < 0 && ret != AVERROR_EOF) {
-        return ret;
-    }
+    if (s->opts.segment_size > 0 && o->ofmt_ctx->pb &&
+        avio_tell(o->ofmt_ctx->pb) >= s->opts.segment_size)
+        return 1;
 
     return 0;
 }
+
+/**
+ * Writer thread of an output: rescale the queued packets to the output
+ * time base and mux them, rotating the file when needed. The last file
+ * is closed when the ring ends.
+ */
+static void *output_writer(void *arg)
+{
+    RemuxOutput *o = arg;
+    RemuxSession *s = o->session;
+    AVPacket pkt = { 0 };
+    int ret;
+
+    av_init_packet(&pkt);
+
+    while (packet_ring_pop(o->ring, &pkt) >= 0) {
+        AVStream *out_stream;
+        AVRational in_tb = s->in_time_base[pkt.stream_index];
+        int64_t ts = av_rescale_q(pkt.dts, in_tb, AV_TIME_BASE_Q);
+        int64_t offset, start, latency;
+        int stream_index, size;
+
+        if (callback_deadline_passed(s->cb)) {
+            av_log(NULL, AV_LOG_WARNING, "Deadline passed, dropping the %d "
+                   "packets queued for '%s'\n",
+                   packet_ring_count(o->ring) + 1, o->url);
+            av_packet_unref(&pkt);
+            packet_ring_abort(o->ring);
+            break;
+        }
+
+        if (output_should_rotate(o, &pkt, ts)) {
+            output_close(o);
+            ret = output_open(o);
+            if (ret < 0) {
+                o->ret = ret;
+                atomic_store(&o->failed, 1);
+                av_packet_unref(&pkt);
+                packet_ring_abort(o->ring);
+                break;
+            }
+        }
+
+        /* every segment starts from zero */
+        if (o->seg_start == AV_NOPTS_VALUE)
+            o->seg_start = ts;
+        offset = av_rescale_q(o->seg_start, AV_TIME_BASE_Q, in_tb);
+        pkt.dts -= offset;
+        pkt.pts -= offset;
+
+        out_stream = o->ofmt_ctx->streams[pkt.stream_index];
+
+        /* copy packet */
+        pkt.pts = av_rescale_q_rnd(pkt.pts, in_tb, out_stream->time_base, AV_ROUND_NEAR_INF|AV_ROUND_PASS_MINMAX);
+        pkt.dts = av_rescale_q_rnd(pkt.dts, in_tb, out_stream->time_base, AV_ROUND_NEAR_INF|AV_ROUND_PASS_MINMAX);
+        pkt.duration = av_rescale_q(pkt.duration, in_tb, out_stream->time_base);
+        pkt.pos = -1;
+
+        /* the muxer takes the packet */
+        stream_index = pkt.stream_index;
+        size = pkt.size;
+
+        start = av_gettime_relative();
+        if (s->direct_write)
+            ret = av_write_frame(o->ofmt_ctx, &pkt);
+        else
+            ret = av_interleaved_write_frame(o->ofmt_ctx, &pkt);
+        latency = av_gettime_relative() - start;
+        histogram_record(s->write_latency, latency);
+        TRACE_PROBE(remux, packet_write, o->url, stream_index, size, ts, latency, ret);
+        av_packet_unref(&pkt);
+
+        if (ret < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Error muxing packet to '%s': %s\n",
+                   o->url, av_err2str(ret));
+            o->ret = ret;
+            atomic_store(&o->failed, 1);
+            packet_ring_abort(o->ring);
+            break;
+        }
+
+        if (stream_index < REMUX_MAX_STREAMS) {
+            StreamCounters *sc = &s->streams[stream_index];
+
+            atomic_fetch_add_explicit(&sc->packets_out, 1, memory_order_relaxed);
+            atomic_fetch_add_explicit(&sc->bytes_out, size, memory_order_relaxed);
+        }
+
+        if (!atomic_load_explicit(&s->first_write_latency, memory_order_relaxed)) {
+            int_least64_t expected = 0;
+            int64_t latency = av_gettime_relative() - s->start_time;
+
+            if (atomic_compare_exchange_strong(&s->first_write_latency,
+                                               &expected, latency)) {
+                av_log(NULL, AV_LOG_INFO, "First packet muxed %"PRId64" ms "
+                       "after connecting\n", latency / 1000);
+                session_phase_done(s, "first_packet_write", start);
+            }
+        }
+    }
+
+    output_close(o);
+
+    av_log(NULL, AV_LOG_INFO, "Packet ring high-water mark of '%s': %d/%d\n",
+           o->url, packet_ring_high_water(o->ring), packet_ring_depth(o->ring));
+
+    return NULL;
+}
+
+static RemuxOutput *output_alloc(RemuxSession *s, const char *url,
+                                 const char *format_name)
+{
+    RemuxOutput *o = av_mallocz(sizeof(*o));
+    if (!o)
+        return NULL;
+
+    o->session = s;
+    o->url = av_strdup(url);
+    if (format_name)
+        o->format_name = av_strdup(format_name);
+    o->ring = packet_ring_alloc(s->opts.ring_depth);
+    if (s->opts.spill_dir)
+        o->spill = spill_queue_alloc(s->opts.spill_dir, s->opts.spill_size);
+
+    atomic_init(&o->failed, 0);
+    atomic_init(&o->dropped_packets, 0);
+    atomic_init(&o->nb_segments, 0);
+
+    if (!o->url || (format_name && !o->format_name) || !o->ring ||
+        (s->opts.spill_dir && !o->spill)) {
+        packet_ring_free(&o->ring);
+        spill_queue_free(&o->spill);
+        av_freep(&o->url);
+        av_freep(&o->format_name);
+        av_freep(&o);
+    }
+
+    return o;
+}
+
+static void output_free(RemuxOutput **po)
+{
+    RemuxOutput *o = *po;
+    if (!o)
+        return;
+
+    packet_ring_free(&o->ring);
+    spill_queue_free(&o->spill);
+    av_freep(&o->url);
+    av_freep(&o->format_name);
+    av_freep(&o->seg_filename);
+    av_freep(&o->last_expanded);
+    av_freep(po);
+}
+
+/**
+ * Move the spilled packets of an output back into its ring, as far as it
+ * has room, or entirely if wait is set.
+ */
+static int output_unspill(RemuxOutput *o, int wait)
+{
+    int ret;
+
+    if (!o->spill)
+        return 0;
+
+    ret = spill_queue_drain(o->spill, o->ring, wait);
+    if (ret < 0 && ret != AVERROR_EXIT)
+        av_log(NULL, AV_LOG_ERROR, "Could not read back the spilled packets "
+               "of '%s': %s\n", o->url, av_err2str(ret));
+
+    if (o->spilling && !spill_queue_pending(o->spill)) {
+        o->spilling = 0;
+        av_log(NULL, AV_LOG_WARNING, "Output '%s' caught up\n", o->url);
+    }
+
+    return ret;
+}
+
+/**
+ * Queue a packet for an output, spilling it to disk if its ring is full.
+ * Once the scratch file is full, or without one, wait for a free slot if
+ * wait is set.
+ *
+ * @return 0 on success, AVERROR(EAGAIN) if the packet could not be queued
+ *         without waiting, another negative AVERROR code on failure
+ */
+static int output_queue(RemuxOutput *o, AVPacket *pkt, int wait)
+{
+    int ret;
+
+    if (o->spill) {
+        ret = output_unspill(o, 0);
+        if (ret < 0)
+            return ret;
+
+        /* packets only bypass the scratch file while it is empty */
+        if (!spill_queue_pending(o->spill)) {
+            ret = packet_ring_try_push(o->ring, pkt);
+            if (ret != AVERROR(EAGAIN))
+                return ret;
+        }
+
+        ret = spill_queue_push(o->spill, pkt);
+        if (ret >= 0) {
+            if (!o->spilling) {
+                o->spilling = 1;
+                av_log(NULL, AV_LOG_WARNING,
+                       "Output '%s' is stalled, spilling packets to disk\n", o->url);
+            }
+            return 0;
+        }
+        if (!wait)
+            return AVERROR(EAGAIN);
+
+        ret = output_unspill(o, 1);
+        if (ret < 0)
+            return ret;
+    }
+
+    return wait ? packet_ring_push(o->ring, pkt) : packet_ring_try_push(o->ring, pkt);
+}
+
+/**
+ * Hand a packet to every output.
+ *
+ * A single output is fed with backpressure. With several outputs, an
+ * output whose ring is full loses packets until the next keyframe instead
+ * of stalling the reader and, through it, the other outputs. With
+ * spill_dir set, either only happens once the scratch file is full.
+ */
+static int session_dispatch(RemuxSession *s, AVPacket *pkt)
+{
+    int is_key = !s->has_video ||
+                 (s->out_codecpar[pkt->stream_index]->codec_type == AVMEDIA_TYPE_VIDEO &&
+                  pkt->flags & AV_PKT_FLAG_KEY);
+    int alive = 0;
+    int ret, i;
+
+    if (s->nb_outputs == 1) {
+        ret = output_queue(s->outputs[0], pkt, 1);
+        if (ret < 0)
+            av_packet_unref(pkt);
+        return ret;
+    }
+
+    for (i = 0; i < s->nb_outputs; i++) {
+        RemuxOutput *o = s->outputs[i];
+        AVPacket out_pkt;
+
+        if (atomic_load(&o->failed))
+            continue;
+        alive++;
+
+        if (o->need_keyframe) {
+            if (!is_key) {
+                atomic_fetch_add(&o->dropped_packets, 1);
+                continue;
+            }
+            o->need_keyframe = 0;
+        }
+
+        ret = av_packet_ref(&out_pkt, pkt);
+        if (ret < 0) {
+            av_packet_unref(pkt);
+            return ret;
+        }
+
+        if (output_queue(o, &out_pkt, 0) < 0) {
+            av_packet_unref(&out_pkt);
+            atomic_fetch_add(&o->dropped_packets, 1);
+            o->need_keyframe = 1;
+            av_log(NULL, AV_LOG_WARNING,
+                   "Output '%s' is stalled, dropping packets\n", o->url);
+        }
+    }
+
+    av_packet_unref(pkt);
+    return alive ? 0 : AVERROR_EXIT;
+}
+
+/**
+ * Hand the packet with the lowest DTS of the reorder window to the
+ * outputs.
+ */
+static int session_reorder_pop(RemuxSession *s)
+{
+    AVPacket pkt;
+
+    av_packet_move_ref(&pkt, &s->reorder[0]);
+    s->nb_reorder--;
+    memmove(&s->reorder[0], &s->reorder[1], s->nb_reorder * sizeof(*s->reorder));
+    memmove(&s->reorder_ts[0], &s->reorder_ts[1], s->nb_reorder * sizeof(*s->reorder_ts));
+
+    return session_dispatch(s, &pkt);
+}
+
+/**
+ * Put a packet in the reorder window, after those with the same or a
+ * lower DTS, and dispatch the first packet of the window once it is full.
+ * Without direct_write, the packet is dispatched right away.
+ */
+static int session_reorder(RemuxSession *s, AVPacket *pkt)
+{
+    int64_t ts;
+    int i;
+
+    if (!s->direct_write)
+        return session_dispatch(s, pkt);
+
+    ts = av_rescale_q(pkt->dts, s->in_time_base[pkt->stream_index], AV_TIME_BASE_Q);
+
+    /* the input is interleaved already: this rarely goes past the end */
+    for (i = s->nb_reorder; i > 0 && s->reorder_ts[i - 1] > ts; i--)
+        ;
+    memmove(&s->reorder[i + 1], &s->reorder[i], (s->nb_reorder - i) * sizeof(*s->reorder));
+    memmove(&s->reorder_ts[i + 1], &s->reorder_ts[i], (s->nb_reorder - i) * sizeof(*s->reorder_ts));
+    av_packet_move_ref(&s->reorder[i], pkt);
+    s->reorder_ts[i] = ts;
+    s->nb_reorder++;
+
+    if (s->nb_reorder < s->opts.reorder_window)
+        return 0;
+    return session_reorder_pop(s);
+}
+
+/**
+ * Dispatch every packet left in the reorder window.
+ */
+static void session_reorder_flush(RemuxSession *s)
+{
+    while (s->nb_reorder) {
+        if (session_reorder_pop(s) < 0)
+            break;
+    }
+    while (s->nb_reorder)
+        av_packet_unref(&s->reorder[--s->nb_reorder]);
+}
+
+/**
+ * Compare the repaired DTS of a packet with the time it was read, both
+ * relative to the first packet.
+ */
+static void session_update_lag(RemuxSession *s, int stream_index, int64_t dts)
+{
+    int64_t ts, lag;
+
+    if (!s->read_time)
+        return;
+
+    ts = av_rescale_q(dts, s->in_time_base[stream_index], AV_TIME_BASE_Q);
+    if (s->lag_origin == AV_NOPTS_VALUE)
+        s->lag_origin = s->read_time - ts;
+    lag = s->read_time - s->lag_origin - ts;
+
+    /* only the reader stores them */
+    atomic_store_explicit(&s->lag, lag, memory_order_relaxed);
+    if (lag > atomic_load_explicit(&s->max_lag, memory_order_relaxed))
+        atomic_store_explicit(&s->max_lag, lag, memory_order_relaxed);
+}
+
+/**
+ * Make the DTS of a mapped packet monotonic increasing across jumps of the
+ * input and reconnects, and shift its PTS along.
+ */
+static void session_repair_timestamps(RemuxSession *s, AVPacket *pkt)
+{
+    /* rescale DTS to be monotonic increasing */
+    int64_t dts;
+    do {
+        if (s->in_last_dts[pkt->stream_index] == AV_NOPTS_VALUE) {
+            AVRational tb = s->in_time_base[pkt->stream_index];
+            int64_t ts;
+
+            if (s->resume_ts == AV_NOPTS_VALUE) {
+                dts = 0;
+                break;
+            }
+
+            /* reconnected: keep the offsets between streams of the new input */
+            ts = av_rescale_q(pkt->dts, tb, AV_TIME_BASE_Q);
+            if (s->resume_in_ts == AV_NOPTS_VALUE)
+                s->resume_in_ts = ts;
+            dts = av_rescale_q(s->resume_ts + ts - s->resume_in_ts, AV_TIME_BASE_Q, tb);
+            if (dts <= s->out_last_dts[pkt->stream_index])
+                dts = s->out_last_dts[pkt->stream_index] + 10;
+            atomic_fetch_add_explicit(&s->dts_resumes, 1, memory_order_relaxed);
+            TRACE_PROBE(remux, dts_repair, s, pkt->stream_index, "reconnect", pkt->dts, dts);
+            break;
+        }
+
+        if (pkt->dts > s->in_last_dts[pkt->stream_index]) {
+            if (pkt->dts > s->in_last_dts[pkt->stream_index] + 1000) {
+                dts = s->out_last_dts[pkt->stream_index] + 10;
+                atomic_fetch_add_explicit(&s->dts_jumps, 1, memory_order_relaxed);
+                TRACE_PROBE(remux, dts_repair, s, pkt->stream_index, "jump", pkt->dts, dts);
+            } else {
+                dts = pkt->dts - s->in_last_dts[pkt->stream_index] + s->out_last_dts[pkt->stream_index];
+            }
+        } else {
+            dts = s->out_last_dts[pkt->stream_index] + 10;
+            atomic_fetch_add_explicit(&s->dts_backwards, 1, memory_order_relaxed);
+            TRACE_PROBE(remux, dts_repair, s, pkt->stream_index, "backwards", pkt->dts, dts);
+        }
+    } while (0);
+    s->in_last_dts[pkt->stream_index] = pkt->dts;
+    s->out_last_dts[pkt->stream_index] = dts;
+    session_update_lag(s, pkt->stream_index, dts);
+
+    /* shift pts */
+    int64_t cts = pkt->pts - pkt->dts;
+    pkt->dts = dts;
+    pkt->pts = dts + cts;
+}
+
+/**
+ * Timestamp repair as a stage of the pipeline.
+ */
+static int session_repair_stage(void *opaque, const PacketStreams *streams,
+                                AVPacket **pkts, int *nb_pkts)
+{
+    int i;
+
+    for (i = 0; i < *nb_pkts; i++)
+        session_repair_timestamps(opaque, pkts[i]);
+
+    return 0;
+}
+
+/**
+ * Run the batched packets through the pipeline and queue what is left
+ * for the writers.
+ *
+ * @return 0 on success, a negative AVERROR code otherwise
+ */
+static int session_flush_batch(RemuxSession *s)
+{
+    PacketStreams streams = { s->out_codecpar, s->in_time_base, s->nb_out_streams };
+    int nb_pkts = s->nb_batch;
+    int ret, i;
+
+    if (!nb_pkts)
+        return 0;
+    s->nb_batch = 0;
+
+    ret = packet_pipeline_run(s->pipeline, &streams, s->batch, &nb_pkts);
+    for (i = 0; i < nb_pkts; i++) {
+        if (ret >= 0)
+            ret = session_reorder(s, s->batch[i]);
+        av_packet_unref(s->batch[i]);
+    }
+
+    return ret;
+}
+
+/**
+ * Map a packet read from the input to its output stream, fix its
+ * timestamps and queue it for the writers. With a pipeline, the packet is
+ * batched instead, until the batch is full or session_flush_batch().
+ *
+ * @return 0 on success, a negative AVERROR code otherwise
+ */
+static int session_process_packet(RemuxSession *s, AVPacket *pkt)
+{
+    int in_index;
+
+    in_index = pkt->stream_index;
+    if (in_index >= s->stream_mapping_size ||
+        s->stream_mapping[in_index] < 0) {
+        av_packet_unref(pkt);
+        return 0;
+    }
+
+    pkt->stream_index = s->stream_mapping[in_index];
+
+    if (pkt->stream_index < REMUX_MAX_STREAMS) {
+        StreamCounters *sc = &s->streams[pkt->stream_index];
+
+        atomic_fetch_add_explicit(&sc->packets_in, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&sc->bytes_in, pkt->size, memory_order_relaxed);
+    }
+
+    if (!s->pipeline) {
+        session_repair_timestamps(s, pkt);
+        return session_reorder(s, pkt);
+    }
+
+    av_packet_move_ref(s->batch[s->nb_batch++], pkt);
+    if (s->nb_batch == PACKET_BATCH_SIZE)
+        return session_flush_batch(s);
+    return 0;
+}
+
+/**
+ * @return whether the next packet can be demuxed from data already read
+ */
+static int session_input_buffered(RemuxSession *s)
+{
+    AVIOContext *pb = s->ifmt_ctx->pb;
+
+    return pb && pb->buf_ptr < pb->buf_end;
+}
+
+/**
+ * av_read_frame() accounted in the read latency.
+ */
+static int session_timed_read(RemuxSession *s, AVPacket *pkt)
+{
+    int64_t start = av_gettime_relative();
+    int ret;
+
+    ret = av_read_frame(s->ifmt_ctx, pkt);
+    s->read_time = av_gettime_relative();
+    histogram_record(s->read_latency, s->read_time - start);
+    TRACE_PROBE(remux, packet_read, s, ret, pkt->stream_index, pkt->size, pkt->dts,
+                s->read_time - start);
+    if (ret >= 0)
+        atomic_store_explicit(&s->last_read_time, s->read_time,
+                              memory_order_relaxed);
+
+    return ret;
+}
+
+/**
+ * Read one packet and queue it for the writers.
+ *
+ * @return 0 on success, a negative AVERROR code at the end of input
+ */
+static int session_read_packet(RemuxSession *s, AVPacket *pkt)
+{
+    int ret;
+
+    ret = session_timed_read(s, pkt);
+    if (ret < 0) {
+        /* the packets of this input are repaired before another one opens */
+        int flush_ret = session_flush_batch(s);
+
+        if (flush_ret < 0)
+            return flush_ret;
+        /* the demuxer may report the end of a stalled transfer as EOF */
+        if (s->ingest && s->opts.stall_timeout &&
+            s->ifmt_ctx->pb->error == AVERROR(ETIMEDOUT) &&
+            !atomic_exchange(&s->stalled, 1)) {
+            atomic_fetch_add(&s->nb_stalls, 1);
+            av_log(NULL, AV_LOG_WARNING, "No data for %"PRId64" ms (usual gap %"
+                   PRId64" ms), dropping the input\n",
+                   (int64_t)atomic_load(&s->stall_limit) / 1000,
+                   (int64_t)s->gap_peak / 1000);
+        }
+        if (!atomic_load(&s->stalled))
+            return ret;
+        s->stall_detected = av_gettime_relative();
+        return AVERROR(ETIMEDOUT);
+    }
+    session_watchdog_feed(s, s->read_time);
+
+    ret = session_process_packet(s, pkt);
+    /* a batch ends where the demuxer would wait for the network */
+    if (ret >= 0 && s->nb_batch && !session_input_buffered(s))
+        ret = session_flush_batch(s);
+
+    return ret;
+}
+
+/**
+ * Fast start: instead of avformat_find_stream_info(), read packets only
+ * until the FLV sequence headers of every stream and the first video
+ * keyframe have arrived, and take the codec parameters from the decoder
+ * configuration records. The packets read are kept for the writers.
+ *
+ * @return 0 on success, a negative AVERROR code otherwise
+ */
+static int session_fast_probe(RemuxSession *s)
+{
+    AVFormatContext *ifmt_ctx = s->ifmt_ctx;
+    int64_t first_ts = AV_NOPTS_VALUE;
+    int has_keyframe = 0;
+    int ret, i;
+
+    while (s->nb_probe_pkts < FAST_START_MAX_PACKETS && !session_interrupted(s)) {
+        AVPacket *pkt = av_packet_alloc();
+        AVStream *st;
+        int has_audio = 0, has_video = 0, ready = 1;
+        int64_t ts;
+
+        if (!pkt)
+            return AVERROR(ENOMEM);
+
+        ret = session_timed_read(s, pkt);
+        if (ret < 0) {
+            av_packet_free(&pkt);
+            if (!s->nb_probe_pkts)
+                return ret;
+            break;
+        }
+
+        ret = av_dynarray_add_nofree(&s->probe_pkts, &s->nb_probe_pkts, pkt);
+        if (ret < 0) {
+            av_packet_free(&pkt);
+            return ret;
+        }
+
+        st = ifmt_ctx->streams[pkt->stream_index];
+        if (st->codecpar->codec_type == AVMEDIA_TYPE_VIDEO &&
+            pkt->flags & AV_PKT_FLAG_KEY)
+            has_keyframe = 1;
+
+        for (i = 0; i < ifmt_ctx->nb_streams; i++) {
+            AVCodecParameters *par = ifmt_ctx->streams[i]->codecpar;
+
+            has_audio |= par->codec_type == AVMEDIA_TYPE_AUDIO;
+            has_video |= par->codec_type == AVMEDIA_TYPE_VIDEO;
+            ready &= codec_config_ready(par);
+        }
+        if (ready && has_audio && has_video && has_keyframe)
+            break;
+
+        /* a stream may be missing for good, do not wait longer than this */
+        if (pkt->dts == AV_NOPTS_VALUE)
+            continue;
+        ts = av_rescale_q(pkt->dts, st->time_base, AV_TIME_BASE_Q);
+        if (first_ts == AV_NOPTS_VALUE)
+            first_ts = ts;
+        else if (ts - first_ts >= FAST_START_MAX_DURATION)
+            break;
+    }
+
+    for (i = 0; i < ifmt_ctx->nb_streams; i++) {
+        AVCodecParameters *par = ifmt_ctx->streams[i]->codecpar;
+
+        ret = codec_config_parse(par);
+        if (ret < 0 && ret != AVERROR(ENOSYS))
+            av_log(ifmt_ctx, AV_LOG_WARNING, "Could not parse the codec "
+                   "configuration of stream #%d: %s\n", i, av_err2str(ret));
+    }
+
+    return 0;
+}
+
+/**
+ * Options of FFmpeg's http protocol for the input.
+ */
+static void session_http_options(RemuxSession *s, AVDictionary **options)
+{
+    if (!s->http_headers)
+        return;
+
+    av_dict_set(options, "timeout", "5000000", AV_DICT_APPEND);
+    av_dict_set(options, "headers", s->http_headers, AV_DICT_APPEND);
+    av_dict_set(options, "multiple_requests", "1", AV_DICT_APPEND);
+    av_dict_set(options, "reconnect_at_eof", "1", AV_DICT_APPEND);
+    av_dict_set(options, "reconnect_streamed", "1", AV_DICT_APPEND);
+    av_dict_set(options, "reconnect_delay_max", "3", AV_DICT_APPEND);
+}
+
+static int session_use_curl(RemuxSession *s)
+{
+    const char *protocol = avio_find_protocol_name(s->in_filename);
+
+    return s->opts.curl_input && protocol && av_match_name(protocol, "http,https");
+}
+
+static void input_avio_close(AVIOContext **pb)
+{
+    avio_closep(pb);
+}
+
+/**
+ * Open the input with the read-ahead stage between its source and the
+ * demuxer.
+ *
+ * @return 0 on success, a negative AVERROR code otherwise
+ */
+static int session_open_read_ahead(RemuxSession *s)
+{
+    AVIOInterruptCB int_cb = read_ahead_interrupt_cb(s->read_ahead);
+    AVIOContext *source = NULL;
+    void (*close_source)(AVIOContext **pb);
+    int ret;
+
+    if (session_use_curl(s)) {
+        ret = curl_input_open(&source, s->in_filename, s->http_headers, &int_cb);
+        close_source = curl_input_close;
+    } else {
+        AVDictionary *options = NULL;
+
+        session_http_options(s, &options);
+        ret = avio_open2(&source, s->in_filename, AVIO_FLAG_READ, &int_cb, &options);
+        av_dict_free(&options);
+        close_source = input_avio_close;
+    }
+    if (ret < 0)
+        return ret;
+
+    ret = read_ahead_start(s->read_ahead, source, close_source, &s->input_pb);
+    if (ret < 0) {
+        close_source(&source);
+        return ret;
+    }
+    s->input_pb_close = read_ahead_stop;
+
+    return 0;
+}
+
+/**
+ * Open the input and read its stream parameters.
+ *
+ * @return 0 on success, a negative AVERROR code otherwise
+ */
+static int session_open_input(RemuxSession *s)
+{
+    AVFormatContext *ifmt_ctx = NULL;
+    AVDictionary *options = NULL;
+    int64_t start = av_gettime_relative();
+    int ret = 0;
+
+    if (s->ingest) {
+        ret = ingest_stream_open_avio(s->ingest, &s->input_pb);
+        s->input_pb_close = ingest_stream_close_avio;
+    } else if (s->read_ahead) {
+        ret = session_open_read_ahead(s);
+    } else if (session_use_curl(s)) {
+        AVIOInterruptCB int_cb = { session_input_interrupt_cb, s };
+
+        ret = curl_input_open(&s->input_pb, s->in_filename, s->http_headers,
+                              &int_cb);
+        s->input_pb_close = curl_input_close;
+    } else {
+        session_http_options(s, &options);
+    }
+    if (ret < 0) {
+        session_phase_done(s, "avformat_open_input", start);
+        fprintf(stderr, "Could not open input file '%s'\n", s->in_filename);
+        return ret;
+    }
+
+    ifmt_ctx = avformat_alloc_context();
+    if (!ifmt_ctx) {
+        av_dict_free(&options);
+        return AVERROR(ENOMEM);
+    }
+    ifmt_ctx->interrupt_callback = (AVIOInterruptCB){ session_input_interrupt_cb, s };
+    if (s->input_pb) {
+        ifmt_ctx->pb = s->input_pb;
+        ifmt_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+    }
+
+    ret = avformat_open_input(&ifmt_ctx, s->in_filename, 0, &options);
+    session_phase_done(s, "avformat_open_input", start);
+    av_dict_free(&options);
+    if (ret < 0) {
+        fprintf(stderr, "Could not open input file '%s'\n", s->in_filename);
+        return ret;
+    }
+    s->ifmt_ctx = ifmt_ctx;
+
+    /* the sequence headers are only known to carry everything in FLV */
+    start = av_gettime_relative();
+    if (s->opts.fast_start &&
+        av_match_name(ifmt_ctx->iformat->name, "flv,live_flv")) {
+        ret = session_fast_probe(s);
+        session_phase_done(s, "fast_start_probe", start);
+        if (ret < 0) {
+            fprintf(stderr, "Failed to read the stream headers\n");
+            return ret;
+        }
+    } else if (s->ingest) {
+        fprintf(stderr, "Input '%s' is not FLV\n", s->in_filename);
+        return AVERROR_INVALIDDATA;
+    } else {
+        ret = avformat_find_stream_info(ifmt_ctx, 0);
+        session_phase_done(s, "avformat_find_stream_info", start);
+        if (ret < 0) {
+            fprintf(stderr, "Failed to retrieve input stream information\n");
+            return ret;
+        }
+    }
+
+    av_dump_format(ifmt_ctx, 0, s->in_filename, 0);
+
+    return 0;
+}
+
+static void session_close_input(RemuxSession *s)
+{
+    int i;
+
+    for (i = 0; i < s->nb_probe_pkts; i++)
+        av_packet_free(&s->probe_pkts[i]);
+    av_freep(&s->probe_pkts);
+    s->nb_probe_pkts = 0;
+
+    avformat_close_input(&s->ifmt_ctx);
+    if (s->input_pb)
+        s->input_pb_close(&s->input_pb);
+}
+
+static int session_stream_usable(const AVCodecParameters *par)
+{
+    return par->codec_type == AVMEDIA_TYPE_AUDIO ||
+           par->codec_type == AVMEDIA_TYPE_VIDEO ||
+           par->codec_type == AVMEDIA_TYPE_SUBTITLE;
+}
+
+static void session_free_streams(RemuxSession *s)
+{
+    int i;
+
+    av_freep(&s->stream_mapping);
+    av_freep(&s->in_last_dts);
+    av_freep(&s->out_last_dts);
+    av_freep(&s->in_time_base);
+    for (i = 0; i < s->nb_out_streams; i++)
+        avcodec_parameters_free(&s->out_codecpar[i]);
+    av_freep(&s->out_codecpar);
+    s->stream_mapping_size = 0;
+    s->nb_out_streams = 0;
+    s->has_video = 0;
+}
+
+/**
+ * Create the output streams from the streams of the input.
+ * Only called while no writer is running.
+ *
+ * @return 0 on success, a negative AVERROR code otherwise
+ */
+static int session_setup_streams(RemuxSession *s)
+{
+    AVFormatContext *ifmt_ctx = s->ifmt_ctx;
+    int stream_index = 0;
+    int ret, i;
+
+    session_free_streams(s);
+    s->resume_ts = AV_NOPTS_VALUE;
+    /* the new streams start from zero */
+    s->lag_origin = AV_NOPTS_VALUE;
+
+    s->stream_mapping_size = ifmt_ctx->nb_streams;
+    s->stream_mapping = av_mallocz_array(s->stream_mapping_size, sizeof(*s->stream_mapping));
+    if (!s->stream_mapping)
+        return AVERROR(ENOMEM);
+
+    s->in_last_dts = av_mallocz_array(s->stream_mapping_size, sizeof(int64_t));
+    if (!s->in_last_dts)
+        return AVERROR(ENOMEM);
+
+    s->out_last_dts = av_mallocz_array(s->stream_mapping_size, sizeof(int64_t));
+    if (!s->out_last_dts)
+        return AVERROR(ENOMEM);
+
+    s->in_time_base = av_mallocz_array(s->stream_mapping_size, sizeof(AVRational));
+    if (!s->in_time_base)
+        return AVERROR(ENOMEM);
+
+    s->out_codecpar = av_mallocz_array(s->stream_mapping_size, sizeof(*s->out_codecpar));
+    if (!s->out_codecpar)
+        return AVERROR(ENOMEM);
+
+    for (i = 0; i < ifmt_ctx->nb_streams; i++) {
+        AVCodecParameters *out_codecpar;
+        AVStream *in_stream = ifmt_ctx->streams[i];
+        AVCodecParameters *in_codecpar = in_stream->codecpar;
+
+        if (!session_stream_usable(in_codecpar)) {
+            s->stream_mapping[i] = -1;
+            continue;
+        }
+
+        out_codecpar = avcodec_parameters_alloc();
+        if (!out_codecpar)
+            return AVERROR(ENOMEM);
+        s->out_codecpar[stream_index] = out_codecpar;
+        s->nb_out_streams = stream_index + 1;
+
+        ret = avcodec_parameters_copy(out_codecpar, in_codecpar);
+        if (ret < 0) {
+            fprintf(stderr, "Failed to copy codec parameters\n");
+            return ret;
+        }
+
+        if (out_codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+            s->has_video = 1;
+        if (stream_index < REMUX_MAX_STREAMS)
+            atomic_store(&s->streams[stream_index].type, out_codecpar->codec_type);
+
+        s->in_time_base[stream_index] = in_stream->time_base;
+        s->in_last_dts[stream_index] = AV_NOPTS_VALUE;
+        s->stream_mapping[i] = stream_index++;
+    }
+
+    s->direct_write = s->reorder &&
+                      av_match_name(ifmt_ctx->iformat->name, "flv,live_flv");
+    atomic_store(&s->nb_streams, FFMIN(s->nb_out_streams, REMUX_MAX_STREAMS));
+
+    return 0;
+}
+
+static int codecpar_equal(const AVCodecParameters *a, const AVCodecParameters *b)
+{
+    if (a->codec_type != b->codec_type || a->codec_id != b->codec_id ||
+        a->extradata_size != b->extradata_size ||
+        (a->extradata_size && memcmp(a->extradata, b->extradata, a->extradata_size)))
+        return 0;
+
+    if (a->codec_type == AVMEDIA_TYPE_VIDEO)
+        return a->width == b->width && a->height == b->height;
+    if (a->codec_type == AVMEDIA_TYPE_AUDIO)
+        return a->sample_rate == b->sample_rate && a->channels == b->channels;
+    return 1;
+}
+
+/**
+ * Map the streams of a reopened input onto the current output streams,
+ * if they carry the same codec parameters in the same order.
+ *
+ * @return 1 if the streams were mapped, 0 if they changed,
+ *         a negative AVERROR code on failure
+ */
+static int session_remap_streams(RemuxSession *s)
+{
+    AVFormatContext *ifmt_ctx = s->ifmt_ctx;
+    int *mapping;
+    int stream_index = 0;
+    int i;
+
+    if (ifmt_ctx->nb_streams > s->stream_mapping_size)
+        return 0;
+
+    mapping = av_mallocz_array(ifmt_ctx->nb_streams, sizeof(*mapping));
+    if (!mapping)
+        return AVERROR(ENOMEM);
+
+    for (i = 0; i < ifmt_ctx->nb_streams; i++) {
+        AVStream *in_stream = ifmt_ctx->streams[i];
+
+        if (!session_stream_usable(in_stream->codecpar)) {
+            mapping[i] = -1;
+            continue;
+        }
+
+        if (stream_index >= s->nb_out_streams ||
+            av_cmp_q(in_stream->time_base, s->in_time_base[stream_index]) ||
+            !codecpar_equal(in_stream->codecpar, s->out_codecpar[stream_index]))
+            break;
+
+        mapping[i] = stream_index++;
+    }
+
+    if (i < ifmt_ctx->nb_streams || stream_index != s->nb_out_streams) {
+        av_free(mapping);
+        return 0;
+    }
+
+    memcpy(s->stream_mapping, mapping, ifmt_ctx->nb_streams * sizeof(*mapping));
+    for (; i < s->stream_mapping_size; i++)
+        s->stream_mapping[i] = -1;
+    av_free(mapping);
+
+    /* continue right after the last packet written on any stream */
+    s->resume_ts = AV_NOPTS_VALUE;
+    s->resume_in_ts = AV_NOPTS_VALUE;
+    for (i = 0; i < s->nb_out_streams; i++) {
+        int64_t ts;
+
+        if (s->in_last_dts[i] == AV_NOPTS_VALUE)
+            continue;
+
+        ts = av_rescale_q(s->out_last_dts[i] + 10, s->in_time_base[i], AV_TIME_BASE_Q);
+        if (s->resume_ts == AV_NOPTS_VALUE || ts > s->resume_ts)
+            s->resume_ts = ts;
+        s->in_last_dts[i] = AV_NOPTS_VALUE;
+    }
+    if (s->resume_ts == AV_NOPTS_VALUE)
+        s->resume_ts = 0;
+
+    return 1;
+}
+
+/**
+ * Open every output and start its writer. An output that cannot be opened
+ * is dropped, the others go on.
+ *
+ * @return 0 if at least one output is running, a negative AVERROR code
+ *         otherwise
+ */
+static int session_start_outputs(RemuxSession *s)
+{
+    int nb_opened = 0;
+    int ret = 0, i;
+
+    for (i = 0; i < s->nb_outputs; i++) {
+        RemuxOutput *o = s->outputs[i];
+
+        if (atomic_load(&o->failed))
+            continue;
+
+        o->ret = output_open(o);
+        if (o->ret < 0) {
+            ret = o->ret;
+            atomic_store(&o->failed, 1);
+            continue;
+        }
+        nb_opened++;
+    }
+    if (!nb_opened)
+        return ret < 0 ? ret : AVERROR_EXIT;
+
+    for (i = 0; i < s->nb_outputs; i++) {
+        RemuxOutput *o = s->outputs[i];
+
+        if (atomic_load(&o->failed))
+            continue;
+
+        packet_ring_reopen(o->ring);
+        ret = pthread_create(&o->writer, NULL, output_writer, o);
+        if (ret) {
+            fprintf(stderr, "Could not start writer thread\n");
+            return AVERROR(ret);
+        }
+        o->writer_started = 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Let the writers drain their rings and finalize their files.
+ *
+ * @return the first error of an output, 0 if none failed
+ */
+static int session_stop_outputs(RemuxSession *s)
+{
+    int out_ret = 0;
+    int i;
+
+    session_flush_batch(s);
+    session_reorder_flush(s);
+
+    for (i = 0; i < s->nb_outputs; i++) {
+        RemuxOutput *o = s->outputs[i];
+
+        if (o->writer_started) {
+            output_unspill(o, 1);
+            packet_ring_close(o->ring);
+            pthread_join(o->writer, NULL);
+            o->writer_started = 0;
+        } else {
+            output_close(o);
+        }
+
+        if (o->ret < 0 && !out_ret)
+            out_ret = o->ret;
+    }
+
+    return out_ret;
+}
+
+/**
+ * Sleep for up to the given time, waking up early if the session is
+ * interrupted.
+ */
+static void session_sleep(RemuxSession *s, int64_t usec)
+{
+    int64_t end = av_gettime_relative() + usec;
+
+    while (!session_interrupted(s) && av_gettime_relative() < end)
+        av_usleep(FFMIN(end - av_gettime_relative(), 100000));
+}
+
+/**
+ * Delay before the given reconnect attempt, in microseconds.
+ */
+static int64_t session_backoff(int attempt)
+{
+    return attempt ? FFMIN(1 << (attempt - 1), 8) * (int64_t)AV_TIME_BASE : 0;
+}
+
+/**
+ * Ask opts.reconnect_url for the URL of the next attempt.
+ *
+ * @return 0 on success, a negative value to end the session
+ */
+static int session_update_url(RemuxSession *s)
+{
+    char url[4096];
+    int ret;
+
+    if (!s->opts.reconnect_url)
+        return 0;
+
+    av_strlcpy(url, s->in_filename, sizeof(url));
+    ret = s->opts.reconnect_url(s->opts.opaque, url, sizeof(url));
+    if (ret < 0)
+        return ret;
+
+    if (strcmp(url, s->in_filename)) {
+        char *in_filename = av_strdup(url);
+        if (!in_filename)
+            return AVERROR(ENOMEM);
+        av_free(s->in_filename);
+        s->in_filename = in_filename;
+    }
+
+    return 0;
+}
+
+/**
+ * Reopen the input after it was lost, asking opts.reconnect_url for a new
+ * URL before each attempt and backing off between failed attempts.
+ *
+ * @return 0 on success, a negative AVERROR code otherwise
+ */
+static int session_reconnect(RemuxSession *s)
+{
+    int ret = AVERROR_EXIT;
+    int attempt;
+
+    for (attempt = 0; attempt < s->opts.max_reconnects; attempt++) {
+        session_close_input(s);
+
+        session_sleep(s, session_backoff(attempt));
+        if (session_interrupted(s))
+            return AVERROR_EXIT;
+
+        ret = session_update_url(s);
+        if (ret < 0)
+            return ret;
+
+        TRACE_PROBE(remux, reconnect, s, attempt + 1, s->in_filename);
+        ret = session_open_input(s);
+        TRACE_PROBE(remux, reconnect_done, s, attempt + 1, ret);
+        if (ret >= 0) {
+            atomic_fetch_add(&s->nb_reconnects, 1);
+            return 0;
+        }
+
+        av_log(NULL, AV_LOG_WARNING, "Reconnect attempt %d failed: %s\n",
+               attempt + 1, av_err2str(ret));
+    }
+
+    return ret;
+}
+
+/**
+ * Go on with a reopened input. The current files are kept if the codec
+ * parameters did not change, otherwise every output starts a new file.
+ *
+ * @return 0 on success, a negative AVERROR code otherwise
+ */
+static int session_resume(RemuxSession *s)
+{
+    int ret;
+
+    ret = session_remap_streams(s);
+    if (ret)
+        return ret < 0 ? ret : 0;
+
+    av_log(s->ifmt_ctx, AV_LOG_WARNING,
+           "Codec parameters changed, starting new files\n");
+
+    ret = session_stop_outputs(s);
+    if (ret < 0)
+        return ret;
+
+    ret = session_setup_streams(s);
+    if (ret < 0)
+        return ret;
+
+    return session_start_outputs(s);
+}
+
+/**
+ * @return AVERROR_EXIT if the session was asked to stop, ret otherwise
+ */
+static int session_stop_reason(RemuxSession *s, int ret)
+{
+    if (keyboard_interrupt) {
+        av_log(s->ifmt_ctx, AV_LOG_WARNING, "%s\n", "Keyboard interrupt received");
+        return AVERROR_EXIT;
+    }
+    if (atomic_load(&s->abort_request)) {
+        av_log(s->ifmt_ctx, AV_LOG_WARNING, "%s\n", "Stop requested");
+        return AVERROR_EXIT;
+    }
+    if (session_interrupted(s)) {
+        av_log(s->ifmt_ctx, AV_LOG_WARNING, "%s\n", "Cancelled or past the deadline");
+        return AVERROR_EXIT;
+    }
+    return ret;
+}
+
+/**
+ * Finalize the outputs, release the input and set the final state.
+ *
+ * @return the result of the session
+ */
+static int session_end(RemuxSession *s, int ret)
+{
+    int out_ret;
+
+    out_ret = session_stop_outputs(s);
+
+    /* a failed writer ends the read with AVERROR_EXIT, report its error */
+    if (out_ret < 0 && !session_interrupted(s) &&
+        (ret >= 0 || ret == AVERROR_EOF || ret == AVERROR_EXIT))
+        ret = out_ret;
+
+    session_close_input(s);
+    session_free_streams(s);
+
+    if (ret == AVERROR_EXIT) {
+        atomic_store(&s->state, REMUX_STATE_STOPPED);
+        return ret;
+    }
+
+    if (ret < 0 && ret != AVERROR_EOF) {
+        atomic_store(&s->state, REMUX_STATE_FAILED);
+        return ret;
+    }
+
+    atomic_store(&s->state, REMUX_STATE_FINISHED);
+    return 0;
+}
+
+static int session_run(RemuxSession *s)
+{
+    AVPacket pkt = { 0 };
+    int ret, read_ret, i;
+
+    pthread_once(&remux_init_once, remux_global_init);
+    atomic_store(&s->state, REMUX_STATE_OPENING);
+    s->start_time = av_gettime_relative();
+
+    ret = session_open_input(s);
+    if (ret < 0)
+        goto end;
+
+    ret = session_setup_streams(s);
+    if (ret < 0)
+        goto end;
+
+    ret = session_start_outputs(s);
+    if (ret < 0)
+        goto end;
+
+    atomic_store(&s->state, REMUX_STATE_RUNNING);
+
+    av_init_packet(&pkt);
+    for (;;) {
+        ret = 0;
+        for (i = 0; i < s->nb_probe_pkts && ret >= 0; i++)
+            ret = session_process_packet(s, s->probe_pkts[i]);
+        if (ret >= 0)
+            ret = session_flush_batch(s);
+
+        session_watchdog_arm(s);
+        while (ret >= 0 && !session_interrupted(s)) {
+            ret = session_read_packet(s, &pkt);
+        }
+        session_watchdog_disarm(s);
+        av_packet_unref(&pkt);
+
+        /* AVERROR_EXIT: no output left to write to */
+        if (session_interrupted(s) || ret == AVERROR_EXIT ||
+            s->opts.max_reconnects <= 0)
+            break;
+
+        av_log(s->ifmt_ctx, AV_LOG_WARNING, "Input lost: %s, reconnecting\n",
+               av_err2str(ret));
+
+        read_ret = ret;
+        ret = session_reconnect(s);
+        if (ret >= 0)
+            ret = session_resume(s);
+        if (ret < 0) {
+            /* the stream most likely ended, report how the read ended */
+            if (ret != AVERROR_EXIT && ret != AVERROR(ENOMEM))
+                ret = read_ret;
+            break;
+        }
+    }
+
+    ret = session_stop_reason(s, ret);
+
+end:
+    return session_end(s, ret);
+}
+
+static void *session_thread(void *arg)
+{
+    RemuxSession *s = arg;
+
+    s->ret = session_run(s);
+    return NULL;
+}
+
+static void session_ingest_step(void *arg);
+
+/**
+ * on_data callback of the ingest stream: queue a step of the session
+ * unless one is already queued or running.
+ */
+static void session_ingest_wakeup(void *opaque)
+{
+    RemuxSession *s = opaque;
+
+    if (atomic_exchange(&s->ingest_scheduled, 1))
+        return;
+
+    if (ingest_engine_submit(s->opts.ingest, session_ingest_step, s) < 0)
+        atomic_store(&s->ingest_scheduled, 0);
+}
+
+/**
+ * Whether a step has something to do without waiting for the network.
+ */
+static int session_ingest_pending(RemuxSession *s)
+{
+    if (session_interrupted(s))
+        return 1;
+    if (atomic_load(&s->refreshing))
+        return 0;
+    if (s->refresh_ret < 0)
+        return 1;
+    return ingest_stream_ready(s->ingest, s->ifmt_ctx ? avio_tell(s->ifmt_ctx->pb) : -1);
+}
+
+/**
+ * Start the transfer of attempt s->ingest_attempts after its backoff delay.
+ */
+static int session_ingest_restart(RemuxSession *s)
+{
+    TRACE_PROBE(remux, reconnect, s, s->ingest_attempts, s->in_filename);
+    return ingest_stream_restart(s->ingest, s->in_filename,
+                                 session_backoff(s->ingest_attempts - 1));
+}
+
+/**
+ * Thread asking opts.reconnect_url for the next URL, which may block on
+ * the network, then restarting the transfer. A failure is left in
+ * refresh_ret for a step to end the session with.
+ */
+static void *session_ingest_refresh(void *arg)
+{
+    RemuxSession *s = arg;
+    int ret;
+
+    ret = session_update_url(s);
+    if (ret < 0)
+        ret = ret == AVERROR(ENOMEM) ? ret : s->ingest_read_ret;
+    else if (!session_interrupted(s))
+        ret = session_ingest_restart(s);
+
+    s->refresh_ret = ret;
+    atomic_store(&s->refreshing, 0);
+
+    /* the new transfer wakes a step once its data has arrived */
+    if (ret < 0)
+        session_ingest_wakeup(s);
+    return NULL;
+}
+
+/**
+ * Restart the transfer of a lost input after the backoff delay. The input
+ * is opened again by a later step, once data has arrived. A new URL is
+ * asked for on a thread of its own, the workers must not block.
+ *
+ * @return AVERROR(EAGAIN) to wait for the data, another negative AVERROR
+ *         code to end the session
+ */
+static int session_ingest_reconnect(RemuxSession *s, int read_ret)
+{
+    int ret;
+
+    session_close_input(s);
+
+    if (s->ingest_attempts >= s->opts.max_reconnects)
+        return read_ret;
+
+    av_log(NULL, AV_LOG_WARNING, "Input lost: %s, reconnecting\n",
+           av_err2str(read_ret));
+
+    s->ingest_attempts++;
+    s->ingest_read_ret = read_ret;
+
+    if (!s->opts.reconnect_url) {
+        ret = session_ingest_restart(s);
+        return ret < 0 ? ret : AVERROR(EAGAIN);
+    }
+
+    /* the previous refresh is over, refreshing was cleared */
+    if (s->refresh_started) {
+        pthread_join(s->refresh_thread, NULL);
+        s->refresh_started = 0;
+    }
+
+    s->refresh_ret = 0;
+    atomic_store(&s->refreshing, 1);
+    ret = pthread_create(&s->refresh_thread, NULL, session_ingest_refresh, s);
+    if (ret) {
+        atomic_store(&s->refreshing, 0);
+        return AVERROR(ret);
+    }
+    s->refresh_started = 1;
+
+    return AVERROR(EAGAIN);
+}
+
+/**
+ * Open the buffered input, on the first step and after each reconnect.
+ *
+ * @return 0 on success, a negative AVERROR code otherwise
+ */
+static int session_ingest_open(RemuxSession *s)
+{
+    int ret, i;
+
+    ret = session_open_input(s);
+    if (ret < 0) {
+        if (!s->ingest_started || session_interrupted(s))
+            return ret;
+        av_log(NULL, AV_LOG_WARNING, "Reconnect attempt %d failed: %s\n",
+               s->ingest_attempts, av_err2str(ret));
+        return session_ingest_reconnect(s, s->ingest_read_ret);
+    }
+
+    if (!s->ingest_started) {
+        ret = session_setup_streams(s);
+        if (ret >= 0)
+            ret = session_start_outputs(s);
+        if (ret < 0)
+            return ret;
+        s->ingest_started = 1;
+        atomic_store(&s->state, REMUX_STATE_RUNNING);
+    } else {
+        atomic_fetch_add(&s->nb_reconnects, 1);
+        ret = session_resume(s);
+        if (ret < 0)
+            return ret;
+    }
+    s->ingest_attempts = 0;
+    session_watchdog_arm(s);
+
+    for (i = 0; i < s->nb_probe_pkts && ret >= 0; i++)
+        ret = session_process_packet(s, s->probe_pkts[i]);
+    if (ret >= 0)
+        ret = session_flush_batch(s);
+
+    return ret;
+}
+
+/**
+ * Read the packets that can be read without waiting for the network.
+ *
+ * @return AVERROR(EAGAIN) when more data is needed, another negative
+ *         AVERROR code when the session is over
+ */
+static int session_ingest_run(RemuxSession *s)
+{
+    AVPacket pkt = { 0 };
+    int ret = 0;
+
+    if (!s->ifmt_ctx) {
+        if (session_interrupted(s))
+            return AVERROR_EXIT;
+        if (atomic_load(&s->refreshing))
+            return AVERROR(EAGAIN);
+        if (s->refresh_ret < 0)
+            return s->refresh_ret;
+        if (!ingest_stream_ready(s->ingest, -1))
+            return AVERROR(EAGAIN);
+
+        ret = session_ingest_open(s);
+        if (ret < 0)
+            return ret;
+    }
+
+    av_init_packet(&pkt);
+    while (ret >= 0 && !session_interrupted(s) &&
+           ingest_stream_ready(s->ingest, avio_tell(s->ifmt_ctx->pb)))
+        ret = session_read_packet(s, &pkt);
+    av_packet_unref(&pkt);
+    if (ret >= 0)
+        ret = session_flush_batch(s);
+
+    if (session_interrupted(s))
+        return AVERROR_EXIT;
+    if (ret >= 0)
+        return AVERROR(EAGAIN);
+
+    /* AVERROR_EXIT: no output left to write to */
+    if (ret == AVERROR_EXIT || s->opts.max_reconnects <= 0)
+        return ret;
+
+    s->ingest_attempts = 0;
+    return session_ingest_reconnect(s, ret);
+}
+
+/**
+ * Worker task of a session fed by the ingest engine. At most one step of
+ * a session is queued or running at a time.
+ */
+static void session_ingest_step(void *arg)
+{
+    RemuxSession *s = arg;
+    int ret;
+
+    ret = session_ingest_run(s);
+    if (ret == AVERROR(EAGAIN)) {
+        atomic_store(&s->ingest_scheduled, 0);
+
+        /* data that arrived during the step found the step still queued */
+        if (session_ingest_pending(s))
+            session_ingest_wakeup(s);
+        return;
+    }
+
+    /* ingest_scheduled stays set, no step runs anymore */
+    ret = session_end(s, session_stop_reason(s, ret));
+    ingest_stream_abort(s->ingest);
+
+    pthread_mutex_lock(&s->done_lock);
+    s->ret = ret;
+    s->done = 1;
+    pthread_cond_broadcast(&s->done_cond);
+    pthread_mutex_unlock(&s->done_lock);
+}
+
+static int session_ingest_start(RemuxSession *s)
+{
+    pthread_once(&remux_init_once, remux_global_init);
+    atomic_store(&s->state, REMUX_STATE_OPENING);
+    s->start_time = av_gettime_relative();
+
+    s->ingest = ingest_stream_open(s->opts.ingest, s->in_filename, s->http_headers,
+                                   session_ingest_wakeup, s);
+    if (!s->ingest)
+        return AVERROR(ENOMEM);
+    if (s->opts.stall_timeout)
+        ingest_stream_set_stall_limit(s->ingest, s->opts.stall_timeout);
+
+    return 0;
+}
+
+RemuxSession *remux_session_create(const char *in_filename,
+                                   const char *out_filename,
+                                   const char *http_headers,
+                                   const RemuxOptions *opts)
+{
+    RemuxSession *s = av_mallocz(sizeof(*s));
+    int i;
+
+    if (!s)
+        return NULL;
+
+    if (opts)
+        s->opts = *opts;
+    else
+        remux_options_default(&s->opts);
+
+    atomic_init(&s->state, REMUX_STATE_IDLE);
+    atomic_init(&s->abort_request, 0);
+    atomic_init(&s->first_write_latency, 0);
+    atomic_init(&s->nb_reconnects, 0);
+    atomic_init(&s->last_packet_time, 0);
+    atomic_init(&s->stall_limit, s->opts.stall_timeout);
+    atomic_init(&s->stalled, 0);
+    atomic_init(&s->nb_stalls, 0);
+    atomic_init(&s->ingest_scheduled, 0);
+    atomic_init(&s->refreshing, 0);
+    for (i = 0; i < REMUX_MAX_STREAMS; i++) {
+        atomic_init(&s->streams[i].type, AVMEDIA_TYPE_UNKNOWN);
+        atomic_init(&s->streams[i].packets_in, 0);
+        atomic_init(&s->streams[i].bytes_in, 0);
+        atomic_init(&s->streams[i].packets_out, 0);
+        atomic_init(&s->streams[i].bytes_out, 0);
+    }
+    atomic_init(&s->nb_streams, 0);
+    atomic_init(&s->dts_jumps, 0);
+    atomic_init(&s->dts_backwards, 0);
+    atomic_init(&s->dts_resumes, 0);
+    atomic_init(&s->last_read_time, 0);
+    atomic_init(&s->lag, 0);
+    atomic_init(&s->max_lag, 0);
+    pthread_mutex_init(&s->done_lock, NULL);
+    pthread_cond_init(&s->done_cond, NULL);
+    s->resume_ts = AV_NOPTS_VALUE;
+    s->lag_origin = AV_NOPTS_VALUE;
+
+    s->in_filename = av_strdup(in_filename);
+    if (http_headers)
+        s->http_headers = av_strdup(http_headers);
+    s->cb = callback_ref_alloc(&s->opts);
+    s->read_latency = histogram_alloc();
+    s->write_latency = histogram_alloc();
+    if (s->opts.read_ahead > 0 && !s->opts.ingest) {
+        AVIOInterruptCB int_cb = { session_input_interrupt_cb, s };
+        s->read_ahead = read_ahead_alloc(s->opts.read_ahead, &int_cb);
+    }
+    if (s->opts.reorder_window > 0) {
+        s->reorder = av_mallocz_array(s->opts.reorder_window, sizeof(*s->reorder));
+        s->reorder_ts = av_mallocz_array(s->opts.reorder_window, sizeof(*s->reorder_ts));
+    }
+
+    if (!s->in_filename || (http_headers && !s->http_headers) || !s->cb ||
+        !s->read_latency || !s->write_latency ||
+        (s->opts.read_ahead > 0 && !s->opts.ingest && !s->read_ahead) ||
+        (s->opts.reorder_window > 0 && (!s->reorder || !s->reorder_ts)) ||
+        remux_session_add_output(s, out_filename, NULL) < 0) {
+        /* the caller keeps ownership of opaque on failure */
+        if (s->cb)
+            s->cb->release = NULL;
+        remux_session_free(&s);
+        return NULL;
+    }
+
+    return s;
+}
+
+int remux_session_add_output(RemuxSession *s, const char *url,
+                             const char *format_name)
+{
+    RemuxOutput *o;
+    int ret;
+
+    if (s->thread_started || s->nb_outputs >= REMUX_MAX_OUTPUTS)
+        return AVERROR(EINVAL);
+
+    o = output_alloc(s, url, format_name);
+    if (!o)
+        return AVERROR(ENOMEM);
+
+    ret = av_dynarray_add_nofree(&s->outputs, &s->nb_outputs, o);
+    if (ret < 0) {
+        output_free(&o);
+        return ret;
+    }
+
+    return 0;
+}
+
+static int cancel_register(RemuxCancel *c, RemuxSession *s)
+{
+    int ret;
+
+    pthread_mutex_lock(&c->lock);
+    ret = av_dynarray_add_nofree(&c->sessions, &c->nb_sessions, s);
+    pthread_mutex_unlock(&c->lock);
+
+    return ret;
+}
+
+static void cancel_unregister(RemuxCancel *c, RemuxSession *s)
+{
+    int i;
+
+    pthread_mutex_lock(&c->lock);
+    for (i = 0; i < c->nb_sessions; i++) {
+        if (c->sessions[i] == s) {
+            c->sessions[i] = c->sessions[--c->nb_sessions];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+int remux_session_start(RemuxSession *s)
+{
+    int ret;
+
+    const char *protocol;
+
+    if (s->thread_started)
+        return AVERROR(EINVAL);
+
+    if (s->opts.cancel && !s->cancel_registered) {
+        ret = cancel_register(s->opts.cancel, s);
+        if (ret < 0)
+            return ret;
+        s->cancel_registered = 1;
+    }
+
+    /* avformat_find_stream_info() would wait for data on a worker */
+    protocol = avio_find_protocol_name(s->in_filename);
+    if (s->opts.ingest && s->opts.fast_start &&
+        protocol && av_match_name(protocol, "http,https")) {
+        ret = session_ingest_start(s);
+        if (ret < 0)
+            return ret;
+    } else {
+        ret = pthread_create(&s->thread, NULL, session_thread, s);
+        if (ret)
+            return AVERROR(ret);
+    }
+
+    s->thread_started = 1;
+    return 0;
+}
+
+int remux_session_add_stage(RemuxSession *s, RemuxStagePosition position,
+                            const PacketStage *stage)
+{
+    int ret, i;
+
+    if (s->thread_started)
+        return AVERROR(EINVAL);
+
+    if (!s->pipeline) {
+        PacketStage repair = {
+            .name    = "timestamp repair",
+            .process = session_repair_stage,
+            .opaque  = s,
+        };
+
+        for (i = 0; i < PACKET_BATCH_SIZE; i++) {
+            s->batch[i] = av_packet_alloc();
+            if (!s->batch[i])
+                return AVERROR(ENOMEM);
+        }
+
+        s->pipeline = packet_pipeline_alloc();
+        if (!s->pipeline)
+            return AVERROR(ENOMEM);
+        ret = packet_pipeline_insert(s->pipeline, -1, &repair);
+        if (ret < 0) {
+            packet_pipeline_free(&s->pipeline);
+            return ret;
+        }
+    }
+
+    if (position == REMUX_STAGE_INPUT) {
+        ret = packet_pipeline_insert(s->pipeline, s->nb_input_stages, stage);
+        if (ret >= 0)
+            s->nb_input_stages++;
+    } else {
+        ret = packet_pipeline_insert(s->pipeline, -1, stage);
+    }
+
+    return ret;
+}
+
+RemuxCancel *remux_cancel_alloc(void)
+{
+    RemuxCancel *c = av_mallocz(sizeof(*c));
+    if (!c)
+        return NULL;
+
+    atomic_init(&c->triggered, 0);
+    pthread_mutex_init(&c->lock, NULL);
+
+    return c;
+}
+
+void remux_cancel_free(RemuxCancel **pc)
+{
+    RemuxCancel *c = *pc;
+
+    if (!c)
+        return;
+
+    pthread_mutex_destroy(&c->lock);
+    av_freep(&c->sessions);
+    av_freep(pc);
+}
+
+void remux_cancel_trigger(RemuxCancel *c, int64_t deadline)
+{
+    int i;
+
+    pthread_mutex_lock(&c->lock);
+    atomic_store(&c->triggered, 1);
+    for (i = 0; i < c->nb_sessions; i++) {
+        if (deadline)
+            remux_session_set_deadline(c->sessions[i], deadline);
+        remux_session_stop(c->sessions[i]);
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+int remux_cancel_triggered(const RemuxCancel *c)
+{
+    return atomic_load(&c->triggered);
+}
+
+void remux_session_set_deadline(RemuxSession *s, int64_t deadline)
+{
+    atomic_store(&s->cb->deadline, deadline);
+}
+
+void remux_session_stop(RemuxSession *s)
+{
+    atomic_store(&s->abort_request, 1);
+
+    /* wake up a blocked read and let a step see the request */
+    if (s->ingest) {
+        ingest_stream_abort(s->ingest);
+        session_ingest_wakeup(s);
+    }
+}
+
+int remux_session_join(RemuxSession *s)
+{
+    if (!s->thread_started)
+        return AVERROR(EINVAL);
+
+    if (s->ingest) {
+        pthread_mutex_lock(&s->done_lock);
+        while (!s->done)
+            pthread_cond_wait(&s->done_cond, &s->done_lock);
+        pthread_mutex_unlock(&s->done_lock);
+        s->thread_joined = 1;
+    } else if (!s->thread_joined) {
+        pthread_join(s->thread, NULL);
+        s->thread_joined = 1;
+    }
+
+    return s->ret;
+}
+
+RemuxState remux_session_state(const RemuxSession *s)
+{
+    return atomic_load(&s->state);
+}
+
+void remux_session_get_stats(const RemuxSession *s, RemuxStats *stats)
+{
+    int i;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->nb_outputs = s->nb_outputs;
+    stats->first_write_latency = atomic_load(&s->first_write_latency);
+    stats->nb_reconnects = atomic_load(&s->nb_reconnects);
+    stats->nb_stalls = atomic_load(&s->nb_stalls);
+    if (s->pipeline)
+        stats->nb_stages = packet_pipeline_get_stats(s->pipeline, stats->stages,
+                                                     REMUX_MAX_STAGES);
+    if (s->read_ahead) {
+        ReadAheadStats rs;
+
+        read_ahead_get_stats(s->read_ahead, &rs);
+        stats->read_ahead_size       = rs.size;
+        stats->read_ahead_high_water = rs.high_water;
+        stats->read_ahead_stalls     = rs.stalls;
+        stats->read_ahead_stall_time = rs.stall_time;
+        stats->read_ahead_max_stall  = rs.max_stall;
+    }
+
+    for (i = 0; i < s->nb_outputs; i++) {
+        const RemuxOutput *o = s->outputs[i];
+        RemuxOutputStats *os = &stats->outputs[i];
+
+        os->ring_depth      = packet_ring_depth(o->ring);
+        os->ring_count      = packet_ring_count(o->ring);
+        os->ring_high_water = packet_ring_high_water(o->ring);
+        os->ring_full_waits = packet_ring_full_waits(o->ring);
+        os->dropped_packets = atomic_load(&o->dropped_packets);
+        os->nb_segments     = atomic_load(&o->nb_segments);
+        if (o->spill) {
+            SpillQueueStats ss;
+
+            spill_queue_get_stats(o->spill, &ss);
+            os->spilled_bytes    = ss.bytes;
+            os->spilled_packets  = ss.packets;
+            os->spill_high_water = ss.high_water;
+            os->spill_episodes   = ss.episodes;
+            os->degraded_time    = ss.degraded_time;
+        }
+    }
+}
+
+void remux_session_get_metrics(const RemuxSession *s, RemuxMetrics *metrics)
+{
+    int i;
+
+    memset(metrics, 0, sizeof(*metrics));
+    metrics->nb_streams = atomic_load(&s->nb_streams);
+    for (i = 0; i < metrics->nb_streams; i++) {
+        const StreamCounters *sc = &s->streams[i];
+        RemuxStreamMetrics *sm = &metrics->streams[i];
+
+        sm->type        = atomic_load_explicit(&sc->type, memory_order_relaxed);
+        sm->packets_in  = atomic_load_explicit(&sc->packets_in, memory_order_relaxed);
+        sm->bytes_in    = atomic_load_explicit(&sc->bytes_in, memory_order_relaxed);
+        sm->packets_out = atomic_load_explicit(&sc->packets_out, memory_order_relaxed);
+        sm->bytes_out   = atomic_load_explicit(&sc->bytes_out, memory_order_relaxed);
+    }
+
+    histogram_read(s->read_latency, &metrics->read_latency);
+    histogram_read(s->write_latency, &metrics->write_latency);
+    metrics->dts_jumps     = atomic_load_explicit(&s->dts_jumps, memory_order_relaxed);
+    metrics->dts_backwards = atomic_load_explicit(&s->dts_backwards, memory_order_relaxed);
+    metrics->dts_resumes   = atomic_load_explicit(&s->dts_resumes, memory_order_relaxed);
+    metrics->last_packet_time = atomic_load_explicit(&s->last_read_time,
+                                                     memory_order_relaxed);
+    metrics->lag           = atomic_load_explicit(&s->lag, memory_order_relaxed);
+    metrics->max_lag       = atomic_load_explicit(&s->max_lag, memory_order_relaxed);
+
+    for (i = 0; i < s->nb_outputs; i++)
+        metrics->queue_depth = FFMAX(metrics->queue_depth,
+                                     packet_ring_count(s->outputs[i]->ring));
+}
+
+void remux_session_free(RemuxSession **ps)
+{
+    RemuxSession *s = *ps;
+    int i;
+
+    if (!s)
+        return;
+
+    if (s->thread_started && !s->thread_joined) {
+        remux_session_stop(s);
+        remux_session_join(s);
+    }
+    if (s->cancel_registered)
+        cancel_unregister(s->opts.cancel, s);
+
+    /* no step is queued once the session is done, but a refresh may run */
+    if (s->refresh_started)
+        pthread_join(s->refresh_thread, NULL);
+    ingest_stream_close(&s->ingest);
+    pthread_cond_destroy(&s->done_cond);
+    pthread_mutex_destroy(&s->done_lock);
+
+    for (i = 0; i < s->nb_outputs; i++)
+        output_free(&s->outputs[i]);
+    av_freep(&s->outputs);
+    av_freep(&s->in_filename);
+    av_freep(&s->http_headers);
+    callback_unref(&s->cb);
+    read_ahead_free(&s->read_ahead);
+    histogram_free(&s->read_latency);
+    histogram_free(&s->write_latency);
+    while (s->nb_reorder)
+        av_packet_unref(&s->reorder[--s->nb_reorder]);
+    av_freep(&s->reorder);
+    packet_pipeline_free(&s->pipeline);
+    for (i = 0; i < PACKET_BATCH_SIZE; i++)
+        av_packet_free(&s->batch[i]);
+    av_freep(&s->reorder_ts);
+    av_freep(ps);
+}
+
+int remux(const char *in_filename, const char *out_filename, const char *http_headers)
+{
+    RemuxSession *s;
+    int ret;
+
+    s = remux_session_create(in_filename, out_filename, http_headers, NULL);
+    if (!s)
+        return AVERROR(ENOMEM);
+
+    (void)signal(SIGUSR1, handle_stop);
+
+    /* legacy entry point: run on the calling thread */
+    ret = session_run(s);
+    remux_session_free(&s);
+
+    return ret;
+}
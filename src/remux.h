@@ -32,13 +32,307 @@
 extern "C" {
 #endif
 
+#include <stdint.h>
+
 #include <libavutil/rational.h>
 
+#include "file_writer.h"
+#include "histogram.h"
+#include "ingest.h"
+#include "packet_pipeline.h"
+
 /**
  * Rational number '1'
  */
 #define ONE_Q (AVRational){1, 1}
 
+/**
+ * Default capacity of the packet ring between reader and writer.
+ */
+#define REMUX_DEFAULT_RING_DEPTH 512
+
+/**
+ * Default size limit of the scratch file of each output, in bytes.
+ */
+#define REMUX_DEFAULT_SPILL_SIZE (1024LL * 1024 * 1024)
+
+typedef struct RemuxCancel RemuxCancel;
+
+/**
+ * Tunables of a remux session.
+ * Initialize with remux_options_default() before changing any field.
+ */
+typedef struct RemuxOptions {
+    /**
+     * Number of packets the reader may queue ahead of each writer.
+     * A slow disk only stalls the network read once the ring is full.
+     */
+    int ring_depth;
+
+    /**
+     * Directory on local storage where packets that do not fit in the
+     * ring of a stalled output spill to, so that the reader neither waits
+     * for the output nor drops packets. They go back to the writer in
+     * order once it catches up. NULL disables spilling. Read when the
+     * outputs are added.
+     */
+    const char *spill_dir;
+
+    /**
+     * Size limit of the scratch file of each output, in bytes. Past it, a
+     * stalled output is handled as without spill_dir until its scratch
+     * file is drained.
+     */
+    int64_t spill_size;
+
+    /**
+     * Write FLV input with av_write_frame() instead of
+     * av_interleaved_write_frame(). The stream is interleaved already, so
+     * the session only sorts packets by DTS within a window of this many
+     * packets, instead of the muxer buffering every stream until each
+     * other stream has a later packet, which grows without bound when the
+     * timestamps of a stream jump. 0 keeps the interleaving of the muxer,
+     * which other input formats always use.
+     */
+    int reorder_window;
+
+    /**
+     * Write fragmented MP4 with fragments of at least this duration,
+     * in microseconds, cut on video keyframes. 0 writes a regular MP4
+     * whose index stays in memory until the end of the recording.
+     */
+    int64_t frag_duration;
+
+    /**
+     * Start a new output file on the next video keyframe once the current
+     * one covers this duration, in microseconds. 0 disables the limit.
+     */
+    int64_t segment_duration;
+
+    /**
+     * Start a new output file on the next video keyframe once the current
+     * one reaches this size, in bytes. 0 disables the limit.
+     *
+     * With either segment limit set, the output URL is a strftime(3)
+     * pattern expanded when each segment is opened.
+     */
+    int64_t segment_size;
+
+    /**
+     * Skip avformat_find_stream_info() on FLV input and take the codec
+     * parameters from the AVC/HEVC and AAC sequence headers instead, so
+     * writing starts on the first keyframe. Other formats are probed as
+     * usual.
+     */
+    int fast_start;
+
+    /**
+     * Reopen the input up to this many times in a row when it is lost,
+     * writing on to the same files. New files are only started if the
+     * codec parameters of the reopened input differ. 0 ends the session
+     * when the input is lost.
+     */
+    int max_reconnects;
+
+    /**
+     * Called from the session thread before reopening the input.
+     * url holds the current input URL and may be replaced by a fresh one,
+     * NUL-terminated and at most size bytes long.
+     *
+     * @return 0 to reconnect, a negative value to end the session
+     */
+    int (*reconnect_url)(void *opaque, char *url, int size);
+
+    /**
+     * Treat the input as lost once no packet has arrived for this long, in
+     * microseconds, rather than waiting for the socket timeout. When the
+     * stream is usually delivered in bursts, the limit is raised to a few
+     * times the usual gap between packets, up to the socket timeout.
+     * 0 disables the watchdog. With ingest, the gaps are checked by the
+     * event loop receiving the stream.
+     */
+    int64_t stall_timeout;
+
+    /**
+     * Cancellation token shared with other sessions, see
+     * remux_cancel_trigger(). Must outlive the session. NULL by default.
+     */
+    RemuxCancel *cancel;
+
+    /**
+     * Hand closed files to a background finalizer that writes their
+     * trailers, so that neither segment rotation nor the end of the
+     * session waits for a large MP4 index to be written.
+     * See remux_finalizer_drain().
+     */
+    int async_finalize;
+
+    /**
+     * Write local output files through a large aligned buffer with
+     * preallocation and the given sync policy. Disabled by default.
+     */
+    FileWriterOptions writer;
+
+    /**
+     * Receive HTTP input through this engine instead of FFmpeg's http
+     * protocol. The session then has no thread of its own: its reading
+     * runs on the workers of the engine whenever complete tags are
+     * buffered. Other inputs, and sessions without fast_start, whose
+     * probing would wait for data on a worker, ignore it. NULL by default.
+     */
+    IngestEngine *ingest;
+
+    /**
+     * Read HTTP input with libcurl instead of FFmpeg's http protocol:
+     * HTTP/2, and DNS cache, TLS sessions and connections shared by every
+     * session of the process, so that reconnects skip the handshake.
+     * The http protocol reconnected by itself; with this set, a lost
+     * input only comes back through max_reconnects.
+     */
+    int curl_input;
+
+    /**
+     * Read the input on a thread of its own into a memory ring of this
+     * many bytes, ahead of the demuxer, so that short network stalls are
+     * absorbed by the buffered data. 0 disables it. Not used with ingest,
+     * which buffers by itself.
+     */
+    int read_ahead;
+
+    /**
+     * Called after each output file is closed, from the writer thread or
+     * from the finalizer with async_finalize. Suits post-processing.
+     */
+    void (*output_closed)(void *opaque, const char *filename);
+
+    /**
+     * Called after each startup phase: "avformat_open_input", which also
+     * covers connecting with custom I/O, "avformat_find_stream_info" or
+     * "fast_start_probe", then "avformat_write_header" for each output
+     * file, and last "first_packet_write" for the first packet muxed by
+     * any output. start and end are from av_gettime_relative(). Called
+     * from the session thread, or a writer thread for later segments and
+     * the first packet, whether the phase succeeded or not. NULL by
+     * default.
+     */
+    void (*phase_done)(void *opaque, const char *phase, int64_t start, int64_t end);
+
+    /**
+     * Called once the session and all of its files are done with opaque.
+     * With async_finalize, this may happen after remux_session_free().
+     * Not called if remux_session_create() fails.
+     */
+    void (*release)(void *opaque);
+
+    /**
+     * User data passed to the callbacks.
+     */
+    void *opaque;
+} RemuxOptions;
+
+/**
+ * Maximum number of outputs of a session.
+ */
+#define REMUX_MAX_OUTPUTS 8
+
+/**
+ * Runtime counters of one output.
+ */
+typedef struct RemuxOutputStats {
+    int ring_depth;             ///< capacity of the packet ring
+    int ring_count;             ///< packets currently queued
+    int ring_high_water;        ///< highest number of packets queued at once
+    int64_t ring_full_waits;    ///< times the reader waited for the writer
+    int64_t dropped_packets;    ///< packets lost while the output was stalled
+    int64_t spilled_bytes;      ///< bytes written to the scratch file
+    int64_t spilled_packets;    ///< packets written to the scratch file
+    int64_t spill_high_water;   ///< largest size of the scratch file
+    int64_t spill_episodes;     ///< times the output started spilling
+    int64_t degraded_time;      ///< microseconds with packets spilled
+    int nb_segments;            ///< files opened so far
+} RemuxOutputStats;
+
+/**
+ * Maximum number of pipeline stages reported in RemuxStats.
+ */
+#define REMUX_MAX_STAGES 8
+
+/**
+ * Runtime counters of a session.
+ */
+typedef struct RemuxStats {
+    int64_t first_write_latency;    ///< microseconds from connecting to the first
+                                    ///< packet muxed, 0 until then
+    int nb_reconnects;              ///< times the input was reopened
+    int nb_stalls;                  ///< times the watchdog found the input stalled
+    int read_ahead_size;            ///< capacity of the read-ahead ring, 0 if unused
+    int read_ahead_high_water;      ///< most bytes read ahead at once
+    int64_t read_ahead_stalls;      ///< times the demuxer found the ring empty
+    int64_t read_ahead_stall_time;  ///< microseconds the demuxer waited for data
+    int64_t read_ahead_max_stall;   ///< longest single wait, in microseconds
+    int nb_outputs;
+    RemuxOutputStats outputs[REMUX_MAX_OUTPUTS];
+    int nb_stages;                  ///< 0 unless stages were added
+    PacketStageStats stages[REMUX_MAX_STAGES];
+} RemuxStats;
+
+/**
+ * Maximum number of streams reported in RemuxMetrics.
+ */
+#define REMUX_MAX_STREAMS 4
+
+/**
+ * Traffic of one output stream, counted across reconnects.
+ */
+typedef struct RemuxStreamMetrics {
+    enum AVMediaType type;      ///< of the stream in the current input
+    int64_t packets_in;         ///< packets read for the stream
+    int64_t bytes_in;
+    int64_t packets_out;        ///< packets written, summed over the outputs
+    int64_t bytes_out;
+} RemuxStreamMetrics;
+
+/**
+ * Fine-grained counters of a session, cheap enough to keep up to date on
+ * every packet and meant to be pulled periodically by a monitoring agent.
+ * Durations are in microseconds.
+ */
+typedef struct RemuxMetrics {
+    int nb_streams;
+    RemuxStreamMetrics streams[REMUX_MAX_STREAMS];
+    HistogramSnapshot read_latency;     ///< of each packet read from the input
+    HistogramSnapshot write_latency;    ///< of each packet handed to a muxer
+    int64_t dts_jumps;          ///< DTS pulled back after jumping forward
+    int64_t dts_backwards;      ///< DTS pushed forward after not increasing
+    int64_t dts_resumes;        ///< DTS aligned on the previous input after a reconnect
+    int queue_depth;            ///< packets queued for the most loaded output
+    int64_t last_packet_time;   ///< av_gettime_relative() when the last packet
+                                ///< was read, 0 before the first
+    int64_t lag;                ///< how far the media time of the last packet
+                                ///< trails the wall clock, relative to the first
+    int64_t max_lag;            ///< highest lag so far
+} RemuxMetrics;
+
+/**
+ * Opaque handle of one remuxing job.
+ *
+ * A session owns its input and output contexts and its cancellation flag,
+ * so any number of sessions can run concurrently in one process.
+ */
+typedef struct RemuxSession RemuxSession;
+
+/**
+ * Lifecycle of a remux session.
+ */
+typedef enum RemuxState {
+    REMUX_STATE_IDLE,       ///< created, not started yet
+    REMUX_STATE_OPENING,    ///< opening input and writing output header
+    REMUX_STATE_RUNNING,    ///< copying packets
+    REMUX_STATE_STOPPED,    ///< ended by remux_session_stop(), a RemuxCancel or SIGUSR1
+    REMUX_STATE_FINISHED,   ///< input reached its end
+    REMUX_STATE_FAILED,     ///< ended by an error
+} RemuxState;
+
 /**
  * Remux a media from in_filename to out_filename.
  * @param in_filename URL of input file
@@ -48,6 +342,168 @@ extern "C" {
  */
 int remux(const char *in_filename, const char *out_filename, const char *http_headers);
 
+/**
+ * Fill opts with the default settings.
+ */
+void remux_options_default(RemuxOptions *opts);
+
+/**
+ * Allocate a session remuxing in_filename to out_filename.
+ * The arguments are copied, the caller keeps ownership of them.
+ * @param in_filename URL of input file
+ * @param out_filename URL of output file
+ * @param http_headers extra HTTP headers for the input, may be NULL
+ * @param opts session settings, NULL for the defaults
+ *
+ * @return the new session, or NULL on allocation failure
+ */
+RemuxSession *remux_session_create(const char *in_filename,
+                                   const char *out_filename,
+                                   const char *http_headers,
+                                   const RemuxOptions *opts);
+
+/**
+ * Write the same packets to one more output. Every packet is read once
+ * and queued to each output, which has its own writer thread and time
+ * base. When several outputs are set, one that cannot keep up loses
+ * packets up to the next keyframe rather than slowing the others down.
+ * Must be called before remux_session_start().
+ * @param url URL of the output, a strftime(3) pattern when segmenting
+ * @param format_name muxer name, NULL to guess it from the URL
+ *
+ * @return 0 on success, a negative AVERROR code otherwise
+ */
+int remux_session_add_output(RemuxSession *s, const char *url,
+                             const char *format_name);
+
+/**
+ * Where a stage added to a session sees the packets.
+ */
+typedef enum RemuxStagePosition {
+    REMUX_STAGE_INPUT,      ///< before timestamp repair, with input timestamps
+    REMUX_STAGE_OUTPUT,     ///< after timestamp repair, as written
+} RemuxStagePosition;
+
+/**
+ * Add a stage to the packet pipeline of the session, after the stages
+ * already added at the same position. Packets are mapped to the output
+ * streams before the first stage. Without any stage, packets skip the
+ * pipeline. Must be called before remux_session_start().
+ *
+ * @return 0 on success, in which case the session owns stage->opaque,
+ *         a negative AVERROR code otherwise
+ */
+int remux_session_add_stage(RemuxSession *s, RemuxStagePosition position,
+                            const PacketStage *stage);
+
+/**
+ * Run the session on its own thread, or on the workers of opts.ingest.
+ * A session can be started only once.
+ *
+ * @return 0 on success, a negative AVERROR code otherwise
+ */
+int remux_session_start(RemuxSession *s);
+
+/**
+ * Ask a running session to stop. A blocked read of the input is
+ * interrupted and the output is finalized normally.
+ * Returns immediately, use remux_session_join() to wait for the end.
+ */
+void remux_session_stop(RemuxSession *s);
+
+/**
+ * Interrupt the output I/O of the session, including trailers still
+ * written by the finalizer, once av_gettime_relative() reaches deadline.
+ * Writers drop the packets they have not written by then. Local files
+ * are only cut short between packets. 0 removes the deadline.
+ */
+void remux_session_set_deadline(RemuxSession *s, int64_t deadline);
+
+/**
+ * Allocate a cancellation token, to stop many sessions at once.
+ *
+ * @return the new token, or NULL on failure
+ */
+RemuxCancel *remux_cancel_alloc(void);
+
+/**
+ * Free a token no session uses anymore and set *c to NULL.
+ */
+void remux_cancel_free(RemuxCancel **c);
+
+/**
+ * Stop every session started with the token, as remux_session_stop()
+ * does, and give each the deadline if it is not 0. Sessions started later
+ * stop right away. Safe to call from any thread, but not from a signal
+ * handler.
+ */
+void remux_cancel_trigger(RemuxCancel *c, int64_t deadline);
+
+/**
+ * @return whether the token was triggered
+ */
+int remux_cancel_triggered(const RemuxCancel *c);
+
+/**
+ * Wait for a started session to end.
+ *
+ * @return 0 if no error occurs, AVERROR_EXIT if the session was stopped,
+ *         otherwise a negative AVERROR code
+ */
+int remux_session_join(RemuxSession *s);
+
+/**
+ * @return the current state of the session
+ */
+RemuxState remux_session_state(const RemuxSession *s);
+
+/**
+ * Read the counters of a session. Safe to call from any thread.
+ */
+void remux_session_get_stats(const RemuxSession *s, RemuxStats *stats);
+
+/**
+ * Read the metrics of a session. Safe to call from any thread, each
+ * counter is read on its own without stopping the session.
+ */
+void remux_session_get_metrics(const RemuxSession *s, RemuxMetrics *metrics);
+
+/**
+ * Stop and join the session if needed, then free it and set *s to NULL.
+ */
+void remux_session_free(RemuxSession **s);
+
+/**
+ * @return number of files queued or being finalized in the background
+ */
+int remux_finalizer_pending(void);
+
+/**
+ * Wait until every file handed to the finalizer has been finalized.
+ * Call before exiting when sessions use async_finalize.
+ */
+void remux_finalizer_drain(void);
+
+/**
+ * Set how many trailers the finalizer writes at once, e.g. the number of
+ * concurrent sessions so that a shutdown finalizes all their files in
+ * parallel. Only effective before the finalizer is first used.
+ */
+void remux_finalizer_configure(int nb_threads);
+
+/**
+ * Wait until every output file of the process, written by a session or
+ * waiting for its trailer, has been finalized, or until
+ * av_gettime_relative() reaches deadline. Suits a shutdown after
+ * remux_cancel_trigger() with the same deadline.
+ * @param unfinished called for each file left at the deadline, may be NULL
+ *
+ * @return number of files left
+ */
+int remux_finalizer_drain_until(int64_t deadline,
+                                void (*unfinished)(void *opaque, const char *filename),
+                                void *opaque);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,358 @@
+/**
+ * @file
+ * Implementation of the spill queue.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libavutil/avstring.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include <libavutil/time.h>
+
+#include "spill_queue.h"
+
+/**
+ * Fixed part of a spilled packet, followed by length bytes: the payload,
+ * then each side data as a SpillSideData and its bytes.
+ */
+typedef struct SpillRecord {
+    int64_t pts;
+    int64_t dts;
+    int64_t duration;
+    int32_t stream_index;
+    int32_t flags;
+    int32_t size;
+    int32_t nb_side_data;
+    int32_t length;
+    int32_t reserved;
+} SpillRecord;
+
+typedef struct SpillSideData {
+    int32_t type;
+    int32_t size;
+} SpillSideData;
+
+struct SpillQueue {
+    char *dir;
+    int64_t max_size;
+    int fd;                     ///< -1 until a packet spills
+
+    int64_t read_pos;           ///< oldest spilled packet
+    int64_t write_pos;          ///< end of the file
+    int64_t nb_packets;         ///< packets between read_pos and write_pos
+
+    AVPacket staged;            ///< read back, waiting for a free slot
+    int has_staged;
+
+    uint8_t *buf;
+    unsigned int buf_size;
+
+    pthread_mutex_t lock;
+    int64_t degraded_start;     ///< guarded by lock, 0 while nothing is spilled
+    SpillQueueStats stats;      ///< guarded by lock
+};
+
+static int spill_open(SpillQueue *sq)
+{
+    char *path = av_asprintf("%s/remux-spill-XXXXXX", sq->dir);
+    int ret = 0;
+
+    if (!path)
+        return AVERROR(ENOMEM);
+
+    sq->fd = mkstemp(path);
+    if (sq->fd < 0)
+        ret = AVERROR(errno);
+    else
+        unlink(path);
+
+    if (ret < 0)
+        fprintf(stderr, "Could not create spill file in '%s': %s\n",
+                sq->dir, av_err2str(ret));
+    av_free(path);
+    return ret;
+}
+
+static int spill_pwrite(int fd, const uint8_t *buf, size_t size, int64_t pos)
+{
+    size_t done = 0;
+
+    while (done < size) {
+        ssize_t n = pwrite(fd, buf + done, size - done, pos + done);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return AVERROR(errno);
+        }
+        done += n;
+    }
+
+    return 0;
+}
+
+static int spill_pread(int fd, uint8_t *buf, size_t size, int64_t pos)
+{
+    size_t done = 0;
+
+    while (done < size) {
+        ssize_t n = pread(fd, buf + done, size - done, pos + done);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return AVERROR(errno);
+        }
+        if (n == 0)
+            return AVERROR(EIO);
+        done += n;
+    }
+
+    return 0;
+}
+
+/* Give the space back once everything spilled has been read. */
+static void spill_reset(SpillQueue *sq)
+{
+    sq->read_pos = 0;
+    sq->write_pos = 0;
+    sq->nb_packets = 0;
+    if (sq->fd >= 0 && ftruncate(sq->fd, 0) < 0)
+        fprintf(stderr, "Could not truncate spill file: %s\n",
+                av_err2str(AVERROR(errno)));
+}
+
+static void spill_caught_up(SpillQueue *sq)
+{
+    pthread_mutex_lock(&sq->lock);
+    if (sq->degraded_start) {
+        sq->stats.degraded_time += av_gettime_relative() - sq->degraded_start;
+        sq->degraded_start = 0;
+    }
+    pthread_mutex_unlock(&sq->lock);
+}
+
+SpillQueue *spill_queue_alloc(const char *dir, int64_t max_size)
+{
+    SpillQueue *sq = av_mallocz(sizeof(*sq));
+    if (!sq)
+        return NULL;
+
+    sq->dir = av_strdup(dir);
+    if (!sq->dir) {
+        av_free(sq);
+        return NULL;
+    }
+    sq->max_size = max_size;
+    sq->fd = -1;
+    av_init_packet(&sq->staged);
+
+    pthread_mutex_init(&sq->lock, NULL);
+
+    return sq;
+}
+
+void spill_queue_free(SpillQueue **psq)
+{
+    SpillQueue *sq = *psq;
+
+    if (!sq)
+        return;
+
+    if (sq->fd >= 0)
+        close(sq->fd);
+    av_packet_unref(&sq->staged);
+    pthread_mutex_destroy(&sq->lock);
+    av_freep(&sq->buf);
+    av_freep(&sq->dir);
+    av_freep(psq);
+}
+
+int spill_queue_push(SpillQueue *sq, AVPacket *pkt)
+{
+    SpillRecord rec = { 0 };
+    int64_t length = pkt->size;
+    uint8_t *p;
+    int ret, i;
+
+    for (i = 0; i < pkt->side_data_elems; i++)
+        length += sizeof(SpillSideData) + pkt->side_data[i].size;
+    if (length > INT_MAX - (int64_t)sizeof(rec))
+        return AVERROR(EINVAL);
+    if (sq->write_pos + (int64_t)sizeof(rec) + length > sq->max_size)
+        return AVERROR(ENOSPC);
+
+    if (sq->fd < 0) {
+        ret = spill_open(sq);
+        if (ret < 0)
+            return ret;
+    }
+
+    av_fast_malloc(&sq->buf, &sq->buf_size, sizeof(rec) + length);
+    if (!sq->buf)
+        return AVERROR(ENOMEM);
+
+    rec.pts          = pkt->pts;
+    rec.dts          = pkt->dts;
+    rec.duration     = pkt->duration;
+    rec.stream_index = pkt->stream_index;
+    rec.flags        = pkt->flags;
+    rec.size         = pkt->size;
+    rec.nb_side_data = pkt->side_data_elems;
+    rec.length       = length;
+
+    p = sq->buf;
+    memcpy(p, &rec, sizeof(rec));
+    p += sizeof(rec);
+    if (pkt->size)
+        memcpy(p, pkt->data, pkt->size);
+    p += pkt->size;
+    for (i = 0; i < pkt->side_data_elems; i++) {
+        SpillSideData sd = { pkt->side_data[i].type, pkt->side_data[i].size };
+
+        memcpy(p, &sd, sizeof(sd));
+        p += sizeof(sd);
+        memcpy(p, pkt->side_data[i].data, sd.size);
+        p += sd.size;
+    }
+
+    ret = spill_pwrite(sq->fd, sq->buf, sizeof(rec) + length, sq->write_pos);
+    if (ret < 0)
+        return ret;
+
+    sq->write_pos += sizeof(rec) + length;
+    sq->nb_packets++;
+
+    pthread_mutex_lock(&sq->lock);
+    sq->stats.bytes += sizeof(rec) + length;
+    sq->stats.packets++;
+    if (sq->write_pos > sq->stats.high_water)
+        sq->stats.high_water = sq->write_pos;
+    if (!sq->degraded_start) {
+        sq->degraded_start = av_gettime_relative();
+        sq->stats.episodes++;
+    }
+    pthread_mutex_unlock(&sq->lock);
+
+    av_packet_unref(pkt);
+    return 0;
+}
+
+/* Read the oldest spilled packet into pkt. */
+static int spill_read(SpillQueue *sq, AVPacket *pkt)
+{
+    SpillRecord rec;
+    const uint8_t *p, *end;
+    int ret, i;
+
+    ret = spill_pread(sq->fd, (uint8_t *)&rec, sizeof(rec), sq->read_pos);
+    if (ret < 0)
+        return ret;
+    if (rec.length < 0 || rec.size < 0 || rec.size > rec.length)
+        return AVERROR_INVALIDDATA;
+
+    av_fast_malloc(&sq->buf, &sq->buf_size, rec.length);
+    if (!sq->buf && rec.length)
+        return AVERROR(ENOMEM);
+    ret = spill_pread(sq->fd, sq->buf, rec.length, sq->read_pos + sizeof(rec));
+    if (ret < 0)
+        return ret;
+
+    ret = av_new_packet(pkt, rec.size);
+    if (ret < 0)
+        return ret;
+    p = sq->buf;
+    end = p + rec.length;
+    if (rec.size)
+        memcpy(pkt->data, p, rec.size);
+    p += rec.size;
+
+    for (i = 0; i < rec.nb_side_data; i++) {
+        SpillSideData sd;
+        uint8_t *dst;
+
+        if (end - p < (ptrdiff_t)sizeof(sd)) {
+            av_packet_unref(pkt);
+            return AVERROR_INVALIDDATA;
+        }
+        memcpy(&sd, p, sizeof(sd));
+        p += sizeof(sd);
+        if (sd.size < 0 || sd.size > end - p) {
+            av_packet_unref(pkt);
+            return AVERROR_INVALIDDATA;
+        }
+        dst = av_packet_new_side_data(pkt, sd.type, sd.size);
+        if (!dst) {
+            av_packet_unref(pkt);
+            return AVERROR(ENOMEM);
+        }
+        memcpy(dst, p, sd.size);
+        p += sd.size;
+    }
+
+    pkt->pts          = rec.pts;
+    pkt->dts          = rec.dts;
+    pkt->duration     = rec.duration;
+    pkt->stream_index = rec.stream_index;
+    pkt->flags        = rec.flags;
+
+    sq->read_pos += sizeof(rec) + rec.length;
+    sq->nb_packets--;
+    if (!sq->nb_packets)
+        spill_reset(sq);
+
+    return 0;
+}
+
+int spill_queue_drain(SpillQueue *sq, PacketRing *ring, int wait)
+{
+    int ret;
+
+    if (!spill_queue_pending(sq))
+        return 0;
+
+    for (;;) {
+        if (!sq->has_staged) {
+            if (!sq->nb_packets)
+                break;
+            ret = spill_read(sq, &sq->staged);
+            if (ret < 0) {
+                spill_reset(sq);
+                spill_caught_up(sq);
+                return ret;
+            }
+            sq->has_staged = 1;
+        }
+
+        ret = wait ? packet_ring_push(ring, &sq->staged) :
+                     packet_ring_try_push(ring, &sq->staged);
+        if (ret == AVERROR(EAGAIN))
+            return 0;
+        if (ret < 0)
+            return ret;
+        sq->has_staged = 0;
+    }
+
+    spill_caught_up(sq);
+    return 0;
+}
+
+int64_t spill_queue_pending(const SpillQueue *sq)
+{
+    return sq->nb_packets + sq->has_staged;
+}
+
+void spill_queue_get_stats(SpillQueue *sq, SpillQueueStats *stats)
+{
+    pthread_mutex_lock(&sq->lock);
+    *stats = sq->stats;
+    if (sq->degraded_start)
+        stats->degraded_time += av_gettime_relative() - sq->degraded_start;
+    pthread_mutex_unlock(&sq->lock);
+}
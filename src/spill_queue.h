@@ -0,0 +1,87 @@
+/**
+ * @file
+ * Overflow of a packet ring into a scratch file.
+ *
+ * When the writer of an output stalls, packets that do not fit in its ring
+ * are appended to a file on local storage instead of stalling the reader,
+ * and moved back into the ring in their order as the writer catches up.
+ * The file is unlinked as soon as it is created and is emptied each time
+ * every spilled packet is back in the ring.
+ *
+ * Producer side of the ring only, except spill_queue_get_stats().
+ */
+
+#ifndef SPILL_QUEUE_H
+#define SPILL_QUEUE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include <libavcodec/avcodec.h>
+
+#include "packet_ring.h"
+
+typedef struct SpillQueue SpillQueue;
+
+/**
+ * Counters of a spill queue.
+ */
+typedef struct SpillQueueStats {
+    int64_t bytes;          ///< bytes written to the scratch file
+    int64_t packets;        ///< packets written to the scratch file
+    int64_t high_water;     ///< largest size reached by the scratch file
+    int64_t episodes;       ///< times spilling started
+    int64_t degraded_time;  ///< microseconds with packets spilled
+} SpillQueueStats;
+
+/**
+ * Allocate a queue spilling to a file of at most max_size bytes in dir.
+ * The file is only created once a packet spills.
+ *
+ * @return the new queue, or NULL on failure
+ */
+SpillQueue *spill_queue_alloc(const char *dir, int64_t max_size);
+
+/**
+ * Free the queue, dropping every packet still spilled, and set *sq to
+ * NULL.
+ */
+void spill_queue_free(SpillQueue **sq);
+
+/**
+ * Append pkt to the scratch file. pkt is blank on success and left as it
+ * was on failure.
+ *
+ * @return 0 on success, AVERROR(ENOSPC) if the file would grow beyond its
+ *         maximum size, another negative AVERROR code on failure
+ */
+int spill_queue_push(SpillQueue *sq, AVPacket *pkt);
+
+/**
+ * Move spilled packets into ring, oldest first, until none is left or,
+ * unless wait is set, until the ring is full.
+ *
+ * @return 0 on success, AVERROR_EXIT if the ring was aborted, another
+ *         negative AVERROR code if the scratch file could not be read, in
+ *         which case the remaining spilled packets are lost
+ */
+int spill_queue_drain(SpillQueue *sq, PacketRing *ring, int wait);
+
+/**
+ * @return number of packets spilled and not yet back in a ring
+ */
+int64_t spill_queue_pending(const SpillQueue *sq);
+
+/**
+ * Read the counters of the queue. Safe to call from any thread.
+ */
+void spill_queue_get_stats(SpillQueue *sq, SpillQueueStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,219 @@
+/**
+ * @file
+ * Implementation of the shared memory stats segment.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "stats_shm.h"
+
+/**
+ * Attempts of stats_shm_read() before giving up on a slot.
+ */
+#define STATS_SHM_READ_RETRIES 1000
+
+typedef struct StatsShmHeader {
+    uint32_t magic;             ///< set last, once the segment is ready
+    uint32_t version;
+    uint32_t room_size;         ///< sizeof(StatsShmRoom) of the writer
+    uint32_t nb_rooms;
+    int32_t  pid;
+} StatsShmHeader;
+
+/**
+ * A slot on a cache line of its own. seq is odd while the writer changes
+ * state, and increases by 2 with each publication.
+ */
+typedef struct StatsShmRoom {
+    _Alignas(64) atomic_uint seq;
+    StatsShmRoomState state;
+} StatsShmRoom;
+
+typedef struct StatsShmSegment {
+    StatsShmHeader header;
+    StatsShmRoom rooms[];
+} StatsShmSegment;
+
+struct StatsShm {
+    StatsShmSegment *seg;
+    size_t size;
+    char *name;                 ///< to unlink, NULL for readers
+};
+
+static size_t segment_size(int nb_rooms)
+{
+    return sizeof(StatsShmSegment) + (size_t)nb_rooms * sizeof(StatsShmRoom);
+}
+
+StatsShm *stats_shm_create(const char *name, int nb_rooms)
+{
+    StatsShm *shm;
+    void *addr;
+    int fd, i;
+
+    if (nb_rooms <= 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    shm = calloc(1, sizeof(*shm));
+    if (!shm)
+        return NULL;
+    shm->size = segment_size(nb_rooms);
+    shm->name = strdup(name);
+    if (!shm->name)
+        goto fail;
+
+    fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        goto fail;
+    if (ftruncate(fd, shm->size) < 0) {
+        int err = errno;
+
+        close(fd);
+        shm_unlink(name);
+        errno = err;
+        goto fail;
+    }
+    addr = mmap(NULL, shm->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        int err = errno;
+
+        shm_unlink(name);
+        errno = err;
+        goto fail;
+    }
+    shm->seg = addr;
+
+    /* the pages are zeroed by ftruncate() */
+    for (i = 0; i < nb_rooms; i++)
+        atomic_init(&shm->seg->rooms[i].seq, 0);
+    shm->seg->header.version = STATS_SHM_VERSION;
+    shm->seg->header.room_size = sizeof(StatsShmRoom);
+    shm->seg->header.nb_rooms = nb_rooms;
+    shm->seg->header.pid = getpid();
+    atomic_thread_fence(memory_order_release);
+    shm->seg->header.magic = STATS_SHM_MAGIC;
+
+    return shm;
+
+fail:
+    free(shm->name);
+    free(shm);
+    return NULL;
+}
+
+StatsShm *stats_shm_open(const char *name)
+{
+    const StatsShmHeader *header;
+    StatsShm *shm;
+    struct stat st;
+    void *addr;
+    int fd, err;
+
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0) {
+        err = errno;
+        close(fd);
+        errno = err;
+        return NULL;
+    }
+    if (st.st_size < (off_t)sizeof(StatsShmSegment)) {
+        close(fd);
+        errno = EPROTO;
+        return NULL;
+    }
+    addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+        return NULL;
+
+    header = addr;
+    if (header->magic != STATS_SHM_MAGIC || header->version != STATS_SHM_VERSION ||
+        header->room_size != sizeof(StatsShmRoom) ||
+        segment_size(header->nb_rooms) > (size_t)st.st_size) {
+        munmap(addr, st.st_size);
+        errno = EPROTO;
+        return NULL;
+    }
+    atomic_thread_fence(memory_order_acquire);
+
+    shm = calloc(1, sizeof(*shm));
+    if (!shm) {
+        munmap(addr, st.st_size);
+        errno = ENOMEM;
+        return NULL;
+    }
+    shm->seg = addr;
+    shm->size = st.st_size;
+
+    return shm;
+}
+
+void stats_shm_close(StatsShm **pshm)
+{
+    StatsShm *shm = *pshm;
+
+    if (!shm)
+        return;
+
+    munmap(shm->seg, shm->size);
+    if (shm->name)
+        shm_unlink(shm->name);
+    free(shm->name);
+    free(shm);
+    *pshm = NULL;
+}
+
+int stats_shm_nb_rooms(const StatsShm *shm)
+{
+    return shm->seg->header.nb_rooms;
+}
+
+int stats_shm_pid(const StatsShm *shm)
+{
+    return shm->seg->header.pid;
+}
+
+void stats_shm_publish(StatsShm *shm, int index, const StatsShmRoomState *state)
+{
+    StatsShmRoom *room = &shm->seg->rooms[index];
+    unsigned seq = atomic_load_explicit(&room->seq, memory_order_relaxed);
+
+    atomic_store_explicit(&room->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(&room->state, state, sizeof(*state));
+    atomic_store_explicit(&room->seq, seq + 2, memory_order_release);
+}
+
+int stats_shm_read(const StatsShm *shm, int index, StatsShmRoomState *state)
+{
+    StatsShmRoom *room = &shm->seg->rooms[index];
+    int i;
+
+    for (i = 0; i < STATS_SHM_READ_RETRIES; i++) {
+        unsigned seq = atomic_load_explicit(&room->seq, memory_order_acquire);
+
+        if (!(seq & 1)) {
+            /* may be torn, in which case seq has changed */
+            memcpy(state, &room->state, sizeof(*state));
+            atomic_thread_fence(memory_order_acquire);
+            if (atomic_load_explicit(&room->seq, memory_order_relaxed) == seq)
+                return 0;
+        }
+        sched_yield();
+    }
+
+    return -EAGAIN;
+}
@@ -0,0 +1,93 @@
+/**
+ * @file
+ * Live state of every room, published in a POSIX shared memory segment.
+ *
+ * The recorder rewrites the state of each room in place under a seqlock,
+ * and any number of monitors map the segment read-only and copy the rooms
+ * out without a system call and without ever blocking the recorder. Only
+ * plain C and POSIX are used, so that readers need no FFmpeg.
+ */
+
+#ifndef STATS_SHM_H
+#define STATS_SHM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#define STATS_SHM_MAGIC   0x53524d42    /* "BMRS" in little endian */
+#define STATS_SHM_VERSION 1
+
+/**
+ * Published state of one room. Times are Unix times in microseconds.
+ */
+typedef struct StatsShmRoomState {
+    uint32_t room_id;
+    int32_t  online;            ///< the room was live at its last check
+    int32_t  recording;         ///< a recording is running
+    int32_t  qn;                ///< quality of the stream recorded
+    char     codec[8];          ///< codec of the stream recorded, "" if none
+    int64_t  bitrate;           ///< input bits per second over the last period
+    int64_t  bytes_written;     ///< by the current recording
+    int64_t  last_packet_time;  ///< 0 until a packet was read
+    int32_t  nb_reconnects;     ///< by the current recording
+    int32_t  reserved;
+    int64_t  update_time;       ///< when the state was published
+} StatsShmRoomState;
+
+typedef struct StatsShm StatsShm;
+
+/**
+ * Create, or replace, the segment name (e.g. "/bili-live") with room
+ * slots nb_rooms, all zeroed, and map it for writing.
+ *
+ * @return the new segment, or NULL with errno set on failure
+ */
+StatsShm *stats_shm_create(const char *name, int nb_rooms);
+
+/**
+ * Map an existing segment read-only.
+ *
+ * @return the segment, or NULL with errno set on failure, to EPROTO if
+ *         the segment is not ready or of another version
+ */
+StatsShm *stats_shm_open(const char *name);
+
+/**
+ * Unmap the segment, remove it if it was created by stats_shm_create(),
+ * and set *shm to NULL.
+ */
+void stats_shm_close(StatsShm **shm);
+
+/**
+ * @return number of room slots
+ */
+int stats_shm_nb_rooms(const StatsShm *shm);
+
+/**
+ * @return process ID of the writer
+ */
+int stats_shm_pid(const StatsShm *shm);
+
+/**
+ * Publish the state of the room in slot index. Each slot must have a
+ * single writer at a time.
+ */
+void stats_shm_publish(StatsShm *shm, int index, const StatsShmRoomState *state);
+
+/**
+ * Copy the last state published in slot index, retrying while the writer
+ * is changing it.
+ *
+ * @return 0 on success, -EAGAIN if the slot stayed inconsistent, e.g. the
+ *         writer died while changing it
+ */
+int stats_shm_read(const StatsShm *shm, int index, StatsShmRoomState *state);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
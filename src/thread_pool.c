@@ -0,0 +1,160 @@
+/**
+ * @file
+ * Implementation of the worker thread pool.
+ */
+
+#include <pthread.h>
+
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+
+#include "thread_pool.h"
+
+typedef struct PoolTask {
+    void (*func)(void *arg);
+    void *arg;
+    struct PoolTask *next;
+} PoolTask;
+
+struct ThreadPool {
+    pthread_t *threads;
+    int nb_threads;
+
+    pthread_mutex_t lock;
+    pthread_cond_t task_cond;
+    pthread_cond_t idle_cond;
+
+    PoolTask *head;
+    PoolTask *tail;
+    int pending;
+    int exiting;
+};
+
+static void *pool_worker(void *arg)
+{
+    ThreadPool *pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        PoolTask *task;
+
+        while (!pool->head && !pool->exiting)
+            pthread_cond_wait(&pool->task_cond, &pool->lock);
+
+        if (!pool->head)
+            break;
+
+        task = pool->head;
+        pool->head = task->next;
+        if (!pool->head)
+            pool->tail = NULL;
+        pthread_mutex_unlock(&pool->lock);
+
+        task->func(task->arg);
+        av_free(task);
+
+        pthread_mutex_lock(&pool->lock);
+        if (!--pool->pending)
+            pthread_cond_broadcast(&pool->idle_cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+ThreadPool *thread_pool_create(int nb_threads)
+{
+    ThreadPool *pool;
+
+    if (nb_threads <= 0)
+        return NULL;
+
+    pool = av_mallocz(sizeof(*pool));
+    if (!pool)
+        return NULL;
+
+    pool->threads = av_mallocz_array(nb_threads, sizeof(*pool->threads));
+    if (!pool->threads) {
+        av_free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->task_cond, NULL);
+    pthread_cond_init(&pool->idle_cond, NULL);
+
+    for (; pool->nb_threads < nb_threads; pool->nb_threads++) {
+        if (pthread_create(&pool->threads[pool->nb_threads], NULL,
+                           pool_worker, pool)) {
+            thread_pool_free(&pool);
+            return NULL;
+        }
+    }
+
+    return pool;
+}
+
+int thread_pool_submit(ThreadPool *pool, void (*func)(void *arg), void *arg)
+{
+    PoolTask *task = av_mallocz(sizeof(*task));
+    if (!task)
+        return AVERROR(ENOMEM);
+
+    task->func = func;
+    task->arg  = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tail)
+        pool->tail->next = task;
+    else
+        pool->head = task;
+    pool->tail = task;
+    pool->pending++;
+    pthread_cond_signal(&pool->task_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    return 0;
+}
+
+int thread_pool_pending(ThreadPool *pool)
+{
+    int pending;
+
+    pthread_mutex_lock(&pool->lock);
+    pending = pool->pending;
+    pthread_mutex_unlock(&pool->lock);
+
+    return pending;
+}
+
+void thread_pool_wait(ThreadPool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending)
+        pthread_cond_wait(&pool->idle_cond, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void thread_pool_free(ThreadPool **ppool)
+{
+    ThreadPool *pool = *ppool;
+    int i;
+
+    if (!pool)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->exiting = 1;
+    pthread_cond_broadcast(&pool->task_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->nb_threads; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_cond_destroy(&pool->idle_cond);
+    pthread_cond_destroy(&pool->task_cond);
+    pthread_mutex_destroy(&pool->lock);
+
+    av_freep(&pool->threads);
+    av_freep(ppool);
+}
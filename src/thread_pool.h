@@ -0,0 +1,49 @@
+/**
+ * @file
+ * Fixed-size pool of worker threads consuming a FIFO of tasks.
+ */
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct ThreadPool ThreadPool;
+
+/**
+ * Start a pool of nb_threads workers.
+ *
+ * @return the new pool, or NULL on failure
+ */
+ThreadPool *thread_pool_create(int nb_threads);
+
+/**
+ * Queue func(arg) to run on one of the workers.
+ *
+ * @return 0 on success, a negative AVERROR code otherwise
+ */
+int thread_pool_submit(ThreadPool *pool, void (*func)(void *arg), void *arg);
+
+/**
+ * @return number of tasks queued or running
+ */
+int thread_pool_pending(ThreadPool *pool);
+
+/**
+ * Block until every submitted task has returned.
+ */
+void thread_pool_wait(ThreadPool *pool);
+
+/**
+ * Run the remaining tasks, join the workers, free the pool and set *pool
+ * to NULL.
+ */
+void thread_pool_free(ThreadPool **pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,26 @@
+/**
+ * @file
+ * Static tracepoints for perf, bpftrace or SystemTap.
+ *
+ * Built with <sys/sdt.h> (systemtap-sdt-dev), TRACE_PROBE(provider, name,
+ * ...) is a USDT probe: a single nop and an ELF note describing where its
+ * arguments live, so that it costs nothing until a tracer attaches, e.g.
+ *
+ *     bpftrace -e 'usdt:./bili-live:remux:packet_write { @[str(arg0)] = hist(arg4); }'
+ *
+ * Without it, probes compile to nothing and their arguments are not
+ * evaluated. Arguments are integers or pointers, up to 12 of them.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#if HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define TRACE_PROBE(provider, name, ...) STAP_PROBEV(provider, name, ##__VA_ARGS__)
+#else
+#define TRACE_PROBE(provider, name, ...) do { } while (0)
+#endif
+
+#endif
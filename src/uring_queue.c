@@ -0,0 +1,352 @@
+/**
+ * @file
+ * Implementation of the shared io_uring write queue.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+
+#include <libavutil/error.h>
+#include <libavutil/log.h>
+#include <libavutil/mem.h>
+
+#include "uring_queue.h"
+
+#if HAVE_LIBURING
+
+#include <liburing.h>
+
+#define QUEUE_ENTRIES   256
+#define QUEUE_BATCH     64
+
+typedef struct UringQueue {
+    struct io_uring ring;
+    pthread_mutex_t submit_lock;
+
+    /* guards the pending counters of every file */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int inflight;
+    int max_inflight;
+    int error;              ///< set once the completion thread has stopped
+
+    pthread_t thread;
+} UringQueue;
+
+struct UringFile {
+    UringQueue *q;
+    int fd;
+    int pending;
+    int64_t pending_bytes;
+    int error;
+};
+
+typedef struct UringRequest {
+    UringFile *file;
+    uint8_t *data;          ///< NULL for a sync
+    int size;
+    int done;
+    int64_t offset;
+} UringRequest;
+
+static UringQueue *queue;
+static pthread_once_t queue_once = PTHREAD_ONCE_INIT;
+
+static int queue_submit(UringQueue *q, UringRequest *req)
+{
+    struct io_uring_sqe *sqe;
+    int ret;
+
+    pthread_mutex_lock(&q->submit_lock);
+
+    sqe = io_uring_get_sqe(&q->ring);
+    if (!sqe) {
+        /* submission queue full, hand it to the kernel and retry */
+        io_uring_submit(&q->ring);
+        sqe = io_uring_get_sqe(&q->ring);
+    }
+    if (!sqe) {
+        pthread_mutex_unlock(&q->submit_lock);
+        return AVERROR(EBUSY);
+    }
+
+    if (req->data)
+        io_uring_prep_write(sqe, req->file->fd, req->data + req->done,
+                            req->size - req->done, req->offset + req->done);
+    else {
+        io_uring_prep_fsync(sqe, req->file->fd, IORING_FSYNC_DATASYNC);
+        /* requests run out of order, the sync must not pass earlier writes */
+        io_uring_sqe_set_flags(sqe, IOSQE_IO_DRAIN);
+    }
+    io_uring_sqe_set_data(sqe, req);
+
+    ret = io_uring_submit(&q->ring);
+    pthread_mutex_unlock(&q->submit_lock);
+
+    return ret < 0 ? AVERROR(-ret) : 0;
+}
+
+/* Account for a finished request. Called with q->lock held. */
+static void queue_finish(UringQueue *q, UringRequest *req, int error)
+{
+    UringFile *f = req->file;
+
+    if (error && !f->error)
+        f->error = error;
+    f->pending--;
+    f->pending_bytes -= req->size;
+    q->inflight--;
+
+    av_free(req->data);
+    av_free(req);
+}
+
+/* Returns whether the request is finished. */
+static int queue_complete(UringQueue *q, UringRequest *req, int res)
+{
+    if (res == -EINTR || res == -EAGAIN)
+        res = 0;
+    else if (res < 0)
+        return AVERROR(-res);
+
+    if (req->data) {
+        req->done += res;
+        if (req->done < req->size) {
+            /* short write, queue the rest */
+            return queue_submit(q, req) < 0 ? AVERROR(EIO) : 0;
+        }
+    }
+
+    return 1;
+}
+
+static void *queue_thread(void *arg)
+{
+    UringQueue *q = arg;
+    struct io_uring_cqe *cqes[QUEUE_BATCH];
+
+    for (;;) {
+        struct io_uring_cqe *cqe;
+        unsigned int i, n;
+        int ret;
+
+        ret = io_uring_wait_cqe(&q->ring, &cqe);
+        if (ret == -EINTR)
+            continue;
+        if (ret < 0) {
+            av_log(NULL, AV_LOG_ERROR, "io_uring completion thread stopped: %s\n",
+                   av_err2str(AVERROR(-ret)));
+
+            /* nothing reaps the requests in flight anymore, fail their files */
+            pthread_mutex_lock(&q->lock);
+            q->error = AVERROR(-ret);
+            pthread_cond_broadcast(&q->cond);
+            pthread_mutex_unlock(&q->lock);
+            break;
+        }
+
+        n = io_uring_peek_batch_cqe(&q->ring, cqes, QUEUE_BATCH);
+
+        pthread_mutex_lock(&q->lock);
+        for (i = 0; i < n; i++) {
+            UringRequest *req = io_uring_cqe_get_data(cqes[i]);
+
+            ret = queue_complete(q, req, cqes[i]->res);
+            if (ret)
+                queue_finish(q, req, ret < 0 ? ret : 0);
+        }
+        pthread_cond_broadcast(&q->cond);
+        pthread_mutex_unlock(&q->lock);
+
+        io_uring_cq_advance(&q->ring, n);
+    }
+
+    return NULL;
+}
+
+static void queue_init(void)
+{
+    UringQueue *q = av_mallocz(sizeof(*q));
+
+    if (!q)
+        return;
+
+    if (io_uring_queue_init(QUEUE_ENTRIES, &q->ring, 0) < 0) {
+        av_free(q);
+        return;
+    }
+    /* never have more completions in flight than the CQ holds */
+    q->max_inflight = *q->ring.cq.kring_entries;
+
+    pthread_mutex_init(&q->submit_lock, NULL);
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->cond, NULL);
+
+    if (pthread_create(&q->thread, NULL, queue_thread, q)) {
+        io_uring_queue_exit(&q->ring);
+        av_free(q);
+        return;
+    }
+    pthread_detach(q->thread);
+
+    queue = q;
+}
+
+/**
+ * Check the queue after its completion thread stopped. Requests of f still
+ * pending will never complete, so f takes the error of the queue; a file
+ * with nothing in flight can go on without io_uring. Called with q->lock
+ * held.
+ */
+static int queue_check(UringQueue *q, UringFile *f)
+{
+    if (!q->error)
+        return 0;
+    if (f->pending && !f->error)
+        f->error = q->error;
+    return f->error ? f->error : AVERROR(ENOSYS);
+}
+
+UringFile *uring_file_open(int fd)
+{
+    UringFile *f;
+    int error;
+
+    pthread_once(&queue_once, queue_init);
+    if (!queue)
+        return NULL;
+
+    pthread_mutex_lock(&queue->lock);
+    error = queue->error;
+    pthread_mutex_unlock(&queue->lock);
+    if (error)
+        return NULL;
+
+    f = av_mallocz(sizeof(*f));
+    if (!f)
+        return NULL;
+    f->q = queue;
+    f->fd = fd;
+
+    return f;
+}
+
+static int file_queue(UringFile *f, UringRequest *req)
+{
+    UringQueue *q = f->q;
+    int ret;
+
+    pthread_mutex_lock(&q->lock);
+    while (!f->error && !q->error && (q->inflight >= q->max_inflight ||
+           (f->pending && f->pending_bytes + req->size > URING_MAX_PENDING_BYTES)))
+        pthread_cond_wait(&q->cond, &q->lock);
+
+    ret = f->error ? f->error : queue_check(q, f);
+    if (!ret) {
+        f->pending++;
+        f->pending_bytes += req->size;
+        q->inflight++;
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    if (ret < 0) {
+        av_free(req->data);
+        av_free(req);
+        return ret;
+    }
+
+    ret = queue_submit(q, req);
+    if (ret < 0) {
+        pthread_mutex_lock(&q->lock);
+        queue_finish(q, req, ret);
+        pthread_cond_broadcast(&q->cond);
+        pthread_mutex_unlock(&q->lock);
+    }
+
+    return ret;
+}
+
+int uring_file_write(UringFile *f, const uint8_t *buf, int size, int64_t offset)
+{
+    UringRequest *req = av_mallocz(sizeof(*req));
+
+    if (!req)
+        return AVERROR(ENOMEM);
+
+    req->data = av_malloc(size);
+    if (!req->data) {
+        av_free(req);
+        return AVERROR(ENOMEM);
+    }
+    memcpy(req->data, buf, size);
+    req->file = f;
+    req->size = size;
+    req->offset = offset;
+
+    return file_queue(f, req);
+}
+
+int uring_file_datasync(UringFile *f)
+{
+    UringRequest *req = av_mallocz(sizeof(*req));
+
+    if (!req)
+        return AVERROR(ENOMEM);
+    req->file = f;
+
+    return file_queue(f, req);
+}
+
+int uring_file_wait(UringFile *f)
+{
+    UringQueue *q = f->q;
+    int ret;
+
+    pthread_mutex_lock(&q->lock);
+    while (f->pending && !q->error)
+        pthread_cond_wait(&q->cond, &q->lock);
+    ret = f->error;
+    if (!ret && f->pending)
+        ret = queue_check(q, f);
+    pthread_mutex_unlock(&q->lock);
+
+    return ret;
+}
+
+#else
+
+UringFile *uring_file_open(int fd)
+{
+    return NULL;
+}
+
+int uring_file_write(UringFile *f, const uint8_t *buf, int size, int64_t offset)
+{
+    return AVERROR(ENOSYS);
+}
+
+int uring_file_datasync(UringFile *f)
+{
+    return AVERROR(ENOSYS);
+}
+
+int uring_file_wait(UringFile *f)
+{
+    return 0;
+}
+
+#endif
+
+int uring_file_close(UringFile **pf)
+{
+    int ret;
+
+    if (!*pf)
+        return 0;
+
+    ret = uring_file_wait(*pf);
+    av_freep(pf);
+
+    return ret;
+}
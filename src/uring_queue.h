@@ -0,0 +1,74 @@
+/**
+ * @file
+ * Asynchronous file writes through one io_uring shared by every output.
+ *
+ * Writes are copied and submitted without waiting; a single completion
+ * thread reaps them in batches for all files. Only available when built
+ * with liburing and supported by the kernel.
+ */
+
+#ifndef URING_QUEUE_H
+#define URING_QUEUE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/**
+ * Bytes of one file that may be in flight before a write waits for the
+ * disk to catch up.
+ */
+#define URING_MAX_PENDING_BYTES (64 * 1024 * 1024)
+
+typedef struct UringFile UringFile;
+
+/**
+ * Attach an open file descriptor to the process-wide ring, which is set
+ * up on first use. The caller keeps ownership of fd.
+ *
+ * @return the handle, or NULL if io_uring is not available
+ */
+UringFile *uring_file_open(int fd);
+
+/**
+ * Copy buf and queue its write at offset. Waits only while too many bytes
+ * of this file are in flight.
+ *
+ * @return 0 on success, the error of an earlier write of this file if
+ *         one failed, AVERROR(ENOSYS) if the ring stopped working while
+ *         nothing of this file was in flight, so the caller can write
+ *         synchronously instead, a negative AVERROR code otherwise
+ */
+int uring_file_write(UringFile *f, const uint8_t *buf, int size, int64_t offset);
+
+/**
+ * Queue an fdatasync(2) of the data already written, without waiting.
+ * It starts once every request queued before it has completed.
+ *
+ * @return as uring_file_write()
+ */
+int uring_file_datasync(UringFile *f);
+
+/**
+ * Wait until every queued request of the file has completed. If the ring
+ * stops working first, the requests still in flight are lost and their
+ * file takes the error of the ring.
+ *
+ * @return 0 on success, the first error of a request otherwise
+ */
+int uring_file_wait(UringFile *f);
+
+/**
+ * Wait for the pending requests, then free the handle and set *f to NULL.
+ *
+ * @return as uring_file_wait()
+ */
+int uring_file_close(UringFile **f);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif